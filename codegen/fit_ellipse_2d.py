@@ -0,0 +1,130 @@
+from __future__ import print_function
+from sympy import *
+import sys
+
+# Lets work this out symbolically first and perform python unit test.
+
+# Equation for the ellipse can be written sxx*x^2 + syy*y^2 + sxy*x*y = 1,
+
+sxx,syy,sxy=symbols("sxx,syy,sxy")
+S=Matrix([[sxx],[syy],[sxy]])
+
+x,y=symbols('x,y')
+
+P=Matrix([[x**2, y**2, x*y]])
+
+A = P.transpose()*P
+b = P.transpose()*Matrix([[1]])
+
+# Circle of radius sqrt(2). Sxx=1/h^2, therefore Sxx=1/2
+circle = {x:1, y:1,
+          sxx:Rational(1,2),syy:Rational(1, 2),sxy:0}
+
+if (A*S).evalf(subs=circle)==b.evalf(subs=circle):
+    print("pass")
+else:
+    print("fail")
+    sys.exit(-1)
+
+# Move onto code generation.
+
+pyname=sys.argv[0].split('/')[-1]
+
+# Write source file
+cxxname=pyname[:-3]+".cpp"
+
+src="""
+/* Start of code generated by %s. Warning - be careful about modifying
+   any of the generated code directly.  Any changes/fixes should be done
+   in the code generation script generation.
+ */
+"""%(pyname)
+
+# A=P^T P is symmetric so only its upper triangle is accumulated, from
+# the monomials of P evaluated once per edge rather than with pow().
+src += """
+void fit_ellipse(int i, real_t *sm){
+  real_t a[6], b[3];
+  for(int j=0;j<6;j++)
+    a[j] = 0.0;
+  for(int j=0;j<3;j++)
+    b[j] = 0.0;
+
+  for(size_t k=0;k<=_mesh->NNList[i].size();k++){
+    index_t it = k<_mesh->NNList[i].size()?_mesh->NNList[i][k]:i;
+
+    const real_t *X0=_mesh->get_coords(it);
+    real_t x0=X0[0], y0=X0[1];
+    assert(std::isfinite(x0));
+    assert(std::isfinite(y0));
+
+    for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[it].begin();n!=_mesh->NNList[it].end();++n){
+      if(*n<=it)
+	continue;
+      
+      const real_t *X=_mesh->get_coords(*n);
+      real_t x=X[0]-x0, y=X[1]-y0;
+
+      assert(std::isfinite(x));
+      assert(std::isfinite(y));
+
+      // The monomials are even under x -> -x, so no sign flip is needed.
+      real_t p[] = {"""
+src += ", ".join([str(P[0, j]).replace("**2", "*"+str(P[0, j])[0]) for j in range(3)])
+src += """};
+
+"""
+k=0
+for i in range(3):
+    src+="      "
+    for j in range(i, 3):
+        src+="a[%d]+=p[%d]*p[%d]; "%(k, i, j)
+        k+=1
+    src+="\n"
+src+="\n"
+for i in range(3):
+    src+="      b[%d]+=p[%d];\n"%(i, i)
+
+src+="""    }
+  }
+
+  Eigen::Matrix<double, 3, 3> A;
+  for(int j=0, k=0;j<3;j++){
+    for(int l=j;l<3;l++, k++){
+      A(j, l) = a[k];
+      A(l, j) = a[k];
+    }
+  }
+  Eigen::Matrix<double, 3, 1> B;
+  for(int j=0;j<3;j++)
+    B[j] = b[j];
+
+  // A is symmetric positive semi-definite, so use Cholesky unless the
+  // patch is degenerate, in which case fall back to the minimum norm
+  // solution.
+  Eigen::Matrix<double, 3, 1> S;
+  Eigen::LLT< Eigen::Matrix<double, 3, 3> > llt(A);
+  if(llt.isPositiveDefinite() && llt.matrixL().diagonal().cwise().square().minCoeff()>1.0e-8*A.diagonal().maxCoeff()){
+    llt.solve(B, &S);
+  }else{
+    A.svd().solve(B, &S);
+  }
+
+  if(_mesh->NNList[i].size()>=3){
+    sm[0] = S[0]; sm[1] = S[2];
+                  sm[2] = S[1];
+  }else{
+    sm[0] = S[0]; sm[1] = 0;
+                  sm[2] = S[1];
+  }
+
+  return;
+}
+
+/* End of code generated by %s. Warning - be careful about
+   modifying any of the generated code directly.  Any changes/fixes
+   should be done in the code generation script generation.*/\n"""%pyname
+
+cxxfile = open(cxxname, "w")
+cxxfile.write(src)
+cxxfile.close()
@@ -40,23 +40,27 @@ src="""
  */
 """%(pyname)
 
+# A=P^T P is symmetric so only its upper triangle is accumulated, from
+# the monomials of P evaluated once per edge rather than with pow().
 src += """
 void fit_ellipsoid(int i, real_t *sm){
-  Eigen::Matrix<double, 6, 6> A = Eigen::Matrix<real_t, 6, 6>::Zero(6,6);
-  Eigen::Matrix<double, 6, 1> b = Eigen::Matrix<real_t, 6, 1>::Zero(6);
+  real_t a[21], b[6];
+  for(int j=0;j<21;j++)
+    a[j] = 0.0;
+  for(int j=0;j<6;j++)
+    b[j] = 0.0;
 
-  std::vector<index_t> nodes = _mesh->NNList[i];
-  nodes.push_back(i);
+  for(size_t k=0;k<=_mesh->NNList[i].size();k++){
+    index_t it = k<_mesh->NNList[i].size()?_mesh->NNList[i][k]:i;
 
-  for(typename std::vector<index_t>::const_iterator it=nodes.begin();it!=nodes.end();++it){
-    const real_t *X0=_mesh->get_coords(*it);
+    const real_t *X0=_mesh->get_coords(it);
     real_t x0=X0[0], y0=X0[1], z0=X0[2];
     assert(std::isfinite(x0));
     assert(std::isfinite(y0));
     assert(std::isfinite(z0));
 
-    for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[*it].begin();n!=_mesh->NNList[*it].end();++n){
-      if(*n<=*it)
+    for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[it].begin();n!=_mesh->NNList[it].end();++n){
+      if(*n<=it)
 	continue;
       
       const real_t *X=_mesh->get_coords(*n);
@@ -65,29 +69,48 @@ void fit_ellipsoid(int i, real_t *sm){
       assert(std::isfinite(x));
       assert(std::isfinite(y));
       assert(std::isfinite(z));
-      if(x<0){
-        x*=-1;
-        y*=-1;
-        z*=-1;
-      }
-      """
 
+      // The monomials are even under x -> -x, so no sign flip is needed.
+      real_t p[] = {"""
+src += ", ".join([str(P[0, j]).replace("**2", "*"+str(P[0, j])[0]) for j in range(6)])
+src += """};
+
+"""
+k=0
 for i in range(6):
     src+="      "
-    for j in range(6):
-        src+="A[%d]+="%(i*6+j)+ccode(A[i,j], contract=False)+"; "
+    for j in range(i, 6):
+        src+="a[%d]+=p[%d]*p[%d]; "%(k, i, j)
+        k+=1
     src+="\n"
-
+src+="\n"
 for i in range(6):
-    src+="b[%d]+="%(i)+ccode(b[i], contract=False)+";\n"
+    src+="      b[%d]+=p[%d];\n"%(i, i)
 
-src+="""
-    }
+src+="""    }
   }
 
-  Eigen::Matrix<double, 6, 1> S = Eigen::Matrix<real_t, 6, 1>::Zero(6);
-
-  A.svd().solve(b, &S);
+  Eigen::Matrix<double, 6, 6> A;
+  for(int j=0, k=0;j<6;j++){
+    for(int l=j;l<6;l++, k++){
+      A(j, l) = a[k];
+      A(l, j) = a[k];
+    }
+  }
+  Eigen::Matrix<double, 6, 1> B;
+  for(int j=0;j<6;j++)
+    B[j] = b[j];
+
+  // A is symmetric positive semi-definite, so use Cholesky unless the
+  // patch is degenerate, in which case fall back to the minimum norm
+  // solution.
+  Eigen::Matrix<double, 6, 1> S;
+  Eigen::LLT< Eigen::Matrix<double, 6, 6> > llt(A);
+  if(llt.isPositiveDefinite() && llt.matrixL().diagonal().cwise().square().minCoeff()>1.0e-8*A.diagonal().maxCoeff()){
+    llt.solve(B, &S);
+  }else{
+    A.svd().solve(B, &S);
+  }
 
   if(_mesh->NNList[i].size()>=6){
     sm[0] = S[0]; sm[1] = S[5]; sm[2] = S[4];
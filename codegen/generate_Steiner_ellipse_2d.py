@@ -0,0 +1,180 @@
+from __future__ import print_function
+from sympy import *
+import sys
+
+# Lets work this out symbolically first and perform python unit test.
+
+# From http://en.wikipedia.org/wiki/Steiner_ellipse
+x1=symbols('x1[:2]')
+x2=symbols('x2[:2]')
+x3=symbols('x3[:2]')
+
+M = Matrix([
+    [(x1[0] - x2[0])**2, (x1[1] - x2[1])**2, (x1[0] - x2[0])*(x1[1] - x2[1])],
+    [(x2[0] - x3[0])**2, (x2[1] - x3[1])**2, (x2[0] - x3[0])*(x2[1] - x3[1])],
+    [(x3[0] - x1[0])**2, (x3[1] - x1[1])**2, (x3[0] - x1[0])*(x3[1] - x1[1])]])
+
+R=Matrix([[1], [1], [1]])
+
+# Isosceles triangle with base 2 and height 2*sqrt(3).
+triangle = {x1[0]:1,  x1[1]:0,
+            x2[0]:-1, x2[1]:0,
+            x3[0]:0,  x3[1]:2*sqrt(3)}
+
+Mi = M.evalf(subs=triangle)
+
+Sxx, Syy, Sxy = Mi.inv()*R
+
+SteinerEllipse = Matrix([
+    [Sxx, Sxy],
+    [Sxy, Syy]])
+
+print("SteinerEllipse = ")
+pprint(SteinerEllipse)
+
+# The generated code does not solve this system. Let J be the matrix
+# whose columns are the edges x_k-x_1, k=2..3, so that the rows of J^-1,
+# g_2..g_3, are the gradients of the barycentric coordinates and
+# g_1=-(g_2+g_3). As every edge has unit length in the Steiner metric M,
+# J^T M J is the Gram matrix of the equilateral unit triangle,
+# G=(I+11^T)/2, and M = J^-T G J^-1 = 1/2 sum_k g_k g_k^T.
+J = Matrix([[x[i]-x1[i] for x in (x2, x3)] for i in range(2)]).evalf(subs=triangle)
+Jinv = J.inv()
+g = [-(Jinv[0,:]+Jinv[1,:]), Jinv[0,:], Jinv[1,:]]
+ClosedForm = sum([gk.T*gk for gk in g], zeros(2, 2))/2
+
+if (ClosedForm-SteinerEllipse).norm()>1.0e-12:
+    print("fail")
+    sys.exit(-1)
+
+if abs(Sxx-1./2**2)<1.0e-12 and abs(Syy-1./4**2)<1.0e-12 and abs(Sxy)<1.0e-12:
+    print("pass")
+else:
+    print("fail")
+    sys.exit(-1)
+
+# Move onto code generation.
+
+pyname=sys.argv[0].split('/')[-1]
+
+# Body of the kernel for element e of a block of n elements.
+kernel = ""
+for k in range(2):
+    for i in range(2):
+        kernel += "    double J%d%d = x[%d*n+e] - x[%d*n+e];\n"%(i, k, (k+1)*2+i, i)
+kernel += """
+    // Adjugate of J; the rows of J^-1 are the gradients g1..g2.
+    double idet = 1.0/(J00*J11 - J01*J10);
+
+    double g10 =  J11*idet, g11 = -J01*idet;
+    double g20 = -J10*idet, g21 =  J00*idet;
+    double g00 = -g10-g20, g01 = -g11-g21;
+
+"""
+upper = [(0, 0), (0, 1), (1, 1)]
+for j, (p, q) in enumerate(upper):
+    kernel += "    sm[%d*n+e] = 0.5*(%s);\n"%(j, " + ".join(["g%d%d*g%d%d"%(k, p, k, q) for k in range(3)]))
+
+# Write header file
+hname=pyname[:-3]+".h"
+macro = pyname[:-3].upper()+"_H"
+header="""/* Start of code generated by %s. Warning - be careful about modifying
+any of the generated code directly.  Any changes/fixes should be done
+in the code generation script generation.*/\n
+
+#ifndef %s
+#define %s
+
+namespace pragmatic
+{
+
+void generate_Steiner_ellipse(const double *x1, const double *x2, const double *x3, double *sm);
+
+/* Calculate the Steiner ellipses of a block of n triangles. The
+   coordinates are interleaved by element, x[(v*2+d)*n+e] being
+   component d of vertex v of element e, and the metrics are returned
+   as sm[j*n+e], j=0..2, in the same upper triangular order as
+   generate_Steiner_ellipse(). Inlined so that the loop over the block
+   is vectorised.*/
+inline void generate_Steiner_ellipse_block_2d(int n, const double *x, double *sm){
+#pragma omp simd
+  for(int e=0;e<n;e++){
+%s  }
+}
+
+}
+
+#endif
+"""%(pyname, macro, macro, kernel)
+
+hfile = open(hname, 'w')
+hfile.write(header)
+hfile.close()
+
+# Write source file
+cxxname=pyname[:-3]+".cpp"
+
+src="""
+/* Start of code generated by %s. Warning - be careful about modifying
+   any of the generated code directly.  Any changes/fixes should be done
+   in the code generation script generation.
+ */
+
+#include <%s>
+
+"""%(pyname, hname)
+
+src += """
+void pragmatic::generate_Steiner_ellipse(const double *x1, const double *x2, const double *x3, double *sm){
+  // # From http://en.wikipedia.org/wiki/Steiner_ellipse
+
+  double x[6];
+  for(int i=0;i<2;i++){
+    x[i] = x1[i]; x[2+i] = x2[i]; x[4+i] = x3[i];
+  }
+
+  generate_Steiner_ellipse_block_2d(1, x, sm);
+
+  return;
+}
+
+/* End of code generated by %s. Warning - be careful about
+   modifying any of the generated code directly.  Any changes/fixes
+   should be done in the code generation script generation.*/\n"""%pyname
+
+cxxfile = open(cxxname, "w")
+cxxfile.write(src)
+cxxfile.close()
+
+# Write unit test code.
+testname="test_"+pyname[:-3]+".cpp"
+testsrc="""
+#include <cmath>
+#include <cfloat>
+#include <iostream>
+
+#include <%s>
+
+int main(){
+  double x1[]={ 1,  0};
+  double x2[]={-1,  0};
+  double x3[]={ 0,  2*sqrt(3)};
+  double sm[3];
+  pragmatic::generate_Steiner_ellipse(x1, x2, x3, sm);
+
+  // Test
+  if(fabs(sm[0]-1./4)<10*DBL_EPSILON && fabs(sm[1])<10*DBL_EPSILON &&
+                                        fabs(sm[2]-1./16)<10*DBL_EPSILON){
+    std::cout<<"pass"<<std::endl;
+  }else{
+    std::cout<<"fail"<<std::endl;
+  }
+
+  return 0;
+}
+"""%(hname)
+
+testfile = open(testname, "w")
+testfile.write(testsrc)
+testfile.close()
+
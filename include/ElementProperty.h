@@ -250,8 +250,65 @@ class ElementProperty{
     return quality;
   }
 
+  /*! Gradient of the 2D Lipnikov functional with respect to the position
+   * of the first vertex, x0, for a fixed metric.
+   *
+   * @param x0 pointer to 2D position of the moving vertex.
+   * @param x1 pointer to 2D position for second point in triangle.
+   * @param x2 pointer to 2D position for third point in triangle.
+   * @param m0 2x2 metric tensor.
+   * @param grad gradient, dq/dx0.
+   */
+  inline void lipnikov_grad(const double *x0, const double *x1, const double *x2,
+                            const double *m0,
+                            double *grad){
+    double x01 = x0[0] - x1[0];
+    double y01 = x0[1] - x1[1];
+    double x02 = x0[0] - x2[0];
+    double y02 = x0[1] - x2[1];
+    double x21 = x2[0] - x1[0];
+    double y21 = x2[1] - x1[1];
+
+    // Metric weighted edge vectors, M*(x0-x1) and M*(x0-x2).
+    double mx01 = m0[0]*x01 + m0[1]*y01, my01 = m0[1]*x01 + m0[2]*y01;
+    double mx02 = m0[0]*x02 + m0[1]*y02, my02 = m0[1]*x02 + m0[2]*y02;
+
+    double l01 = sqrt(x01*mx01 + y01*my01);
+    double l02 = sqrt(x02*mx02 + y02*my02);
+    double l21 = sqrt(y21*(y21*m0[2] + x21*m0[1]) + x21*(y21*m0[1] + x21*m0[0]));
+    double l = l01 + l02 + l21;
+    double invl = 1.0/l;
+
+    double a = orientation*inv2*(y02*x01 - y01*x02);
+    double s = sqrt(m0[0]*m0[2] - m0[1]*m0[1]);
+
+    double f, df;
+    if(l*inv3 < 3.0*invl){
+      f = l*inv3;
+      df = inv3;
+    }else{
+      f = 3.0*invl;
+      df = -3.0*invl*invl;
+    }
+    double tf = f*(2.0 - f);
+    double F = tf*tf*tf;
+    double dF = 3.0*tf*tf*(2.0 - 2.0*f)*df;
+
+    // q = C*s*a*F/l^2, so dq = C*s*(F/l^2 da + a*(dF/l^2 - 2F/l^3) dl).
+    double ca = lipnikov_const2d*s*F*invl*invl;
+    double cl = lipnikov_const2d*s*a*(dF - 2.0*F*invl)*invl*invl;
+
+    double dax = orientation*inv2*(x1[1] - x2[1]);
+    double day = orientation*inv2*(x2[0] - x1[0]);
+
+    grad[0] = ca*dax + cl*(mx01/l01 + mx02/l02);
+    grad[1] = ca*day + cl*(my01/l01 + my02/l02);
+
+    return;
+  }
+
   // Gradient of lipnikov functional n0 using a central difference approximation.
-  inline void lipnikov_grad(int moving,
+  inline void lipnikov_grad_fd(int moving,
 		     const double *x0, const double *x1, const double *x2,
 		     const double *m0,
 		     double *grad){
@@ -427,8 +484,207 @@ class ElementProperty{
   }
 
 
+  /*! Evaluates the 2D Lipnikov functional for a batch of elements. The
+   * vertex data is stored as a structure of arrays so that the loop over
+   * the elements in the batch vectorises.
+   *
+   * @param n number of elements in the batch, at most batch_size.
+   * @param x x[(2*i+k)*batch_size+e] is coordinate k of vertex i of element e.
+   * @param m m[(3*i+k)*batch_size+e] is metric component k at vertex i of element e.
+   * @param quality quality of each element in the batch.
+   */
+  inline void lipnikov_batch2d(int n, const double *x, const double *m, double *quality){
+    const int B = batch_size;
+    const double o = orientation;
+
+#pragma omp simd
+    for(int e=0;e<n;e++){
+      // Metric tensor averaged over the element
+      double m00 = (m[0*B+e] + m[3*B+e] + m[6*B+e])*inv3;
+      double m01 = (m[1*B+e] + m[4*B+e] + m[7*B+e])*inv3;
+      double m11 = (m[2*B+e] + m[5*B+e] + m[8*B+e])*inv3;
+
+      double x01 = x[0*B+e] - x[2*B+e];
+      double y01 = x[1*B+e] - x[3*B+e];
+      double x02 = x[0*B+e] - x[4*B+e];
+      double y02 = x[1*B+e] - x[5*B+e];
+      double x21 = x[4*B+e] - x[2*B+e];
+      double y21 = x[5*B+e] - x[3*B+e];
+
+      double l =
+        sqrt(y01*(y01*m11 + x01*m01) +
+             x01*(y01*m01 + x01*m00))+
+        sqrt(y02*(y02*m11 + x02*m01) +
+             x02*(y02*m01 + x02*m00))+
+        sqrt(y21*(y21*m11 + x21*m01) +
+             x21*(y21*m01 + x21*m00));
+
+      double invl = 1.0/l;
+
+      double a = o*inv2*(y02*x01 - y01*x02);
+      double a_m = a*sqrt(m00*m11 - m01*m01);
+
+      double f = std::min(l*inv3, 3.0*invl);
+      double tf = f * (2.0 - f);
+      double F = tf*tf*tf;
+      quality[e] = lipnikov_const2d*a_m*F*invl*invl;
+    }
+  }
+
+  /*! Evaluates the 3D Lipnikov functional for a batch of elements. The
+   * vertex data is stored as a structure of arrays so that the loop over
+   * the elements in the batch vectorises.
+   *
+   * @param n number of elements in the batch, at most batch_size.
+   * @param x x[(3*i+k)*batch_size+e] is coordinate k of vertex i of element e.
+   * @param m m[(6*i+k)*batch_size+e] is metric component k at vertex i of element e.
+   * @param quality quality of each element in the batch.
+   */
+  inline void lipnikov_batch3d(int n, const double *x, const double *m, double *quality){
+    const int B = batch_size;
+    const double o = orientation;
+
+#pragma omp simd
+    for(int e=0;e<n;e++){
+      // Metric tensor
+      double m00 = (m[0*B+e] + m[6*B+e] + m[12*B+e] + m[18*B+e])*inv4;
+      double m01 = (m[1*B+e] + m[7*B+e] + m[13*B+e] + m[19*B+e])*inv4;
+      double m02 = (m[2*B+e] + m[8*B+e] + m[14*B+e] + m[20*B+e])*inv4;
+      double m11 = (m[3*B+e] + m[9*B+e] + m[15*B+e] + m[21*B+e])*inv4;
+      double m12 = (m[4*B+e] + m[10*B+e] + m[16*B+e] + m[22*B+e])*inv4;
+      double m22 = (m[5*B+e] + m[11*B+e] + m[17*B+e] + m[23*B+e])*inv4;
+
+      double z01 = (x[2*B+e] - x[5*B+e]);
+      double y01 = (x[1*B+e] - x[4*B+e]);
+      double x01 = (x[0*B+e] - x[3*B+e]);
+
+      double z12 = (x[5*B+e] - x[8*B+e]);
+      double y12 = (x[4*B+e] - x[7*B+e]);
+      double x12 = (x[3*B+e] - x[6*B+e]);
+
+      double z02 = (x[2*B+e] - x[8*B+e]);
+      double y02 = (x[1*B+e] - x[7*B+e]);
+      double x02 = (x[0*B+e] - x[6*B+e]);
+
+      double z03 = (x[2*B+e] - x[11*B+e]);
+      double y03 = (x[1*B+e] - x[10*B+e]);
+      double x03 = (x[0*B+e] - x[9*B+e]);
+
+      double z13 = (x[5*B+e] - x[11*B+e]);
+      double y13 = (x[4*B+e] - x[10*B+e]);
+      double x13 = (x[3*B+e] - x[9*B+e]);
+
+      double z23 = (x[8*B+e] - x[11*B+e]);
+      double y23 = (x[7*B+e] - x[10*B+e]);
+      double x23 = (x[6*B+e] - x[9*B+e]);
+
+      double dl0 = (z01*(z01*m22 + y01*m12 + x01*m02) + y01*(z01*m12 + y01*m11 + x01*m01) + x01*(z01*m02 + y01*m01 + x01*m00));
+      double dl1 = (z12*(z12*m22 + y12*m12 + x12*m02) + y12*(z12*m12 + y12*m11 + x12*m01) + x12*(z12*m02 + y12*m01 + x12*m00));
+      double dl2 = (z02*(z02*m22 + y02*m12 + x02*m02) + y02*(z02*m12 + y02*m11 + x02*m01) + x02*(z02*m02 + y02*m01 + x02*m00));
+      double dl3 = (z03*(z03*m22 + y03*m12 + x03*m02) + y03*(z03*m12 + y03*m11 + x03*m01) + x03*(z03*m02 + y03*m01 + x03*m00));
+      double dl4 = (z13*(z13*m22 + y13*m12 + x13*m02) + y13*(z13*m12 + y13*m11 + x13*m01) + x13*(z13*m02 + y13*m01 + x13*m00));
+      double dl5 = (z23*(z23*m22 + y23*m12 + x23*m02) + y23*(z23*m12 + y23*m11 + x23*m01) + x23*(z23*m02 + y23*m01 + x23*m00));
+
+      double l = sqrt(dl0)+sqrt(dl1)+sqrt(dl2)+sqrt(dl3)+sqrt(dl4)+sqrt(dl5);
+      double invl = 1.0/l;
+
+      double v = o*inv6*(-x03*(z02*y01 - z01*y02) + x02*(z03*y01 - z01*y03) - x01*(z03*y02 - z02*y03));
+      double v_m = v*sqrt(((m11*m22 - m12*m12)*m00 - (m01*m22 - m02*m12)*m01 + (m01*m12 - m02*m11)*m02));
+
+      double f = std::min(l*inv6, 6*invl);
+      double tf = f * (2.0 - f);
+      double F = tf*tf*tf;
+      quality[e] = lipnikov_const3d * v_m * F *invl*invl*invl;
+    }
+  }
+
+  /*! Gradient of the 3D Lipnikov functional with respect to the position
+   * of the first vertex, x0, for a fixed metric.
+   *
+   * @param x0 pointer to 3D position of the moving vertex.
+   * @param x1 pointer to 3D position for second point in tetrahedral.
+   * @param x2 pointer to 3D position for third point in tetrahedral.
+   * @param x3 pointer to 3D position for forth point in tetrahedral.
+   * @param m0 3x3 metric tensor.
+   * @param grad gradient, dq/dx0.
+   */
+  inline void lipnikov_grad(const double *x0, const double *x1, const double *x2, const double *x3,
+                            const double *m0,
+                            double *grad){
+    double m00 = m0[0];
+    double m01 = m0[1];
+    double m02 = m0[2];
+    double m11 = m0[3];
+    double m12 = m0[4];
+    double m22 = m0[5];
+
+    // Edges from x0, and the metric weighted edge vectors M*(x0-xi).
+    const double *xi[] = {x1, x2, x3};
+    double mv[3][3], li[3];
+    double l = 0;
+    for(int i=0;i<3;i++){
+      double x = x0[0] - xi[i][0];
+      double y = x0[1] - xi[i][1];
+      double z = x0[2] - xi[i][2];
+
+      mv[i][0] = x*m00 + y*m01 + z*m02;
+      mv[i][1] = x*m01 + y*m11 + z*m12;
+      mv[i][2] = x*m02 + y*m12 + z*m22;
+
+      li[i] = sqrt(x*mv[i][0] + y*mv[i][1] + z*mv[i][2]);
+      l += li[i];
+    }
+
+    // Edges of the opposite face, which do not move.
+    double z12 = (x1[2] - x2[2]);
+    double y12 = (x1[1] - x2[1]);
+    double x12 = (x1[0] - x2[0]);
+
+    double z13 = (x1[2] - x3[2]);
+    double y13 = (x1[1] - x3[1]);
+    double x13 = (x1[0] - x3[0]);
+
+    double z23 = (x2[2] - x3[2]);
+    double y23 = (x2[1] - x3[1]);
+    double x23 = (x2[0] - x3[0]);
+
+    l += sqrt(z12*(z12*m22 + y12*m12 + x12*m02) + y12*(z12*m12 + y12*m11 + x12*m01) + x12*(z12*m02 + y12*m01 + x12*m00));
+    l += sqrt(z13*(z13*m22 + y13*m12 + x13*m02) + y13*(z13*m12 + y13*m11 + x13*m01) + x13*(z13*m02 + y13*m01 + x13*m00));
+    l += sqrt(z23*(z23*m22 + y23*m12 + x23*m02) + y23*(z23*m12 + y23*m11 + x23*m01) + x23*(z23*m02 + y23*m01 + x23*m00));
+    double invl = 1.0/l;
+
+    // Volume, and its gradient, -(x2-x1)x(x3-x1)/6.
+    double v = volume(x0, x1, x2, x3);
+    double dv[] = {-orientation*inv6*(y12*z13 - z12*y13),
+                   -orientation*inv6*(z12*x13 - x12*z13),
+                   -orientation*inv6*(x12*y13 - y12*x13)};
+
+    double s = sqrt(((m11*m22 - m12*m12)*m00 - (m01*m22 - m02*m12)*m01 + (m01*m12 - m02*m11)*m02));
+
+    double f, df;
+    if(l*inv6 < 6*invl){
+      f = l*inv6;
+      df = inv6;
+    }else{
+      f = 6*invl;
+      df = -6*invl*invl;
+    }
+    double tf = f*(2.0 - f);
+    double F = tf*tf*tf;
+    double dF = 3.0*tf*tf*(2.0 - 2.0*f)*df;
+
+    // q = C*s*v*F/l^3, so dq = C*s*(F/l^3 dv + v*(dF/l^3 - 3F/l^4) dl).
+    double cv = lipnikov_const3d*s*F*invl*invl*invl;
+    double cl = lipnikov_const3d*s*v*(dF - 3.0*F*invl)*invl*invl*invl;
+
+    for(int j=0;j<3;j++)
+      grad[j] = cv*dv[j] + cl*(mv[0][j]/li[0] + mv[1][j]/li[1] + mv[2][j]/li[2]);
+
+    return;
+  }
+
   // Gradient of lipnikov functional n0 using a central difference approximation.
-  inline void lipnikov_grad(int moving,
+  inline void lipnikov_grad_fd(int moving,
 		     const double *x0, const double *x1, const double *x2, const double *x3,
 		     const double *m0,
 		     double *grad){
@@ -687,6 +943,9 @@ class ElementProperty{
 	return orientation;
   }
 
+  /// Number of elements evaluated together by the batched functions.
+  static const int batch_size = 8;
+
  private:
   const double inv2;
   const double inv3;
@@ -37,8 +37,11 @@
 #ifndef HALOEXCHANGE_H
 #define HALOEXCHANGE_H
 
-#include <vector>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <map>
+#include <vector>
 
 #include "PragmaticTypes.h"
 #include "mpi_tools.h"
@@ -172,4 +175,414 @@ template <typename DATATYPE, int block0, int block1>
   return;
 }
 
+/*! \brief Persistent halo exchange.
+ *
+ * Built once from the send/recv lists of a mesh. Only the processes
+ * that share a halo with this one are communicated with, and the node
+ * lists are flattened. The message buffers and persistent requests are
+ * kept between exchanges. A set of buffers and requests is created for
+ * each item size, sizeof(DATATYPE)*block, the first time it is used.
+ * begin() packs the send buffers and starts the requests; end()
+ * completes them and unpacks the halo, so interior work can be done in
+ * between.
+ *
+ * With MPI-3, neighbours on the same node are exchanged through shared
+ * memory rather than messages. Each process packs the values for such
+ * a neighbour into a double buffered MPI shared memory window, and the
+ * neighbour unpacks its halo straight out of that window once a zero
+ * byte message says the values are ready.
+ *
+ * The constructor is collective over comm, and so are set_halo() and
+ * set_shared_memory(), which create the communicators shared with new
+ * neighbours on the node and recreate the windows whose number of values
+ * has changed. A window for a new item size is created by the first
+ * exchange of that size with each neighbour, so neighbouring processes
+ * have to start the first exchange of each item size in the same order.
+ * Later exchanges can be in any order, as with messages. The destructor
+ * is local; free() releases the shared memory and is collective.
+ */
+class HaloExchanger{
+ public:
+  HaloExchanger(MPI_Comm comm){
+    create_node_comm(comm);
+  }
+
+  HaloExchanger(MPI_Comm comm,
+                const std::vector< std::vector<index_t> > &send,
+                const std::vector< std::vector<index_t> > &recv){
+    create_node_comm(comm);
+    set_halo(send, recv);
+  }
+
+  /*! Release the requests. This is not collective, so the shared memory
+   * windows and communicators are left to MPI_Finalize unless free() has
+   * been called.
+   */
+  ~HaloExchanger(){
+    int finalized;
+    MPI_Finalized(&finalized);
+    if(finalized)
+      return;
+
+    free_channels();
+
+#if MPI_VERSION>=3
+    for(std::map<int, shared_link>::iterator it=links.begin();it!=links.end();++it){
+      for(std::map<size_t, shared_segment>::iterator jt=it->second.segments.begin();jt!=it->second.segments.end();++jt){
+        MPI_Request_free(&(jt->second.token[0]));
+        MPI_Request_free(&(jt->second.token[1]));
+      }
+    }
+#endif
+  }
+
+  /*! Release the shared memory windows and communicators. This is
+   * collective over comm and no exchange may be in flight. Afterwards all
+   * neighbours are exchanged through messages.
+   */
+  void free(){
+    free_channels();
+
+#if MPI_VERSION>=3
+    // Each pair frees its windows together, in order of neighbour, so
+    // this cannot deadlock.
+    for(std::map<int, shared_link>::iterator it=links.begin();it!=links.end();++it){
+      for(std::map<size_t, shared_segment>::iterator jt=it->second.segments.begin();jt!=it->second.segments.end();++jt)
+        free_segment(jt->second);
+      MPI_Comm_free(&(it->second.comm));
+    }
+    links.clear();
+
+    if(node_comm!=MPI_COMM_NULL)
+      MPI_Comm_free(&node_comm);
+    use_shared_memory = false;
+    update_shared_neighbours();
+#endif
+  }
+
+  /*! Replace the send/recv lists. This is collective over comm. The
+   * shared memory windows are kept unless their number of values changes.
+   */
+  void set_halo(const std::vector< std::vector<index_t> > &send,
+                const std::vector< std::vector<index_t> > &recv){
+    free_channels();
+
+    neighbours.clear();
+    send_nodes.clear();
+    recv_nodes.clear();
+    send_offset.assign(1, 0);
+    recv_offset.assign(1, 0);
+    for(size_t i=0;i<send.size();i++){
+      if(send[i].empty() && recv[i].empty())
+        continue;
+
+      neighbours.push_back(i);
+      send_nodes.insert(send_nodes.end(), send[i].begin(), send[i].end());
+      send_offset.push_back(send_nodes.size());
+      recv_nodes.insert(recv_nodes.end(), recv[i].begin(), recv[i].end());
+      recv_offset.push_back(recv_nodes.size());
+    }
+
+    update_shared_neighbours();
+  }
+
+  /*! Enable or disable the shared memory path for neighbours on the same
+   * node. This is mostly useful for benchmarking; it is collective over
+   * comm and no exchange may be in flight. It has no effect after free().
+   */
+  void set_shared_memory(bool enable){
+#if MPI_VERSION>=3
+    free_channels();
+    use_shared_memory = enable && node_comm!=MPI_COMM_NULL;
+    update_shared_neighbours();
+#endif
+  }
+
+  /// Return the number of neighbours exchanged through shared memory.
+  int get_number_shared_neighbours() const{
+    return std::count(shared.begin(), shared.end(), 1);
+  }
+
+  /// Pack the owned values of vec and start the exchange.
+  template <typename DATATYPE, int block>
+    void begin(const std::vector<DATATYPE> &vec){
+    const size_t item_size = sizeof(DATATYPE)*block;
+    channel &c = get_channel(item_size);
+    assert(!c.active);
+
+    for(size_t k=0;k<neighbours.size();k++){
+      char *buff = c.send_buff.data()+send_offset[k]*item_size;
+#if MPI_VERSION>=3
+      if(shared[k]){
+        c.segment[k] = &get_segment(k, item_size);
+        buff = c.segment[k]->send_buff+c.segment[k]->parity*c.segment[k]->nsend*item_size;
+      }
+#endif
+      for(size_t i=send_offset[k];i<send_offset[k+1];i++, buff+=item_size)
+        memcpy(buff, &(vec[send_nodes[i]*block]), item_size);
+
+#if MPI_VERSION>=3
+      if(shared[k]){
+        MPI_Win_sync(c.segment[k]->win);
+        MPI_Startall(2, c.segment[k]->token);
+      }
+#endif
+    }
+
+    if(!c.request.empty())
+      MPI_Startall(c.request.size(), &(c.request[0]));
+    c.active = true;
+  }
+
+  /// Complete the exchange started by begin() and unpack the halo values of vec.
+  template <typename DATATYPE, int block>
+    void end(std::vector<DATATYPE> &vec){
+    const size_t item_size = sizeof(DATATYPE)*block;
+    channel &c = get_channel(item_size);
+    assert(c.active);
+
+    if(!c.request.empty())
+      MPI_Waitall(c.request.size(), &(c.request[0]), MPI_STATUSES_IGNORE);
+    c.active = false;
+
+    for(size_t k=0;k<neighbours.size();k++){
+      const char *buff = c.recv_buff.data()+recv_offset[k]*item_size;
+#if MPI_VERSION>=3
+      if(shared[k]){
+        // Read the halo values straight from the neighbour's send buffer.
+        shared_segment &s = *(c.segment[k]);
+        MPI_Waitall(2, s.token, MPI_STATUSES_IGNORE);
+        MPI_Win_sync(s.win);
+        buff = s.recv_buff+s.parity*s.nrecv*item_size;
+        s.parity = 1-s.parity;
+      }
+#endif
+      for(size_t i=recv_offset[k];i<recv_offset[k+1];i++, buff+=item_size)
+        memcpy(&(vec[recv_nodes[i]*block]), buff, item_size);
+    }
+  }
+
+  /// Blocking halo update.
+  template <typename DATATYPE, int block>
+    void update(std::vector<DATATYPE> &vec){
+    begin<DATATYPE, block>(vec);
+    end<DATATYPE, block>(vec);
+  }
+
+ private:
+  HaloExchanger(const HaloExchanger&);
+  HaloExchanger& operator=(const HaloExchanger&);
+
+#if MPI_VERSION>=3
+  /*! Shared memory used to send values of one item size to a neighbour.
+   * The send buffer holds two copies of the values, used in turn, so a
+   * process can pack the next exchange while its neighbour may still be
+   * reading the previous one. The neighbour's token for an exchange is
+   * only sent after it has finished reading the one before.
+   */
+  struct shared_segment{
+    MPI_Win win;
+    size_t nsend, nrecv;
+    char *send_buff;
+    const char *recv_buff;
+    MPI_Request token[2];
+    int parity;
+  };
+
+  /// Communicator with a neighbour on the same node, and the segments shared with it.
+  struct shared_link{
+    MPI_Comm comm;
+    std::map<size_t, shared_segment> segments;
+  };
+#else
+  struct shared_segment;
+#endif
+
+  struct channel{
+    std::vector<char> send_buff, recv_buff;
+    std::vector<MPI_Request> request;
+    std::vector<shared_segment*> segment;
+    bool active;
+  };
+
+  /// Find the processes on the same node as this one.
+  void create_node_comm(MPI_Comm comm){
+    _comm = comm;
+
+#if MPI_VERSION>=3
+    use_shared_memory = true;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+
+    int num_processes;
+    MPI_Comm_size(comm, &num_processes);
+    std::vector<int> ranks(num_processes);
+    for(int i=0;i<num_processes;i++)
+      ranks[i] = i;
+    node_rank.resize(num_processes);
+
+    MPI_Group group, node_group;
+    MPI_Comm_group(comm, &group);
+    MPI_Comm_group(node_comm, &node_group);
+    MPI_Group_translate_ranks(group, num_processes, &(ranks[0]), node_group, &(node_rank[0]));
+    MPI_Group_free(&group);
+    MPI_Group_free(&node_group);
+#endif
+  }
+
+  /*! Flag the neighbours which are exchanged through shared memory. A
+   * communicator is created for each new pair, and windows whose number
+   * of values has changed are recreated. Both processes of a pair see the
+   * same changes, and they are handled in order of neighbour and item
+   * size, so the collective calls match up.
+   */
+  void update_shared_neighbours(){
+    shared.assign(neighbours.size(), 0);
+#if MPI_VERSION>=3
+    if(!use_shared_memory)
+      return;
+
+    for(size_t k=0;k<neighbours.size();k++){
+      if(node_rank[neighbours[k]]==MPI_UNDEFINED)
+        continue;
+      shared[k] = 1;
+
+      std::map<int, shared_link>::iterator lt=links.find(neighbours[k]);
+      if(lt==links.end()){
+        create_link(neighbours[k]);
+        continue;
+      }
+
+      std::map<size_t, shared_segment> &segments = lt->second.segments;
+      for(std::map<size_t, shared_segment>::iterator st=segments.begin();st!=segments.end();++st){
+        if(st->second.nsend!=send_offset[k+1]-send_offset[k] ||
+           st->second.nrecv!=recv_offset[k+1]-recv_offset[k]){
+          free_segment(st->second);
+          create_segment(k, st->first, lt->second.comm, st->second);
+        }
+      }
+    }
+#endif
+  }
+
+  /// Get the buffers and persistent requests for an item size, creating them on first use.
+  channel& get_channel(size_t item_size){
+    std::map<size_t, channel>::iterator it=channels.find(item_size);
+    if(it!=channels.end())
+      return it->second;
+
+    channel &c = channels[item_size];
+    c.active = false;
+    c.send_buff.resize(send_nodes.size()*item_size);
+    c.recv_buff.resize(recv_nodes.size()*item_size);
+    c.segment.assign(neighbours.size(), NULL);
+
+    // The item size is used as the tag so that exchanges of different
+    // types can be in flight at the same time.
+    for(size_t k=0;k<neighbours.size();k++){
+      size_t nrecv = recv_offset[k+1]-recv_offset[k];
+      if(nrecv>0 && !shared[k]){
+        c.request.push_back(MPI_REQUEST_NULL);
+        MPI_Recv_init(&(c.recv_buff[recv_offset[k]*item_size]), nrecv*item_size, MPI_BYTE,
+                      neighbours[k], item_size, _comm, &(c.request.back()));
+      }
+    }
+    for(size_t k=0;k<neighbours.size();k++){
+      size_t nsend = send_offset[k+1]-send_offset[k];
+      if(nsend>0 && !shared[k]){
+        c.request.push_back(MPI_REQUEST_NULL);
+        MPI_Send_init(&(c.send_buff[send_offset[k]*item_size]), nsend*item_size, MPI_BYTE,
+                      neighbours[k], item_size, _comm, &(c.request.back()));
+      }
+    }
+
+    return c;
+  }
+
+  void free_channels(){
+    for(std::map<size_t, channel>::iterator it=channels.begin();it!=channels.end();++it){
+      assert(!it->second.active);
+      for(size_t i=0;i<it->second.request.size();i++)
+        MPI_Request_free(&(it->second.request[i]));
+    }
+    channels.clear();
+  }
+
+#if MPI_VERSION>=3
+  /// Create the communicator shared with a neighbour on the node. This is collective over the pair.
+  void create_link(int neighbour){
+    int rank;
+    MPI_Comm_rank(_comm, &rank);
+    int pair[] = {std::min(node_rank[rank], node_rank[neighbour]),
+                  std::max(node_rank[rank], node_rank[neighbour])};
+
+    MPI_Group node_group, pair_group;
+    MPI_Comm_group(node_comm, &node_group);
+    MPI_Group_incl(node_group, 2, pair, &pair_group);
+
+    shared_link &l = links[neighbour];
+    MPI_Comm_create_group(node_comm, pair_group, 0, &(l.comm));
+
+    MPI_Group_free(&pair_group);
+    MPI_Group_free(&node_group);
+  }
+
+  /*! Get the shared memory segment for the k'th neighbour and an item
+   * size, creating it the first time the item size is exchanged with that
+   * neighbour. This is collective over the pair.
+   */
+  shared_segment& get_segment(size_t k, size_t item_size){
+    shared_link &l = links[neighbours[k]];
+    std::map<size_t, shared_segment>::iterator st=l.segments.find(item_size);
+    if(st!=l.segments.end())
+      return st->second;
+
+    shared_segment &s = l.segments[item_size];
+    create_segment(k, item_size, l.comm, s);
+    return s;
+  }
+
+  /// Allocate the window and tokens of a segment for the k'th neighbour.
+  void create_segment(size_t k, size_t item_size, MPI_Comm comm, shared_segment &s){
+    s.nsend = send_offset[k+1]-send_offset[k];
+    s.nrecv = recv_offset[k+1]-recv_offset[k];
+    s.parity = 0;
+
+    int other;
+    MPI_Comm_rank(comm, &other);
+    other = 1-other;
+
+    MPI_Win_allocate_shared(2*s.nsend*item_size, 1, MPI_INFO_NULL, comm, &(s.send_buff), &(s.win));
+
+    MPI_Aint size;
+    int disp_unit;
+    MPI_Win_shared_query(s.win, other, &size, &disp_unit, &(s.recv_buff));
+    assert((size_t)size==2*s.nrecv*item_size);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, s.win);
+
+    MPI_Recv_init(NULL, 0, MPI_BYTE, other, item_size, comm, &(s.token[0]));
+    MPI_Send_init(NULL, 0, MPI_BYTE, other, item_size, comm, &(s.token[1]));
+  }
+
+  void free_segment(shared_segment &s){
+    MPI_Request_free(&(s.token[0]));
+    MPI_Request_free(&(s.token[1]));
+    MPI_Win_unlock_all(s.win);
+    MPI_Win_free(&(s.win));
+  }
+#endif
+
+  MPI_Comm _comm;
+  std::vector<int> neighbours;
+  std::vector<char> shared;
+  std::vector<size_t> send_offset, recv_offset;
+  std::vector<index_t> send_nodes, recv_nodes;
+  std::map<size_t, channel> channels;
+#if MPI_VERSION>=3
+  bool use_shared_memory;
+  MPI_Comm node_comm;
+  std::vector<int> node_rank;
+  std::map<int, shared_link> links;
+#endif
+};
+
 #endif
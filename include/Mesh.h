@@ -143,9 +143,16 @@ template<typename real_t> class Mesh{
   }
 #endif
 
-  /// Default destructor.
+  /*! Default destructor. This is not collective; call
+   * free_halo_exchanger() on all processes first to release the shared
+   * memory used for the halo, otherwise it is only released by
+   * MPI_Finalize.
+   */
   ~Mesh(){
     delete property;
+#ifdef HAVE_MPI
+    delete halo_exchanger;
+#endif
   }
 
   /// Add a new vertex
@@ -187,6 +194,7 @@ template<typename real_t> class Mesh{
 
   void create_boundary(){
     assert(boundary.size()==0);
+    boundary_nodes.clear();
     
     size_t NNodes = get_number_nodes();
     size_t NElements = get_number_elements();
@@ -373,6 +381,36 @@ template<typename real_t> class Mesh{
     return;
   }
 
+  /*! Return flags marking the vertices which lie on the boundary. The flags
+   * are cached: they are recalculated when vertices have been added, and
+   * after create_boundary() or defragment(). Should not be called from
+   * inside a parallel region.
+   */
+  const std::vector<char> &get_boundary_nodes(){
+    if(boundary_nodes.size()!=NNodes){
+      boundary_nodes.resize(NNodes);
+
+#pragma omp parallel for schedule(guided)
+      for(size_t i=0;i<NNodes;i++){
+        char on_boundary=0;
+        for(const auto& e : NEList[i]){
+          const index_t *n=get_element(e);
+          for(size_t j=0;j<nloc;j++){
+            if(n[j]!=(index_t)i && boundary[e*nloc+j]>0){
+              on_boundary = 1;
+              break;
+            }
+          }
+          if(on_boundary)
+            break;
+        }
+        boundary_nodes[i] = on_boundary;
+      }
+    }
+
+    return boundary_nodes;
+  }
+
   /// Returns true if the node is in any of the partitioned elements.
   inline bool is_halo_node(index_t nid) const{
     return (node_owner[nid]!= rank || send_halo.count(nid)>0);
@@ -383,6 +421,30 @@ template<typename real_t> class Mesh{
     return node_owner[nid] == rank;
   }
 
+  /*! Return the number of vertices owned by each process and the global
+   * number of each local vertex. After defragment() the global numbering
+   * is contiguous: process p owns the numbers starting from the sum of
+   * NPNodes[0..p-1], which is suitable for assembling a distributed system.
+   */
+  void get_global_node_numbering(std::vector<int> &NPNodes, std::vector<int> &lnn2gnn){
+    int NPNodes_local = 0;
+    for(size_t i=0;i<NNodes;i++)
+      if(node_owner[i]==rank)
+        NPNodes_local++;
+
+    NPNodes.resize(num_processes);
+#ifdef HAVE_MPI
+    if(num_processes>1)
+      MPI_Allgather(&NPNodes_local, 1, MPI_INT, &(NPNodes[0]), 1, MPI_INT, _mpi_comm);
+    else
+#endif
+      NPNodes[0] = NPNodes_local;
+
+    lnn2gnn.resize(NNodes);
+    for(size_t i=0;i<NNodes;i++)
+      lnn2gnn[i] = this->lnn2gnn[i];
+  }
+
   /// Get the mean edge length metric space.
   double get_lmean(){
     int NNodes = get_number_nodes();
@@ -834,8 +896,73 @@ template<typename real_t> class Mesh{
   MPI_Comm get_mpi_comm() const{
     return _mpi_comm;
   }
+
+  /*! Return the persistent halo exchanger. Its send/recv lists are
+   * updated if the halo has changed since it was last used; code that
+   * changes send/recv has to call invalidate_halo_exchanger().
+   */
+  HaloExchanger& get_halo_exchanger(){
+    if(halo_exchanger_stale){
+      halo_exchanger->set_halo(send, recv);
+      send_halo_flags.clear();
+      halo_exchanger_stale = false;
+    }
+    return *halo_exchanger;
+  }
+
+  /*! Release the shared memory and communicators used to exchange the
+   * halo with processes on the same node. This is collective over the
+   * mesh communicator; later halo updates use messages only.
+   */
+  void free_halo_exchanger(){
+    halo_exchanger->free();
+  }
+
+  /*! Update the halo values of vec, which stores block values per vertex.
+   * The first update of each item size, sizeof(DATATYPE)*block, sets up
+   * shared memory with the neighbours on the same node, so it has to be
+   * started in the same order as on the neighbouring processes.
+   */
+  template <typename DATATYPE, int block>
+    void halo_update(std::vector<DATATYPE> &vec){
+    if(num_processes>1)
+      get_halo_exchanger().template update<DATATYPE, block>(vec);
+  }
+
+  /*! Start a halo update of vec. The values of the vertices returned by
+   * get_send_halo_vertices() are packed, so other vertices can be
+   * computed before halo_update_end() is called. The ordering rule of
+   * halo_update() applies.
+   */
+  template <typename DATATYPE, int block>
+    void halo_update_begin(const std::vector<DATATYPE> &vec){
+    if(num_processes>1)
+      get_halo_exchanger().template begin<DATATYPE, block>(vec);
+  }
+
+  /// Complete a halo update started by halo_update_begin().
+  template <typename DATATYPE, int block>
+    void halo_update_end(std::vector<DATATYPE> &vec){
+    if(num_processes>1)
+      get_halo_exchanger().template end<DATATYPE, block>(vec);
+  }
 #endif
 
+  /*! Owned vertices whose values are sent to other processes. These
+   * have to be computed before a halo update is started; all other
+   * vertices can be computed while it is in flight.
+   */
+  const std::vector<index_t> &get_send_halo_vertices(){
+    update_halo_classification();
+    return send_halo_vertices;
+  }
+
+  /// Flags marking the vertices returned by get_send_halo_vertices().
+  const std::vector<char> &get_send_halo_flags(){
+    update_halo_classification();
+    return send_halo_flags;
+  }
+
   /// Return the node id's connected to the specified node_id
   std::set<index_t> get_node_patch(index_t nid) const{
     assert(nid<(index_t)NNodes);
@@ -921,6 +1048,8 @@ template<typename real_t> class Mesh{
     structures. This is useful if the mesh has been significantly
     coarsened. */
   void defragment(){
+    boundary_nodes.clear();
+
     // Discover which vertices and elements are active.
     std::vector<index_t> active_vertex_map(NNodes);
     
@@ -1074,45 +1203,23 @@ template<typename real_t> class Mesh{
     memcpy(&_coords[0], &defrag_coords[0], NNodes*ndims*sizeof(real_t));
     memcpy(&metric[0], &defrag_metric[0], NNodes*msize*sizeof(double));
 
-    // Renumber halo, fix lnn2gnn and node_owner.
+    // Renumber halo.
     if(num_processes>1){
-      std::vector<index_t> defrag_lnn2gnn(NNodes);
-      std::vector<int> defrag_owner(NNodes);
-
-      for(size_t old_nid=0;old_nid<active_vertex_map.size();++old_nid){
-        index_t new_nid = active_vertex_map[old_nid];
-        if(new_nid<0)
-          continue;
-
-        defrag_lnn2gnn[new_nid] = lnn2gnn[old_nid];
-        defrag_owner[new_nid] = node_owner[old_nid];
-      }
-
-      lnn2gnn.swap(defrag_lnn2gnn);
-      node_owner.swap(defrag_owner);
-
+      invalidate_halo_exchanger();
       for(int k=0;k<num_processes;k++){
         std::vector<int> new_halo;
-        send_map[k].clear();
         for(std::vector<int>::iterator jt=send[k].begin();jt!=send[k].end();++jt){
-          if(new_send_set[k].count(*jt)){
-            index_t new_lnn = active_vertex_map[*jt];
-            new_halo.push_back(new_lnn);
-            send_map[k][lnn2gnn[new_lnn]] = new_lnn;
-          }
+          if(new_send_set[k].count(*jt))
+            new_halo.push_back(active_vertex_map[*jt]);
         }
         send[k].swap(new_halo);
       }
 
       for(int k=0;k<num_processes;k++){
         std::vector<int> new_halo;
-        recv_map[k].clear();
         for(std::vector<int>::iterator jt=recv[k].begin();jt!=recv[k].end();++jt){
-          if(new_recv_set[k].count(*jt)){
-            index_t new_lnn = active_vertex_map[*jt];
-            new_halo.push_back(new_lnn);
-            recv_map[k][lnn2gnn[new_lnn]] = new_lnn;
-          }
+          if(new_recv_set[k].count(*jt))
+            new_halo.push_back(active_vertex_map[*jt]);
         }
         recv[k].swap(new_halo);
       }
@@ -1134,17 +1241,313 @@ template<typename real_t> class Mesh{
           }
         }
       }
-    }else{
-      for(size_t i=0; i<NNodes; ++i){
-        lnn2gnn[i] = i;
-        node_owner[i] = 0;
-      }
     }
 
+    // Compact the global numbering and fix node_owner.
+    create_global_node_numbering();
+
 #pragma omp parallel
     create_adjacency();
   }
 
+  /*! Migrate vertices between MPI processes. Each process gives the new
+   * owner of the vertices it currently owns; entries for halo vertices
+   * are ignored. Every element is sent, together with the coordinates,
+   * metric and boundary labels of its vertices and any vertex fields, to
+   * the new owners of its vertices. The halo and the global numbering are
+   * then rebuilt as they would be by the constructor. Deleted vertices and
+   * elements are dropped, as in defragment(). Objects which cache data per
+   * vertex, such as MetricField, must be recreated afterwards.
+   *
+   * @param new_owner the process which should own each vertex.
+   * @param fields optional vertex fields, blocked by vertex, which are migrated with the mesh.
+   */
+  void migrate(const std::vector<int> &new_owner, std::vector< std::vector<double> > *fields=NULL){
+#ifdef HAVE_MPI
+    if(num_processes==1)
+      return;
+
+    // Halo copies learn their new owner from their current owner.
+    std::vector<int> owner(new_owner.begin(), new_owner.begin()+NNodes);
+    halo_update<int, 1>(owner);
+
+    int nfields = (fields==NULL)?0:fields->size();
+    std::vector<size_t> field_block(nfields);
+    size_t vertex_block = ndims+msize;
+    for(int f=0;f<nfields;f++){
+      field_block[f] = (*fields)[f].size()/NNodes;
+      assert((*fields)[f].size()==field_block[f]*NNodes);
+      vertex_block += field_block[f];
+    }
+    bool has_boundary = !boundary.empty();
+    size_t element_block = has_boundary?2*nloc:nloc;
+
+    // The owners of the vertices of an element send it to the new owners
+    // of those vertices. Every element around a vertex is held by its
+    // owner, so each process receives all the elements it needs.
+    std::vector< std::vector<index_t> > send_elements(num_processes), send_vertices(num_processes);
+    for(size_t e=0;e<NElements;e++){
+      const index_t *n = get_element(e);
+      if(n[0]<0)
+        continue;
+
+      for(size_t j=0;j<nloc;j++){
+        if(node_owner[n[j]]!=rank)
+          continue;
+
+        int p = owner[n[j]];
+        if(send_elements[p].empty() || send_elements[p].back()!=(index_t)e){
+          send_elements[p].push_back(e);
+          send_vertices[p].insert(send_vertices[p].end(), n, n+nloc);
+        }
+      }
+    }
+
+    // Pack the vertices, as (gnn, owner) pairs and their real valued
+    // data, followed by the elements in global numbering.
+    std::vector< std::vector<index_t> > send_ibuf(num_processes), recv_ibuf(num_processes);
+    std::vector< std::vector<double> > send_dbuf(num_processes), recv_dbuf(num_processes);
+    for(int p=0;p<num_processes;p++){
+      if(send_elements[p].empty())
+        continue;
+
+      std::sort(send_vertices[p].begin(), send_vertices[p].end());
+      send_vertices[p].erase(std::unique(send_vertices[p].begin(), send_vertices[p].end()), send_vertices[p].end());
+
+      size_t nverts = send_vertices[p].size();
+      size_t nelements = send_elements[p].size();
+      send_ibuf[p].reserve(2+2*nverts+nelements*element_block);
+      send_dbuf[p].reserve(nverts*vertex_block);
+
+      send_ibuf[p].push_back(nverts);
+      send_ibuf[p].push_back(nelements);
+      for(typename std::vector<index_t>::const_iterator it=send_vertices[p].begin();it!=send_vertices[p].end();++it){
+        send_ibuf[p].push_back(lnn2gnn[*it]);
+        send_ibuf[p].push_back(owner[*it]);
+
+        send_dbuf[p].insert(send_dbuf[p].end(), &(_coords[*it*ndims]), &(_coords[*it*ndims])+ndims);
+        send_dbuf[p].insert(send_dbuf[p].end(), &(metric[*it*msize]), &(metric[*it*msize])+msize);
+        for(int f=0;f<nfields;f++)
+          send_dbuf[p].insert(send_dbuf[p].end(), &((*fields)[f][*it*field_block[f]]), &((*fields)[f][*it*field_block[f]])+field_block[f]);
+      }
+      for(typename std::vector<index_t>::const_iterator it=send_elements[p].begin();it!=send_elements[p].end();++it){
+        for(size_t j=0;j<nloc;j++)
+          send_ibuf[p].push_back(lnn2gnn[_ENList[*it*nloc+j]]);
+        if(has_boundary)
+          send_ibuf[p].insert(send_ibuf[p].end(), &(boundary[*it*nloc]), &(boundary[*it*nloc])+nloc);
+      }
+    }
+
+    std::vector<int> send_size(num_processes*2), recv_size(num_processes*2);
+    for(int p=0;p<num_processes;p++){
+      send_size[p*2] = send_ibuf[p].size();
+      send_size[p*2+1] = send_dbuf[p].size();
+    }
+    MPI_Alltoall(&(send_size[0]), 2, MPI_INT,
+                 &(recv_size[0]), 2, MPI_INT, _mpi_comm);
+
+    std::vector<MPI_Request> request(num_processes*4, MPI_REQUEST_NULL);
+    for(int p=0;p<num_processes;p++){
+      if(p==rank){
+        recv_ibuf[p].swap(send_ibuf[p]);
+        recv_dbuf[p].swap(send_dbuf[p]);
+        continue;
+      }
+
+      if(recv_size[p*2]>0){
+        recv_ibuf[p].resize(recv_size[p*2]);
+        MPI_Irecv(&(recv_ibuf[p][0]), recv_size[p*2], MPI_INDEX_T, p, 0, _mpi_comm, &(request[p*4]));
+      }
+      if(recv_size[p*2+1]>0){
+        recv_dbuf[p].resize(recv_size[p*2+1]);
+        MPI_Irecv(&(recv_dbuf[p][0]), recv_size[p*2+1], MPI_DOUBLE, p, 1, _mpi_comm, &(request[p*4+1]));
+      }
+      if(send_size[p*2]>0)
+        MPI_Isend(&(send_ibuf[p][0]), send_size[p*2], MPI_INDEX_T, p, 0, _mpi_comm, &(request[p*4+2]));
+      if(send_size[p*2+1]>0)
+        MPI_Isend(&(send_dbuf[p][0]), send_size[p*2+1], MPI_DOUBLE, p, 1, _mpi_comm, &(request[p*4+3]));
+    }
+
+    std::vector<MPI_Status> status(num_processes*4);
+    MPI_Waitall(num_processes*4, &(request[0]), &(status[0]));
+
+    // Unpack, merging the copies of vertices and elements sent by several processes.
+#ifdef HAVE_BOOST_UNORDERED_MAP_HPP
+    boost::unordered_map<index_t, index_t> gnn2lnn;
+#else
+    std::map<index_t, index_t> gnn2lnn;
+#endif
+    std::map< std::vector<index_t>, index_t > element_index;
+    std::vector<index_t> new_lnn2gnn, new_ENList;
+    std::vector<int> new_node_owner, new_boundary;
+    std::vector<real_t> new_coords;
+    std::vector<double> new_metric;
+    std::vector< std::vector<double> > new_fields(nfields);
+    for(int p=0;p<num_processes;p++){
+      if(recv_ibuf[p].empty())
+        continue;
+
+      const index_t *ibuf = &(recv_ibuf[p][0]);
+      const double *dbuf = &(recv_dbuf[p][0]);
+      size_t nverts = ibuf[0];
+      size_t nelements = ibuf[1];
+      ibuf += 2;
+
+      for(size_t i=0;i<nverts;i++, ibuf+=2, dbuf+=vertex_block){
+        if(gnn2lnn.find(ibuf[0])!=gnn2lnn.end())
+          continue;
+
+        gnn2lnn[ibuf[0]] = new_lnn2gnn.size();
+        new_lnn2gnn.push_back(ibuf[0]);
+        new_node_owner.push_back(ibuf[1]);
+
+        const double *x = dbuf;
+        new_coords.insert(new_coords.end(), x, x+ndims);
+        x += ndims;
+        new_metric.insert(new_metric.end(), x, x+msize);
+        x += msize;
+        for(int f=0;f<nfields;f++){
+          new_fields[f].insert(new_fields[f].end(), x, x+field_block[f]);
+          x += field_block[f];
+        }
+      }
+
+      for(size_t i=0;i<nelements;i++, ibuf+=element_block){
+        std::vector<index_t> key(ibuf, ibuf+nloc);
+        std::sort(key.begin(), key.end());
+
+        typename std::map< std::vector<index_t>, index_t >::const_iterator it=element_index.find(key);
+        if(it==element_index.end()){
+          element_index[key] = new_ENList.size()/nloc;
+          for(size_t j=0;j<nloc;j++)
+            new_ENList.push_back(gnn2lnn[ibuf[j]]);
+          if(has_boundary)
+            new_boundary.insert(new_boundary.end(), ibuf+nloc, ibuf+2*nloc);
+        }else if(has_boundary){
+          // A sender labels a facet -1 if it owns none of its vertices,
+          // so keep the largest label seen for each facet.
+          index_t eid = it->second;
+          for(size_t j=0;j<nloc;j++){
+            index_t nid = gnn2lnn[ibuf[j]];
+            for(size_t k=0;k<nloc;k++){
+              if(new_ENList[eid*nloc+k]==nid)
+                new_boundary[eid*nloc+k] = std::max(new_boundary[eid*nloc+k], ibuf[nloc+j]);
+            }
+          }
+        }
+      }
+    }
+
+    // Replace the mesh.
+    NNodes = new_lnn2gnn.size();
+    NElements = new_ENList.size()/nloc;
+
+    _ENList.swap(new_ENList);
+    _coords.swap(new_coords);
+    metric.swap(new_metric);
+    if(has_boundary)
+      boundary.swap(new_boundary);
+    quality.resize(NElements);
+    lnn2gnn.swap(new_lnn2gnn);
+    node_owner.swap(new_node_owner);
+    for(int f=0;f<nfields;f++)
+      (*fields)[f].swap(new_fields[f]);
+
+    NNList.clear();
+    NNList.resize(NNodes);
+    NEList.clear();
+    NEList.resize(NNodes);
+    boundary_nodes.clear();
+    send_halo_flags.clear();
+
+    // Orient the elements for the local ElementProperty, and label the
+    // facets which do not touch a local vertex as halo facets.
+    for(size_t i=0;i<NElements;i++){
+      const index_t *n=get_element(i);
+
+      double volarea;
+      if(ndims==2)
+        volarea = property->area(get_coords(n[0]), get_coords(n[1]), get_coords(n[2]));
+      else
+        volarea = property->volume(get_coords(n[0]), get_coords(n[1]), get_coords(n[2]), get_coords(n[3]));
+
+      if(volarea<0){
+        invert_element(i);
+        if(has_boundary)
+          std::swap(boundary[i*nloc], boundary[i*nloc+1]);
+      }
+
+      if(has_boundary){
+        for(size_t j=0;j<nloc;j++){
+          bool local=false;
+          for(size_t k=1;k<nloc;k++)
+            local = local || (node_owner[n[(j+k)%nloc]]==rank);
+          if(!local)
+            boundary[i*nloc+j] = -1;
+        }
+      }
+    }
+
+    std::vector< std::pair<index_t, index_t> > sorted_gnn2lnn;
+    create_gnn2lnn(&(lnn2gnn[0]), NNodes, sorted_gnn2lnn);
+
+    std::vector< std::vector<index_t> > recv_gnn(num_processes);
+    for(typename std::vector< std::pair<index_t, index_t> >::const_iterator it=sorted_gnn2lnn.begin();it!=sorted_gnn2lnn.end();++it){
+      if(node_owner[it->second]!=rank)
+        recv_gnn[node_owner[it->second]].push_back(it->first);
+    }
+    create_halo(recv_gnn, sorted_gnn2lnn);
+
+    send_halo.clear();
+    recv_halo.clear();
+    for(int k=0;k<num_processes;k++){
+      send_halo.insert(send[k].begin(), send[k].end());
+      recv_halo.insert(recv[k].begin(), recv[k].end());
+    }
+
+#pragma omp parallel
+    {
+      create_adjacency();
+
+#pragma omp for schedule(static)
+      for(int i=0;i<(int)NElements;i++){
+        if(ndims==2)
+          update_quality<2>(i);
+        else
+          update_quality<3>(i);
+      }
+    }
+
+    create_global_node_numbering();
+#endif
+  }
+
+  /*! Rebalance the mesh between the MPI processes. The load of a process
+   * is the number of elements around the vertices it owns. Each round
+   * diffuses the load over the graph of neighbouring processes and
+   * migrates the vertices chosen by diffuse_load() with migrate(). Load
+   * passing through a process can exceed what it owns, so several rounds
+   * may be needed to carry it across the process graph.
+   *
+   * @param tolerance largest acceptable ratio of the maximum to the mean load.
+   * @param fields optional vertex fields, blocked by vertex, which are migrated with the mesh.
+   * @return true if the mesh was migrated.
+   */
+  bool rebalance(double tolerance=1.05, std::vector< std::vector<double> > *fields=NULL){
+    bool migrated=false;
+#ifdef HAVE_MPI
+    std::vector<int> new_owner;
+    for(int round=0;round<num_processes;round++){
+      if(!diffuse_load(tolerance, new_owner))
+        break;
+
+      migrate(new_owner, fields);
+      migrated = true;
+    }
+#endif
+    return migrated;
+  }
+
   /// This is used to verify that the mesh and its metadata is correct.
   bool verify() const{
     bool state = true;
@@ -1409,6 +1812,10 @@ template<typename real_t> class Mesh{
     MPI_Comm_size(_mpi_comm, &num_processes);
     MPI_Comm_rank(_mpi_comm, &rank);
 
+    // This is collective, so it cannot be left until the first halo update.
+    halo_exchanger = new HaloExchanger(_mpi_comm);
+    halo_exchanger_stale = true;
+
     // Assign the correct MPI data type to MPI_INDEX_T and MPI_REAL_T
     mpi_type_wrapper<index_t> mpi_index_t_wrapper;
     MPI_INDEX_T = mpi_index_t_wrapper.mpi_type;
@@ -1430,89 +1837,65 @@ template<typename real_t> class Mesh{
 
     // From the globalENList, create the halo and a local ENList if num_processes>1.
     const index_t *ENList;
-#ifdef HAVE_BOOST_UNORDERED_MAP_HPP
-    boost::unordered_map<index_t, index_t> gnn2lnn;
-#else
-    std::map<index_t, index_t> gnn2lnn;
-#endif
+    std::vector<index_t> localENList;
     if(num_processes==1){
       ENList = globalENList;
     }else{
 #ifdef HAVE_MPI
       assert(lnn2gnn!=NULL);
-      for(size_t i=0;i<(size_t)NNodes;i++){
-        gnn2lnn[lnn2gnn[i]] = i;
-      }
-
-      std::vector< std::set<index_t> > recv_set(num_processes);
-      index_t *localENList = new index_t[NElements*nloc];
-      for(size_t i=0;i<(size_t)NElements*nloc;i++){
-        index_t gnn = globalENList[i];
-        for(int j=0;j<num_processes;j++){
-          if(gnn<owner_range[j+1]){
-            if(j!=rank)
-              recv_set[j].insert(gnn);
-            break;
-          }
-        }
-        localENList[i] = gnn2lnn[gnn];
-      }
-      std::vector<int> recv_size(num_processes);
-      recv.resize(num_processes);
-      recv_map.resize(num_processes);
-      for(int j=0;j<num_processes;j++){
-        for(typename std::set<int>::const_iterator it=recv_set[j].begin();it!=recv_set[j].end();++it){
-          recv[j].push_back(*it);
-        }
-        recv_size[j] = recv[j].size();
-      }
-      std::vector<int> send_size(num_processes);
-      MPI_Alltoall(&(recv_size[0]), 1, MPI_INT,
-                   &(send_size[0]), 1, MPI_INT, _mpi_comm);
-
-      // Setup non-blocking receives
-      send.resize(num_processes);
-      send_map.resize(num_processes);
-      std::vector<MPI_Request> request(num_processes*2);
-      for(int i=0;i<num_processes;i++){
-        if((i==rank)||(send_size[i]==0)){
-          request[i] =  MPI_REQUEST_NULL;
-        }else{
-          send[i].resize(send_size[i]);
-          MPI_Irecv(&(send[i][0]), send_size[i], MPI_INDEX_T, i, 0, _mpi_comm, &(request[i]));
-        }
-      }
-
-      // Non-blocking sends.
-      for(int i=0;i<num_processes;i++){
-        if((i==rank)||(recv_size[i]==0)){
-          request[num_processes+i] =  MPI_REQUEST_NULL;
-        }else{
-          MPI_Isend(&(recv[i][0]), recv_size[i], MPI_INDEX_T, i, 0, _mpi_comm, &(request[num_processes+i]));
-        }
+      std::vector< std::pair<index_t, index_t> > gnn2lnn;
+      create_gnn2lnn(lnn2gnn, NNodes, gnn2lnn);
+
+      // Owned vertices have a contiguous range of global numbers, so they
+      // are looked up directly; only halo vertices need a binary search.
+      index_t owned_begin = owner_range[rank];
+      index_t owned_end = owner_range[rank+1];
+      std::vector<index_t> owned_lnn(owned_end-owned_begin);
+#pragma omp parallel for schedule(static)
+      for(int i=0;i<(int)NNodes;i++){
+        if((lnn2gnn[i]>=owned_begin)&&(lnn2gnn[i]<owned_end))
+          owned_lnn[lnn2gnn[i]-owned_begin] = i;
       }
 
-      std::vector<MPI_Status> status(num_processes*2);
-      MPI_Waitall(num_processes, &(request[0]), &(status[0]));
-      MPI_Waitall(num_processes, &(request[num_processes]), &(status[num_processes]));
-
-      for(int j=0;j<num_processes;j++){
-        for(int k=0;k<recv_size[j];k++){
-          index_t gnn = recv[j][k];
-          index_t lnn = gnn2lnn[gnn];
-          recv_map[j][gnn] = lnn;
-          recv[j][k] = lnn;
+      // Renumber the elements and gather the global numbers of the halo vertices.
+      int NEntries = NElements*nloc;
+      localENList.resize(NEntries);
+      std::vector<index_t> halo_gnn;
+#pragma omp parallel
+      {
+        std::vector<index_t> local_halo_gnn;
+#pragma omp for schedule(static)
+        for(int i=0;i<NEntries;i++){
+          index_t gnn = globalENList[i];
+          if((gnn>=owned_begin)&&(gnn<owned_end)){
+            localENList[i] = owned_lnn[gnn-owned_begin];
+          }else{
+            local_halo_gnn.push_back(gnn);
+            localENList[i] = lookup_lnn(gnn2lnn, gnn);
+          }
         }
 
-        for(int k=0;k<send_size[j];k++){
-          index_t gnn = send[j][k];
-          index_t lnn = gnn2lnn[gnn];
-          send_map[j][gnn] = lnn;
-          send[j][k] = lnn;
-        }
+        std::sort(local_halo_gnn.begin(), local_halo_gnn.end());
+        local_halo_gnn.erase(std::unique(local_halo_gnn.begin(), local_halo_gnn.end()), local_halo_gnn.end());
+#pragma omp critical
+        halo_gnn.insert(halo_gnn.end(), local_halo_gnn.begin(), local_halo_gnn.end());
       }
+      std::sort(halo_gnn.begin(), halo_gnn.end());
+      halo_gnn.erase(std::unique(halo_gnn.begin(), halo_gnn.end()), halo_gnn.end());
+
+      // The owner ranges are ordered, so the sorted halo splits into
+      // one run per owner, found by binary search.
+      std::vector< std::vector<index_t> > recv_gnn(num_processes);
+      for(typename std::vector<index_t>::iterator it=halo_gnn.begin();it!=halo_gnn.end();){
+        int owner = std::upper_bound(owner_range, owner_range+num_processes+1, *it)-owner_range-1;
+        typename std::vector<index_t>::iterator end = std::lower_bound(it, halo_gnn.end(), owner_range[owner+1]);
+        recv_gnn[owner].assign(it, end);
+        it = end;
+      }
+
+      create_halo(recv_gnn, gnn2lnn);
 
-      ENList = localENList;
+      ENList = &(localENList[0]);
 #endif
     }
 
@@ -1622,6 +2005,252 @@ template<typename real_t> class Mesh{
     create_global_node_numbering();
   }
 
+#ifdef HAVE_MPI
+  /*! Choose new owners for the vertices to reduce the load imbalance.
+   * First order diffusion on the graph of neighbouring processes gives
+   * the load each process passes to each neighbour. It is made up of
+   * vertices grown breadth first from the shared partition boundary.
+   * Returns false if the load is already balanced or no vertex moves.
+   */
+  bool diffuse_load(double tolerance, std::vector<int> &new_owner){
+    if(num_processes==1)
+      return false;
+
+    std::vector<double> weight(NNodes, 0.0);
+    double load=0;
+    for(size_t i=0;i<NNodes;i++){
+      if(node_owner[i]==rank){
+        weight[i] = NEList[i].size();
+        load += weight[i];
+      }
+    }
+
+    double max_load, mean_load;
+    MPI_Allreduce(&load, &max_load, 1, MPI_DOUBLE, MPI_MAX, _mpi_comm);
+    MPI_Allreduce(&load, &mean_load, 1, MPI_DOUBLE, MPI_SUM, _mpi_comm);
+    mean_load/=num_processes;
+    if(max_load<=tolerance*mean_load)
+      return false;
+
+    std::vector<int> neighbours;
+    for(int k=0;k<num_processes;k++){
+      if((k!=rank)&&(!send[k].empty()||!recv[k].empty()))
+        neighbours.push_back(k);
+    }
+    int nneigh = neighbours.size();
+
+    // Diffuse the load, accumulating the flow across each edge of the
+    // process graph. Both ends of an edge use the same coefficient, so
+    // the flows are antisymmetric and the total load is conserved. The
+    // target is tighter than the tolerance to leave room for the
+    // granularity of the vertices moved.
+    std::vector<double> neigh_degree, neigh_load, flow(nneigh, 0.0);
+    exchange_with_neighbours(neighbours, nneigh, neigh_degree);
+
+    double x = load;
+    double target = (1.0+0.5*(tolerance-1.0))*mean_load;
+    for(int iter=0;iter<1000;iter++){
+      exchange_with_neighbours(neighbours, x, neigh_load);
+
+      double outflow=0;
+      for(int n=0;n<nneigh;n++){
+        double f = (x-neigh_load[n])/(std::max((double)nneigh, neigh_degree[n])+1);
+        flow[n] += f;
+        outflow += f;
+      }
+      x -= outflow;
+
+      MPI_Allreduce(&x, &max_load, 1, MPI_DOUBLE, MPI_MAX, _mpi_comm);
+      if(max_load<=target)
+        break;
+    }
+
+    // Grow the vertices sent to each neighbour, largest flow first,
+    // from the vertices next to those it owns or is about to receive.
+    new_owner.assign(node_owner.begin(), node_owner.begin()+NNodes);
+    std::vector< std::pair<double, int> > outgoing;
+    for(int n=0;n<nneigh;n++){
+      if(flow[n]>0)
+        outgoing.push_back(std::pair<double, int>(-flow[n], n));
+    }
+    std::sort(outgoing.begin(), outgoing.end());
+
+    int nmoved=0;
+    for(typename std::vector< std::pair<double, int> >::const_iterator ot=outgoing.begin();ot!=outgoing.end();++ot){
+      int k = neighbours[ot->second];
+      double quota = -ot->first;
+
+      std::vector<index_t> front;
+      for(size_t i=0;i<NNodes;i++){
+        if((weight[i]==0)||(new_owner[i]!=rank))
+          continue;
+
+        for(typename std::vector<index_t>::const_iterator it=NNList[i].begin();it!=NNList[i].end();++it){
+          if(new_owner[*it]==k){
+            front.push_back(i);
+            break;
+          }
+        }
+      }
+
+      for(size_t head=0;(head<front.size())&&(quota>0);head++){
+        index_t i = front[head];
+        if(new_owner[i]!=rank)
+          continue;
+
+        new_owner[i] = k;
+        quota -= weight[i];
+        nmoved++;
+
+        for(typename std::vector<index_t>::const_iterator it=NNList[i].begin();it!=NNList[i].end();++it){
+          if((weight[*it]>0)&&(new_owner[*it]==rank))
+            front.push_back(*it);
+        }
+      }
+    }
+
+    MPI_Allreduce(MPI_IN_PLACE, &nmoved, 1, MPI_INT, MPI_SUM, _mpi_comm);
+
+    return nmoved>0;
+  }
+
+  /// Exchange a value with each of the neighbouring processes.
+  void exchange_with_neighbours(const std::vector<int> &neighbours, double value, std::vector<double> &values){
+    int nneigh = neighbours.size();
+    values.resize(nneigh);
+    if(nneigh==0)
+      return;
+
+    std::vector<MPI_Request> request(nneigh*2);
+    for(int n=0;n<nneigh;n++)
+      MPI_Irecv(&(values[n]), 1, MPI_DOUBLE, neighbours[n], 0, _mpi_comm, &(request[n]));
+    for(int n=0;n<nneigh;n++)
+      MPI_Isend(&value, 1, MPI_DOUBLE, neighbours[n], 0, _mpi_comm, &(request[nneigh+n]));
+
+    std::vector<MPI_Status> status(nneigh*2);
+    MPI_Waitall(nneigh*2, &(request[0]), &(status[0]));
+  }
+
+  /// Pair the global numbers in numbering with their local numbers, sorted for lookup_lnn().
+  void create_gnn2lnn(const index_t *numbering, size_t n, std::vector< std::pair<index_t, index_t> > &gnn2lnn) const{
+    gnn2lnn.resize(n);
+#pragma omp parallel for schedule(static)
+    for(int i=0;i<(int)n;i++)
+      gnn2lnn[i] = std::pair<index_t, index_t>(numbering[i], i);
+
+    std::sort(gnn2lnn.begin(), gnn2lnn.end());
+  }
+
+  /// Look up the local number of a global number in a list made by create_gnn2lnn().
+  static index_t lookup_lnn(const std::vector< std::pair<index_t, index_t> > &gnn2lnn, index_t gnn){
+    // Local numbers are non-negative, so (gnn, -1) orders before the entry for gnn.
+    typename std::vector< std::pair<index_t, index_t> >::const_iterator it =
+      std::lower_bound(gnn2lnn.begin(), gnn2lnn.end(), std::pair<index_t, index_t>(gnn, -1));
+    assert((it!=gnn2lnn.end())&&(it->first==gnn));
+    return it->second;
+  }
+
+  /*! Create the send and recv lists. recv_gnn holds, for each process, the
+   * sorted global numbers of the halo vertices it owns. The owners learn
+   * which vertices to send through a non-blocking consensus (NBX; Hoefler
+   * et al., PPoPP 2010): the requests are sent with synchronous sends,
+   * received as they are probed, and a non-blocking barrier is entered
+   * once all of this process's requests have been matched. When the
+   * barrier completes every request has been received. Only processes
+   * sharing a halo exchange messages, so no all-to-all is needed.
+   */
+  void create_halo(std::vector< std::vector<index_t> > &recv_gnn, const std::vector< std::pair<index_t, index_t> > &gnn2lnn){
+    // Use a private communicator so that requests from a later call
+    // cannot be mistaken for those of this one.
+    MPI_Comm comm;
+    MPI_Comm_dup(_mpi_comm, &comm);
+
+    recv.swap(recv_gnn);
+    recv.resize(num_processes);
+    send.assign(num_processes, std::vector<index_t>());
+    invalidate_halo_exchanger();
+
+    std::vector<MPI_Request> request;
+    request.reserve(num_processes);
+    for(int i=0;i<num_processes;i++){
+      if((i==rank)||recv[i].empty())
+        continue;
+
+      request.push_back(MPI_REQUEST_NULL);
+      MPI_Issend(&(recv[i][0]), recv[i].size(), MPI_INDEX_T, i, 0, comm, &(request.back()));
+    }
+
+    MPI_Request barrier = MPI_REQUEST_NULL;
+    bool barrier_active = false;
+    for(;;){
+      int flag;
+      MPI_Status status;
+      MPI_Iprobe(MPI_ANY_SOURCE, 0, comm, &flag, &status);
+      if(flag){
+        int cnt;
+        MPI_Get_count(&status, MPI_INDEX_T, &cnt);
+        send[status.MPI_SOURCE].resize(cnt);
+        MPI_Recv(&(send[status.MPI_SOURCE][0]), cnt, MPI_INDEX_T, status.MPI_SOURCE, 0, comm, MPI_STATUS_IGNORE);
+      }
+
+      if(barrier_active){
+        MPI_Test(&barrier, &flag, MPI_STATUS_IGNORE);
+        if(flag)
+          break;
+      }else{
+        MPI_Testall(request.size(), request.empty()?NULL:&(request[0]), &flag, MPI_STATUSES_IGNORE);
+        if(flag){
+          MPI_Ibarrier(comm, &barrier);
+          barrier_active = true;
+        }
+      }
+    }
+
+    MPI_Comm_free(&comm);
+
+    // Switch to local numbering.
+    recv_map.clear();
+    recv_map.resize(num_processes);
+    send_map.clear();
+    send_map.resize(num_processes);
+    for(int j=0;j<num_processes;j++){
+      for(typename std::vector<index_t>::iterator it=recv[j].begin();it!=recv[j].end();++it){
+        index_t lnn = lookup_lnn(gnn2lnn, *it);
+        recv_map[j][*it] = lnn;
+        *it = lnn;
+      }
+
+      for(typename std::vector<index_t>::iterator it=send[j].begin();it!=send[j].end();++it){
+        index_t lnn = lookup_lnn(gnn2lnn, *it);
+        send_map[j][*it] = lnn;
+        *it = lnn;
+      }
+    }
+  }
+#endif
+
+  /// Rebuild the cached send halo classification if the halo or the number of vertices has changed.
+  void update_halo_classification(){
+#ifdef HAVE_MPI
+    if(num_processes>1)
+      get_halo_exchanger();
+#endif
+    if(send_halo_flags.size()==NNodes)
+      return;
+
+    send_halo_flags.assign(NNodes, 0);
+    send_halo_vertices.clear();
+    for(size_t i=0;i<send.size();i++){
+      for(typename std::vector<index_t>::const_iterator it=send[i].begin();it!=send[i].end();++it){
+        if(!send_halo_flags[*it]){
+          send_halo_flags[*it] = 1;
+          send_halo_vertices.push_back(*it);
+        }
+      }
+    }
+    std::sort(send_halo_vertices.begin(), send_halo_vertices.end());
+  }
+
   /// Create required adjacency lists.
   void create_adjacency(){
     int tid = pragmatic_thread_id();
@@ -1668,8 +2297,16 @@ template<typename real_t> class Mesh{
     }
   }
 
+  /// Mark the halo exchanger as out of date after send/recv have been changed.
+  void invalidate_halo_exchanger(){
+#ifdef HAVE_MPI
+    halo_exchanger_stale = true;
+#endif
+  }
+
   void trim_halo(){
     std::set<index_t> recv_halo_temp, send_halo_temp;
+    invalidate_halo_exchanger();
 
     // Traverse all vertices V in all recv[i] vectors. Vertices in send[i] belong by definition to *this* MPI process,
     // so all elements adjacent to them either belong exclusively to *this* process or cross partitions.
@@ -1788,33 +2425,71 @@ template<typename real_t> class Mesh{
     send_halo.swap(send_halo_temp);
   }
 
+  /*! Number the vertices contiguously: each process numbers the vertices
+   * it owns in local order, starting from the count of vertices owned by
+   * the processes before it. This takes one scan, and the halo copies get
+   * their numbers from their owners in one halo update. The send and recv
+   * maps are rekeyed by the new numbers.
+   */
   void create_global_node_numbering(){
     if(num_processes>1){
 #ifdef HAVE_MPI
+      // The halo copies are the vertices in the recv lists.
+      std::vector<char> is_copy(NNodes, 0);
+      for(int k=0;k<num_processes;k++){
+        for(typename std::vector<index_t>::const_iterator it=recv[k].begin();it!=recv[k].end();++it){
+          is_copy[*it] = 1;
+          node_owner[*it] = k;
+        }
+      }
+
+      // Count the owned vertices in blocks so that the local numbering
+      // can be written in parallel.
+      int nblocks = nthreads;
+      size_t block_size = (NNodes+nblocks-1)/nblocks;
+      std::vector<index_t> block_offset(nblocks+1, 0);
+#pragma omp parallel for schedule(static)
+      for(int b=0;b<nblocks;b++){
+        size_t end = std::min(NNodes, (b+1)*block_size);
+        for(size_t i=b*block_size;i<end;i++)
+          if(!is_copy[i])
+            block_offset[b+1]++;
+      }
+      for(int b=0;b<nblocks;b++)
+        block_offset[b+1] += block_offset[b];
+
       // Calculate the global numbering offset for this partition.
-      int gnn_offset;
-      int NPNodes = NNodes - recv_halo.size();
-      MPI_Scan(&NPNodes, &gnn_offset, 1, MPI_INT, MPI_SUM, get_mpi_comm());
-      gnn_offset-=NPNodes;
-
-      // Write global node numbering and ownership for nodes assigned to local process.
-      for(index_t i=0; i < (index_t) NNodes; i++){
-        if(recv_halo.count(i)){
-          lnn2gnn[i] = 0;
-        }else{
-          lnn2gnn[i] = gnn_offset++;
-          node_owner[i] = rank;
+      index_t NPNodes = block_offset[nblocks];
+      index_t offset;
+      MPI_Scan(&NPNodes, &offset, 1, MPI_INDEX_T, MPI_SUM, _mpi_comm);
+      offset -= NPNodes;
+
+#pragma omp parallel for schedule(static)
+      for(int b=0;b<nblocks;b++){
+        index_t gnn = offset+block_offset[b];
+        size_t end = std::min(NNodes, (b+1)*block_size);
+        for(size_t i=b*block_size;i<end;i++){
+          if(is_copy[i]){
+            lnn2gnn[i] = -1;
+          }else{
+            lnn2gnn[i] = gnn++;
+            node_owner[i] = rank;
+          }
         }
       }
 
       // Update GNN's for the halo nodes.
-      halo_update<int, 1>(_mpi_comm, send, recv, lnn2gnn);
+      halo_update<index_t, 1>(lnn2gnn);
 
-      // Finish writing node ownerships.
-      for(int i=0;i<num_processes;i++){
-        for(std::vector<int>::const_iterator it=recv[i].begin();it!=recv[i].end();++it){
-          node_owner[*it] = i;
-        }
+#pragma omp parallel for schedule(dynamic)
+      for(int k=0;k<num_processes;k++){
+        send_map[k].clear();
+        for(typename std::vector<index_t>::const_iterator it=send[k].begin();it!=send[k].end();++it)
+          send_map[k][lnn2gnn[*it]] = *it;
+
+        recv_map[k].clear();
+        for(typename std::vector<index_t>::const_iterator it=recv[k].begin();it!=recv[k].end();++it)
+          recv_map[k][lnn2gnn[*it]] = *it;
       }
 #endif
     }else{
@@ -1839,7 +2514,7 @@ template<typename real_t> class Mesh{
         lnn2gnn[i] = -1;
     }
 
-    halo_update<int, 1>(_mpi_comm, send, recv, lnn2gnn);
+    halo_update<int, 1>(lnn2gnn);
 
     for(int i=0;i<num_processes;i++){
       send_map[i].clear();
@@ -1925,6 +2600,18 @@ template<typename real_t> class Mesh{
     }
   }
 
+  /*! Calculate the quality of the elements whose cached quality is not a
+   * number, which is the case until it is evaluated with a metric set.
+   */
+  template<int dim>
+  void update_stale_quality(){
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<(int)NElements; i++){
+      if(_ENList[i*(dim+1)]>=0 && std::isnan(quality[i]))
+        update_quality<dim>(i);
+    }
+  }
+
   template<int dim>
   inline void update_quality(index_t element){
     const index_t *n=get_element(element);
@@ -1945,6 +2632,9 @@ template<typename real_t> class Mesh{
   // Boundary Label
   std::vector<int> boundary;
 
+  // Cached flags marking the vertices on the boundary.
+  std::vector<char> boundary_nodes;
+
   // Quality
   std::vector<double> quality;
 
@@ -1966,6 +2656,10 @@ template<typename real_t> class Mesh{
   std::vector< std::map<index_t, index_t> > send_map, recv_map;
 #endif
   std::set<index_t> send_halo, recv_halo;
+
+  // Owned vertices in the send lists; see get_send_halo_vertices().
+  std::vector<index_t> send_halo_vertices;
+  std::vector<char> send_halo_flags;
   std::vector<int> node_owner;
   std::vector<index_t> lnn2gnn;
 
@@ -1973,6 +2667,10 @@ template<typename real_t> class Mesh{
   MPI_Comm _mpi_comm;
   index_t gnn_offset;
 
+  // Persistent halo exchange, updated when send/recv change.
+  HaloExchanger *halo_exchanger;
+  bool halo_exchanger_stale;
+
   // MPI data type for index_t and real_t
   MPI_Datatype MPI_INDEX_T;
   MPI_Datatype MPI_REAL_T;
@@ -38,6 +38,7 @@
 #ifndef METRICFIELD_H
 #define METRICFIELD_H
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include <map>
@@ -52,6 +53,7 @@
 #include "Mesh.h"
 #include "ElementProperty.h"
 
+#include "generate_Steiner_ellipse_2d.h"
 #include "generate_Steiner_ellipse_3d.h"
 
 #ifdef HAVE_MPI
@@ -131,53 +133,138 @@ public:
       delete [] _metric;
   }
   
+  /*! Generate a metric from the mesh itself by fitting an ellipse
+   * (ellipsoid in 3D) to the edges of the patch around each vertex.
+   * @param resolution_scaling_factor scales the resulting edge lengths.
+   */
   void generate_mesh_metric(double resolution_scaling_factor){
     if(_metric==NULL)
       _metric = new MetricTensor<real_t,dim>[_NNodes];
 
-    if(dim==2){
-      std::cerr<<"ERROR: void generate_mesh_metric() not yet implemented in 2D.\n";
-      exit(-1);
-    }else{
+    const int msize = (dim==2)?3:6;
 #pragma omp parallel
-      {
-	double alpha = pow(1.0/resolution_scaling_factor, 2);
+    {
+      double alpha = pow(1.0/resolution_scaling_factor, 2);
 #pragma omp for schedule(static)
-        for(int i=0; i<_NNodes; i++){
-	  real_t m[6];
-	  
-	  fit_ellipsoid(i, m);
-	  
-	  for(int j=0;j<6;j++)
-	    m[j]*=alpha;
-
-	  _metric[i].set_metric(m);
-	}
+      for(int i=0; i<_NNodes; i++){
+        real_t m[6];
+
+        if(dim==2)
+          fit_ellipse(i, m);
+        else
+          fit_ellipsoid(i, m);
+
+        for(int j=0;j<msize;j++)
+          m[j]*=alpha;
+
+        _metric[i].set_metric(m);
       }
     }
   }
 
+/* Start of code generated by fit_ellipse_2d.py. Warning - be careful about modifying
+   any of the generated code directly.  Any changes/fixes should be done
+   in the code generation script generation.
+ */
+
+void fit_ellipse(int i, real_t *sm){
+  real_t a[6], b[3];
+  for(int j=0;j<6;j++)
+    a[j] = 0.0;
+  for(int j=0;j<3;j++)
+    b[j] = 0.0;
+
+  for(size_t k=0;k<=_mesh->NNList[i].size();k++){
+    index_t it = k<_mesh->NNList[i].size()?_mesh->NNList[i][k]:i;
+
+    const real_t *X0=_mesh->get_coords(it);
+    real_t x0=X0[0], y0=X0[1];
+    assert(std::isfinite(x0));
+    assert(std::isfinite(y0));
+
+    for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[it].begin();n!=_mesh->NNList[it].end();++n){
+      if(*n<=it)
+	continue;
+      
+      const real_t *X=_mesh->get_coords(*n);
+      real_t x=X[0]-x0, y=X[1]-y0;
+
+      assert(std::isfinite(x));
+      assert(std::isfinite(y));
+
+      // The monomials are even under x -> -x, so no sign flip is needed.
+      real_t p[] = {x*x, y*y, x*y};
+
+      a[0]+=p[0]*p[0]; a[1]+=p[0]*p[1]; a[2]+=p[0]*p[2]; 
+      a[3]+=p[1]*p[1]; a[4]+=p[1]*p[2]; 
+      a[5]+=p[2]*p[2]; 
+
+      b[0]+=p[0];
+      b[1]+=p[1];
+      b[2]+=p[2];
+    }
+  }
+
+  Eigen::Matrix<double, 3, 3> A;
+  for(int j=0, k=0;j<3;j++){
+    for(int l=j;l<3;l++, k++){
+      A(j, l) = a[k];
+      A(l, j) = a[k];
+    }
+  }
+  Eigen::Matrix<double, 3, 1> B;
+  for(int j=0;j<3;j++)
+    B[j] = b[j];
+
+  // A is symmetric positive semi-definite, so use Cholesky unless the
+  // patch is degenerate, in which case fall back to the minimum norm
+  // solution.
+  Eigen::Matrix<double, 3, 1> S;
+  Eigen::LLT< Eigen::Matrix<double, 3, 3> > llt(A);
+  if(llt.isPositiveDefinite() && llt.matrixL().diagonal().cwise().square().minCoeff()>1.0e-8*A.diagonal().maxCoeff()){
+    llt.solve(B, &S);
+  }else{
+    A.svd().solve(B, &S);
+  }
+
+  if(_mesh->NNList[i].size()>=3){
+    sm[0] = S[0]; sm[1] = S[2];
+                  sm[2] = S[1];
+  }else{
+    sm[0] = S[0]; sm[1] = 0;
+                  sm[2] = S[1];
+  }
+
+  return;
+}
+
+/* End of code generated by fit_ellipse_2d.py. Warning - be careful about
+   modifying any of the generated code directly.  Any changes/fixes
+   should be done in the code generation script generation.*/
+
 /* Start of code generated by fit_ellipsoid_3d.py. Warning - be careful about modifying
    any of the generated code directly.  Any changes/fixes should be done
    in the code generation script generation.
  */
 
 void fit_ellipsoid(int i, real_t *sm){
-  Eigen::Matrix<double, 6, 6> A = Eigen::Matrix<real_t, 6, 6>::Zero(6,6);
-  Eigen::Matrix<double, 6, 1> b = Eigen::Matrix<real_t, 6, 1>::Zero(6);
+  real_t a[21], b[6];
+  for(int j=0;j<21;j++)
+    a[j] = 0.0;
+  for(int j=0;j<6;j++)
+    b[j] = 0.0;
 
-  std::vector<index_t> nodes = _mesh->NNList[i];
-  nodes.push_back(i);
+  for(size_t k=0;k<=_mesh->NNList[i].size();k++){
+    index_t it = k<_mesh->NNList[i].size()?_mesh->NNList[i][k]:i;
 
-  for(typename std::vector<index_t>::const_iterator it=nodes.begin();it!=nodes.end();++it){
-    const real_t *X0=_mesh->get_coords(*it);
+    const real_t *X0=_mesh->get_coords(it);
     real_t x0=X0[0], y0=X0[1], z0=X0[2];
     assert(std::isfinite(x0));
     assert(std::isfinite(y0));
     assert(std::isfinite(z0));
 
-    for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[*it].begin();n!=_mesh->NNList[*it].end();++n){
-      if(*n<=*it)
+    for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[it].begin();n!=_mesh->NNList[it].end();++n){
+      if(*n<=it)
 	continue;
       
       const real_t *X=_mesh->get_coords(*n);
@@ -186,30 +273,47 @@ void fit_ellipsoid(int i, real_t *sm){
       assert(std::isfinite(x));
       assert(std::isfinite(y));
       assert(std::isfinite(z));
-      if(x<0){
-        x*=-1;
-        y*=-1;
-        z*=-1;
-      }
-            A[0]+=pow(x, 4); A[1]+=pow(x, 2)*pow(y, 2); A[2]+=pow(x, 2)*pow(z, 2); A[3]+=pow(x, 2)*y*z; A[4]+=pow(x, 3)*z; A[5]+=pow(x, 3)*y; 
-      A[6]+=pow(x, 2)*pow(y, 2); A[7]+=pow(y, 4); A[8]+=pow(y, 2)*pow(z, 2); A[9]+=pow(y, 3)*z; A[10]+=x*pow(y, 2)*z; A[11]+=x*pow(y, 3); 
-      A[12]+=pow(x, 2)*pow(z, 2); A[13]+=pow(y, 2)*pow(z, 2); A[14]+=pow(z, 4); A[15]+=y*pow(z, 3); A[16]+=x*pow(z, 3); A[17]+=x*y*pow(z, 2); 
-      A[18]+=pow(x, 2)*y*z; A[19]+=pow(y, 3)*z; A[20]+=y*pow(z, 3); A[21]+=pow(y, 2)*pow(z, 2); A[22]+=x*y*pow(z, 2); A[23]+=x*pow(y, 2)*z; 
-      A[24]+=pow(x, 3)*z; A[25]+=x*pow(y, 2)*z; A[26]+=x*pow(z, 3); A[27]+=x*y*pow(z, 2); A[28]+=pow(x, 2)*pow(z, 2); A[29]+=pow(x, 2)*y*z; 
-      A[30]+=pow(x, 3)*y; A[31]+=x*pow(y, 3); A[32]+=x*y*pow(z, 2); A[33]+=x*pow(y, 2)*z; A[34]+=pow(x, 2)*y*z; A[35]+=pow(x, 2)*pow(y, 2); 
 
-      b[0]+=pow(x, 2);
-      b[1]+=pow(y, 2);
-      b[2]+=pow(z, 2);
-      b[3]+=y*z;
-      b[4]+=x*z;
-      b[5]+=x*y;
+      // The monomials are even under x -> -x, so no sign flip is needed.
+      real_t p[] = {x*x, y*y, z*z, y*z, x*z, x*y};
+
+      a[0]+=p[0]*p[0]; a[1]+=p[0]*p[1]; a[2]+=p[0]*p[2]; a[3]+=p[0]*p[3]; a[4]+=p[0]*p[4]; a[5]+=p[0]*p[5]; 
+      a[6]+=p[1]*p[1]; a[7]+=p[1]*p[2]; a[8]+=p[1]*p[3]; a[9]+=p[1]*p[4]; a[10]+=p[1]*p[5]; 
+      a[11]+=p[2]*p[2]; a[12]+=p[2]*p[3]; a[13]+=p[2]*p[4]; a[14]+=p[2]*p[5]; 
+      a[15]+=p[3]*p[3]; a[16]+=p[3]*p[4]; a[17]+=p[3]*p[5]; 
+      a[18]+=p[4]*p[4]; a[19]+=p[4]*p[5]; 
+      a[20]+=p[5]*p[5]; 
+
+      b[0]+=p[0];
+      b[1]+=p[1];
+      b[2]+=p[2];
+      b[3]+=p[3];
+      b[4]+=p[4];
+      b[5]+=p[5];
     }
   }
 
-  Eigen::Matrix<double, 6, 1> S = Eigen::Matrix<real_t, 6, 1>::Zero(6);
-
-  A.svd().solve(b, &S);
+  Eigen::Matrix<double, 6, 6> A;
+  for(int j=0, k=0;j<6;j++){
+    for(int l=j;l<6;l++, k++){
+      A(j, l) = a[k];
+      A(l, j) = a[k];
+    }
+  }
+  Eigen::Matrix<double, 6, 1> B;
+  for(int j=0;j<6;j++)
+    B[j] = b[j];
+
+  // A is symmetric positive semi-definite, so use Cholesky unless the
+  // patch is degenerate, in which case fall back to the minimum norm
+  // solution.
+  Eigen::Matrix<double, 6, 1> S;
+  Eigen::LLT< Eigen::Matrix<double, 6, 6> > llt(A);
+  if(llt.isPositiveDefinite() && llt.matrixL().diagonal().cwise().square().minCoeff()>1.0e-8*A.diagonal().maxCoeff()){
+    llt.solve(B, &S);
+  }else{
+    A.svd().solve(B, &S);
+  }
 
   if(_mesh->NNList[i].size()>=6){
     sm[0] = S[0]; sm[1] = S[5]; sm[2] = S[4];
@@ -228,47 +332,68 @@ void fit_ellipsoid(int i, real_t *sm){
    modifying any of the generated code directly.  Any changes/fixes
    should be done in the code generation script generation.*/
 
+  /*! Generate a metric from the mesh itself by averaging the Steiner
+   * ellipses of the elements around each vertex.
+   * @param resolution_scaling_factor scales the resulting edge lengths.
+   */
   void generate_Steiner_ellipse(double resolution_scaling_factor){
     if(_metric==NULL)
       _metric = new MetricTensor<real_t,dim>[_NNodes];
 
-    if(dim==2){
-      std::cerr<<"ERROR: void generate_Steiner_ellipse() not yet implemented in 2D.\n";
-      exit(-1);
-    }else{
-      std::vector<double> SteinerMetricField(_NElements*6);
+    const int nloc = dim+1;
+    const int msize = (dim==2)?3:6;
+
+    // The elements are processed in blocks so that the Steiner ellipse
+    // kernel is vectorised over the elements of a block.
+    const int block = 32;
+    int nblocks = (_NElements+block-1)/block;
+
+    std::vector<double> SteinerMetricField(_NElements*msize);
 #pragma omp parallel
-      {
+    {
+      double x[block*4*3], sm[block*6];
+
 #pragma omp for schedule(static)
-        for(int i=0; i<_NElements; i++){
-          const index_t *n=_mesh->get_element(i);
+      for(int b=0; b<nblocks; b++){
+        int e0 = b*block;
+        int n = std::min(block, _NElements-e0);
+
+        for(int e=0;e<n;e++){
+          const index_t *en=_mesh->get_element(e0+e);
+          for(int v=0;v<nloc;v++){
+            const real_t *xv = _mesh->get_coords(en[v]);
+            for(int d=0;d<dim;d++)
+              x[(v*dim+d)*n+e] = xv[d];
+          }
+        }
 
-          const real_t *x0 = _mesh->get_coords(n[0]);
-          const real_t *x1 = _mesh->get_coords(n[1]);
-          const real_t *x2 = _mesh->get_coords(n[2]);
-          const real_t *x3 = _mesh->get_coords(n[3]);
+        if(dim==2)
+          pragmatic::generate_Steiner_ellipse_block_2d(n, x, sm);
+        else
+          pragmatic::generate_Steiner_ellipse_block_3d(n, x, sm);
 
-          pragmatic::generate_Steiner_ellipse(x0, x1, x2, x3, SteinerMetricField.data()+i*6);
-        }
+        for(int e=0;e<n;e++)
+          for(int j=0;j<msize;j++)
+            SteinerMetricField[(e0+e)*msize+j] = sm[j*n+e];
+      }
 
-	double alpha = pow(1.0/resolution_scaling_factor, 2);
+      double alpha = pow(1.0/resolution_scaling_factor, 2);
 #pragma omp for schedule(static)
-        for(int i=0; i<_NNodes; i++){
-          double sm[6];
-          for(int j=0;j<6;j++)
-            sm[j] = 0.0;
+      for(int i=0; i<_NNodes; i++){
+        real_t m[6];
+        for(int j=0;j<msize;j++)
+          m[j] = 0.0;
 
-          for(typename std::set<index_t>::const_iterator ie=_mesh->NEList[i].begin();ie!=_mesh->NEList[i].end();++ie){
-            for(int j=0;j<6;j++)
-              sm[j]+=SteinerMetricField[(*ie)*6+j];
-	  }
+        for(typename std::set<index_t>::const_iterator ie=_mesh->NEList[i].begin();ie!=_mesh->NEList[i].end();++ie){
+          for(int j=0;j<msize;j++)
+            m[j]+=SteinerMetricField[(*ie)*msize+j];
+        }
 
-          double scale = alpha/_mesh->NEList[i].size();
-          for(int j=0;j<6;j++)
-            sm[j]*=scale;
+        double scale = alpha/_mesh->NEList[i].size();
+        for(int j=0;j<msize;j++)
+          m[j]*=scale;
 
-          _metric[i].set_metric(sm);
-        }
+        _metric[i].set_metric(m);
       }
     }
   }
@@ -332,6 +457,24 @@ void fit_ellipsoid(int i, real_t *sm){
     _metric[id].set_metric(metric);
   }
 
+  /*! Intersect the metric tensor field with another metric tensor field,
+   * e.g. one calculated for a different time level. If no metric has been
+   * set yet, it is simply copied. It is assumed that only the top triangle
+   * of the tensors are stored.
+   * @param metric is a pointer to the buffer where the metric field is to be intersected with.
+   */
+  void intersect_metric(const real_t* metric){
+    if(_metric==NULL){
+      set_metric(metric);
+      return;
+    }
+
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_NNodes; i++){
+      _metric[i].constrain(metric+i*(dim==2?3:6));
+    }
+  }
+
   /// Update the metric field on the mesh.
   void relax_mesh(double omega){
     assert(_metric!=NULL);
@@ -373,21 +516,29 @@ void fit_ellipsoid(int i, real_t *sm){
       _mesh->create_gappy_global_numbering(pNElements);
 #endif
 
-    // Enforce first-touch policy
-#pragma omp parallel
-    {
-#pragma omp for schedule(static)
-      for(int i=0; i<_NNodes; i++){
-        double M[dim==2?3:6];
-        _metric[i].get_metric(M);
-        for(int j=0; j<(dim==2?3:6); j++)
-           _mesh->metric[i*(dim==2?3:6)+j] = (1.0-omega)*_mesh->metric[i*(dim==2?3:6)+j] + omega*M[j];
-        MetricTensor<real_t,dim>::positive_definiteness(&(_mesh->metric[i*(dim==2?3:6)]));
-      }
+    // Relax the metric at the vertices which are sent to other
+    // processes first, so that the halo update is in flight while the
+    // remaining vertices are relaxed.
+    const std::vector<index_t> &send_vertices = _mesh->get_send_halo_vertices();
+    const std::vector<char> &is_send_vertex = _mesh->get_send_halo_flags();
+    int nsend = send_vertices.size();
+
+#pragma omp parallel for schedule(static)
+    for(int k=0; k<nsend; k++)
+      relax_metric(send_vertices[k], omega);
+
+    _mesh->template halo_update_begin<double, (dim==2?3:6)>(_mesh->metric);
+
+    // No other process needs the remaining vertices, so they are relaxed
+    // while the messages are in flight. Values relaxed at received halo
+    // vertices are overwritten when the update completes.
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_NNodes; i++){
+      if(!is_send_vertex[i])
+        relax_metric(i, omega);
     }
-    
-    // Halo update if parallel
-    halo_update<double, (dim==2?3:6)>(_mesh->get_mpi_comm(), _mesh->send, _mesh->recv, _mesh->metric);
+
+    _mesh->template halo_update_end<double, (dim==2?3:6)>(_mesh->metric);
   }
 
 
@@ -432,236 +583,415 @@ void fit_ellipsoid(int i, real_t *sm){
       _mesh->create_gappy_global_numbering(pNElements);
 #endif
 
-    // Enforce first-touch policy
-#pragma omp parallel
-    {
-#pragma omp for schedule(static)
-      for(int i=0; i<_NNodes; i++){
+    // Copy the metric at the vertices which are sent to other processes
+    // first, so that the halo update is in flight while the remaining
+    // vertices are copied.
+    const std::vector<index_t> &send_vertices = _mesh->get_send_halo_vertices();
+    const std::vector<char> &is_send_vertex = _mesh->get_send_halo_flags();
+    int nsend = send_vertices.size();
+
+#pragma omp parallel for schedule(static)
+    for(int k=0; k<nsend; k++)
+      _metric[send_vertices[k]].get_metric(&(_mesh->metric[send_vertices[k]*(dim==2?3:6)]));
+
+    _mesh->template halo_update_begin<double, (dim==2?3:6)>(_mesh->metric);
+
+    // No other process needs the remaining vertices, so they are copied
+    // while the messages are in flight. Values copied to received halo
+    // vertices are overwritten when the update completes.
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_NNodes; i++){
+      if(!is_send_vertex[i])
         _metric[i].get_metric(&(_mesh->metric[i*(dim==2?3:6)]));
-      }
     }
-    
-    // Halo update if parallel
-    halo_update<double, (dim==2?3:6)>(_mesh->get_mpi_comm(), _mesh->send, _mesh->recv, _mesh->metric);
+
+    _mesh->template halo_update_end<double, (dim==2?3:6)>(_mesh->metric);
   }
 
+  /*! Methods for recovering the Hessian of a field.
+   * QUADRATIC_LEAST_SQUARES fits a quadratic to the patch around each
+   * vertex. L2_PROJECTION recovers the gradient and then the Hessian by
+   * lumped L2 projection of the element-wise gradients, which is much
+   * cheaper but less accurate.
+   */
+  enum hessian_recovery_t {QUADRATIC_LEAST_SQUARES, L2_PROJECTION};
+
   /*! Add the contribution from the metric field from a new field with a target linear interpolation error. 
+   * If a metric has already been set, the metric for the new field is
+   * intersected with it. This can be used to accumulate the metrics of a
+   * field sampled at several time levels, so that one adaptation resolves
+   * the solution over the whole time window; only the intersected metric
+   * is stored, and the Hessian recovery operator is reused for each sample.
+   * The operator is only valid while the vertex coordinates are unchanged;
+   * see clear_hessian_recovery().
+   * apply_nelements() can then be used to control the size of the mesh.
    * @param psi is field while curvature is to be considered.
    * @param target_error is the user target error for a given norm.
    * @param p_norm Set this optional argument to a positive integer to
    * apply the p-norm scaling to the metric, as in Chen, Sun and Xu,
    * Mathematics of Computation, Volume 76, Number 257, January 2007,
    * pp. 179-204.
+   * @param recovery selects how the Hessian of the field is recovered.
    */
-  void add_field(const real_t* psi, const real_t target_error, int p_norm=-1){
+  void add_field(const real_t* psi, const real_t target_error, int p_norm=-1,
+                 hessian_recovery_t recovery=QUADRATIC_LEAST_SQUARES){
+    add_fields(1, &psi, &target_error, p_norm, recovery);
+  }
+
+  /*! Add the contribution from the metric field from several fields,
+   * each with its own target linear interpolation error. This has the
+   * same effect as calling add_field() for each field in turn, but the
+   * Hessians of all the fields are recovered in a single pass.
+   * @param nfields is the number of fields.
+   * @param psi is an array of pointers to the fields.
+   * @param target_error is the user target error for each field.
+   * @param p_norm Set this optional argument to a positive integer to
+   * apply the p-norm scaling to the metric, see add_field().
+   * @param recovery selects how the Hessians of the fields are recovered.
+   */
+  void add_fields(int nfields, const real_t* const* psi, const real_t* target_error, int p_norm=-1,
+                  hessian_recovery_t recovery=QUADRATIC_LEAST_SQUARES){
+    if(nfields<1)
+      return;
+
     bool add_to=true;
     if(_metric==NULL){
       add_to = false;
       _metric = new MetricTensor<real_t,dim>[_NNodes];
     }
-    
-    real_t eta = 1.0/target_error;
+
+    std::vector<real_t> eta(nfields);
+    for(int k=0;k<nfields;k++)
+      eta[k] = 1.0/target_error[k];
+
+    if(recovery==L2_PROJECTION){
+      std::vector<real_t> hessian;
+      for(int k=0;k<nfields;k++){
+        hessian_l2_projection(psi[k], hessian);
+
+#pragma omp parallel for schedule(static)
+        for(int i=0; i<_NNodes; i++)
+          add_hessian(i, &(hessian[i*(dim==2?3:6)]), eta[k], p_norm, add_to || k>0);
+      }
+
+      return;
+    }
+
+    build_hessian_operator();
+
 #pragma omp parallel
     {
       // Calculate Hessian at each point.
-      double h[dim==2?3:6];
-
-      if(p_norm>0){
-#pragma omp for schedule(static) nowait
-        for(int i=0; i<_NNodes; i++){
-          hessian_qls_kernel(psi, i, h);
-          
-          double m_det;
-          if(dim==2){
-            /*|h[0] h[1]|
-              |h[1] h[2]|*/
-            m_det = fabs(h[0]*h[2]-h[1]*h[1]);
-          }else if(dim==3){
-            /*|h[0] h[1] h[2]|
-              |h[1] h[3] h[4]|
-              |h[2] h[4] h[5]|
-	      
-              sympy
-              h0,h1,h2,h3,h4,h5 = symbols("h[0], h[1], h[2], h[3], h[4], h[5]")
-              M = Matrix([[h0, h1, h2],
-                          [h1, h3, h4],
-                          [h2, h4, h5]])
-              print_ccode(det(M))
-            */
-            m_det = fabs(h[0]*h[3]*h[5] - h[0]*pow(h[4], 2) - pow(h[1], 2)*h[5] + 2*h[1]*h[2]*h[4] - pow(h[2], 2)*h[3]);
-          }
+      std::vector<real_t> h(nfields*(dim==2?3:6));
 
-          double scaling_factor = eta * pow(m_det+DBL_EPSILON, -1.0 / (2.0 * p_norm + dim));
-
-	  if(std::isnormal(scaling_factor)){
-	    for(int j=0;j<(dim==2?3:6);j++)
-	      h[j] *= scaling_factor;
-	  }else{
-	    if(dim==2){
-	      h[0] = min_eigenvalue; h[1] = 0.0;
-	                             h[2] = min_eigenvalue;
-	    }else{
-	      h[0] = min_eigenvalue; h[1] = 0.0;            h[2] = 0.0;
-	                             h[3] = min_eigenvalue; h[4] = 0.0;
-				                            h[5] = min_eigenvalue;
-	    }
-	  }
-
-          if(add_to){
-            // Merge this metric with the existing metric field.
-            _metric[i].constrain(h);
-          }else{
-            _metric[i].set_metric(h);
-          }
-        }
-      }else{
 #pragma omp for schedule(static)
-        for(int i=0; i<_NNodes; i++){
-          hessian_qls_kernel(psi, i, h);
-          
-          for(int j=0; j<(dim==2?3:6); j++)
-            h[j] *= eta;
-	  
-	  if(add_to){
-            // Merge this metric with the existing metric field.
-            _metric[i].constrain(h);
-          }else{
-            _metric[i].set_metric(h);
-          }
-        }
+      for(int i=0; i<_NNodes; i++){
+        hessian_qls_kernel(nfields, psi, i, &(h[0]));
+
+        for(int k=0;k<nfields;k++)
+          add_hessian(i, &(h[k*(dim==2?3:6)]), eta[k], p_norm, add_to || k>0);
       }
     }
   }
 
+  /*! Release the cached Hessian recovery operator and L2 projection
+   * weights. They are built from the vertex coordinates on first use, so
+   * this has to be called if the vertices are moved before more fields
+   * are added. It can also be used to free the memory once all the fields
+   * have been added.
+   */
+  void clear_hessian_recovery(){
+    std::vector<index_t>().swap(hessian_offsets);
+    std::vector<index_t>().swap(hessian_patch);
+    std::vector<real_t>().swap(hessian_pinv);
+
+    std::vector<real_t>().swap(l2_volume);
+    std::vector<real_t>().swap(l2_basis_gradient);
+    std::vector<real_t>().swap(l2_inv_mass);
+  }
+
+  /// Constraints on the metric tensor field; see add_constraint().
+  enum constraint_t {MAX_EDGE_LENGTH, MIN_EDGE_LENGTH, MAX_ASPECT_RATIO,
+                     NELEMENTS, MAX_NELEMENTS, MIN_NELEMENTS};
+
+  /*! Add a constraint to the list applied by apply_constraints(). The
+   * constraints are applied in the order in which they are added, with the
+   * same effect as calling the corresponding apply_* methods in turn.
+   * @param type the constraint.
+   * @param value the edge length, aspect ratio or number of elements.
+   * @param field optional edge length at each vertex, used instead of value.
+   * It holds one entry per vertex of the field and is copied, so it does not
+   * have to outlive this call.
+   */
+  void add_constraint(constraint_t type, real_t value, const real_t *field=NULL){
+    constraint c;
+    c.type = type;
+    c.value = value;
+    c.field = NULL;
+    constraints.push_back(c);
+    if(field!=NULL)
+      constraints.back().values.assign(field, field+_NNodes);
+  }
+
+  /// Remove all constraints added by add_constraint().
+  void clear_constraints(){
+    constraints.clear();
+  }
+
+  /*! Apply the constraints added by add_constraint(). Each tensor is
+   * decomposed once and all of the constraints are applied to its
+   * eigenvalues before it is recomposed, so the field is swept once plus
+   * once after each group of element number constraints.
+   */
+  void apply_constraints(){
+    for(size_t k=0;k<constraints.size();k++)
+      constraints[k].field = constraints[k].values.empty()?NULL:&(constraints[k].values[0]);
+    apply_constraints(constraints);
+  }
+
   /*! Apply maximum edge length constraint.
    * @param max_len specifies the maximum allowed edge length.
    */
   void apply_max_edge_length(real_t max_len){
-    real_t M[dim==2?3:6];
-    real_t m = 1.0/(max_len*max_len);
-
-    if(dim==2){
-      M[0] = m;
-      M[1] = 0.0;
-      M[2] = m;
-    }else if(dim==3){
-      M[0] = m;
-      M[1] = 0.0;
-      M[2] = 0.0;
-      M[3] = m;
-      M[4] = 0.0;
-      M[5] = m;
-    }
-
-#pragma omp parallel
-    {
-#pragma omp for schedule(static)
-      for(int i=0;i<_NNodes;i++)
-        _metric[i].constrain(&(M[0]));
-    }
+    std::vector<constraint> c(1);
+    c[0].type = MAX_EDGE_LENGTH;
+    c[0].value = max_len;
+    c[0].field = NULL;
+    apply_constraints(c);
   }
 
   /*! Apply minimum edge length constraint.
    * @param min_len specifies the minimum allowed edge length globally.
    */
   void apply_min_edge_length(real_t min_len){
-    real_t M[dim==2?3:6];
-    double m = 1.0/(min_len*min_len);
-
-    if(dim==2){
-      M[0] = m;
-      M[1] = 0.0;
-      M[2] = m;
-    }else if(dim==3){
-      M[0] = m;
-      M[1] = 0.0;
-      M[2] = 0.0;
-      M[3] = m;
-      M[4] = 0.0;
-      M[5] = m;
-    }
-
-#pragma omp parallel
-    {
-#pragma omp for schedule(static)
-      for(int i=0;i<_NNodes;i++)
-        _metric[i].constrain(M, false);
-    }
+    std::vector<constraint> c(1);
+    c[0].type = MIN_EDGE_LENGTH;
+    c[0].value = min_len;
+    c[0].field = NULL;
+    apply_constraints(c);
   }
 
   /*! Apply minimum edge length constraint.
    * @param min_len specifies the minimum allowed edge length locally at each vertex.
    */
   void apply_min_edge_length(const real_t *min_len){
-#pragma omp parallel
-    {
-      real_t M[dim==2?3:6];
-#pragma omp for schedule(static)
-      for(int n=0;n<_NNodes;n++){
-        double m = 1.0/(min_len[n]*min_len[n]);
-
-        if(dim==2){
-          M[0] = m;
-          M[1] = 0.0;
-          M[2] = m;
-        }else if(dim==3){
-          M[0] = m;
-          M[1] = 0.0;
-          M[2] = 0.0;
-          M[3] = m;
-          M[4] = 0.0;
-          M[5] = m;
-        }
-
-        _metric[n].constrain(M, false);
-      }
-    }
+    std::vector<constraint> c(1);
+    c[0].type = MIN_EDGE_LENGTH;
+    c[0].value = 0;
+    c[0].field = min_len;
+    apply_constraints(c);
   }
 
   /*! Apply maximum aspect ratio constraint.
    * @param max_aspect_ratio maximum aspect ratio for elements.
    */
   void apply_max_aspect_ratio(real_t max_aspect_ratio){
-#pragma omp parallel
-    {
-#pragma omp for schedule(static)
-      for(int i=0;i<_NNodes;i++)
-        _metric[i].limit_aspect_ratio(max_aspect_ratio);
-    }
+    std::vector<constraint> c(1);
+    c[0].type = MAX_ASPECT_RATIO;
+    c[0].value = max_aspect_ratio;
+    c[0].field = NULL;
+    apply_constraints(c);
   }
 
   /*! Apply maximum number of elements constraint.
    * @param nelements the maximum number of elements desired.
    */
   void apply_max_nelements(real_t nelements){
-    int predicted = predict_nelements();
-    if(predicted>nelements)
-      apply_nelements(nelements);
+    std::vector<constraint> c(1);
+    c[0].type = MAX_NELEMENTS;
+    c[0].value = nelements;
+    c[0].field = NULL;
+    apply_constraints(c);
   }
 
   /*! Apply minimum number of elements constraint.
    * @param nelements the minimum number of elements desired.
    */
   void apply_min_nelements(real_t nelements){
-    int predicted = predict_nelements();
-    if(predicted<nelements)
-      apply_nelements(nelements);
+    std::vector<constraint> c(1);
+    c[0].type = MIN_NELEMENTS;
+    c[0].value = nelements;
+    c[0].field = NULL;
+    apply_constraints(c);
   }
 
   /*! Apply required number of elements.
    * @param nelements is the required number of elements after adapting.
    */
   void apply_nelements(real_t nelements){
-    double scale_factor = nelements/predict_nelements();
-    if(dim==3)
-      scale_factor = pow(scale_factor, 2.0/3.0);
+    std::vector<constraint> c(1);
+    c[0].type = NELEMENTS;
+    c[0].value = nelements;
+    c[0].field = NULL;
+    apply_constraints(c);
+  }
+
+  /*! Limit the gradation of the metric tensor field. Along each edge
+   * (i, j) the metric at j is intersected with the metric at i scaled by
+   * (1 + l*log(beta))^-2, where l is the length of the edge measured with
+   * the metric at i, so that the element size grows by at most a factor of
+   * beta per unit length in metric space. See F. Alauzet, Size gradation
+   * control of anisotropic meshes, Finite Elements in Analysis and Design
+   * 46 (2010) 181-202. Each sweep only visits the neighbours of the
+   * vertices which changed in the previous sweep, until a fixed point is
+   * reached.
+   * @param beta maximum allowed growth in element size (beta>1).
+   * @return the number of iterations taken.
+   */
+  int apply_gradation(real_t beta){
+    assert(_metric!=NULL);
+    assert(beta>1.0);
+
+    const int msize = (dim==2?3:6);
+    const real_t log_beta = log(beta);
+    const real_t tol = 1.0e-6;
+
+    std::vector<real_t> metric(_NNodes*msize), next;
+    std::vector<char> changed(_NNodes, 1);
+    std::vector<int> is_active(_NNodes, 0);
+
+    // Vertices which changed in the last sweep, and the owned vertices
+    // next to them which are visited in the next sweep.
+    std::vector<index_t> changed_list(_NNodes), active;
+
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_NNodes; i++){
+      _metric[i].get_metric(&(metric[i*msize]));
+      changed_list[i] = i;
+    }
+
+#ifdef HAVE_MPI
+    std::vector<index_t> recv_halo;
+    if(nprocs>1){
+      _mesh->template halo_update<real_t, msize>(metric);
+
+      for(typename std::vector< std::vector<index_t> >::const_iterator r=_mesh->recv.begin(); r!=_mesh->recv.end(); ++r)
+        recv_halo.insert(recv_halo.end(), r->begin(), r->end());
+    }
+#endif
+
+    next = metric;
 
+    int iteration = 0;
+    for(;;){
+      int nchanged = changed_list.size();
+      active.clear();
 #pragma omp parallel
-    {
-#pragma omp for schedule(static)
-      for(int i=0;i<_NNodes;i++)
-        _metric[i].scale(scale_factor);
+      {
+        std::vector<index_t> local_active;
+#pragma omp for schedule(guided) nowait
+        for(int k=0; k<nchanged; k++){
+          index_t v = changed_list[k];
+          for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[v].begin(); n!=_mesh->NNList[v].end(); ++n){
+            if(!_mesh->is_owned_node(*n))
+              continue;
+
+            int was_active;
+#pragma omp atomic capture
+            {
+              was_active = is_active[*n];
+              is_active[*n] = 1;
+            }
+            if(!was_active)
+              local_active.push_back(*n);
+          }
+        }
+
+#pragma omp critical
+        active.insert(active.end(), local_active.begin(), local_active.end());
+      }
+
+      int nactive = active.size();
+      int gactive = nactive;
+#ifdef HAVE_MPI
+      if(nprocs>1)
+        MPI_Allreduce(&nactive, &gactive, 1, MPI_INT, MPI_SUM, _mesh->get_mpi_comm());
+#endif
+      if(gactive==0)
+        break;
+
+      iteration++;
+
+#pragma omp parallel for schedule(guided)
+      for(int k=0; k<nactive; k++){
+        index_t i = active[k];
+        const real_t *x = _mesh->get_coords(i);
+        MetricTensor<real_t,dim> M(&(metric[i*msize]));
+        for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[i].begin(); n!=_mesh->NNList[i].end(); ++n){
+          if(!changed[*n])
+            continue;
+
+          const real_t *m = &(metric[(*n)*msize]);
+          const real_t *y = _mesh->get_coords(*n);
+          real_t e[dim];
+          for(int j=0;j<dim;j++)
+            e[j] = x[j]-y[j];
+
+          real_t l;
+          if(dim==2)
+            l = sqrt(e[0]*(m[0]*e[0]+m[1]*e[1]) + e[1]*(m[1]*e[0]+m[2]*e[1]));
+          else
+            l = sqrt(e[0]*(m[0]*e[0]+m[1]*e[1]+m[2]*e[2]) +
+                     e[1]*(m[1]*e[0]+m[3]*e[1]+m[4]*e[2]) +
+                     e[2]*(m[2]*e[0]+m[4]*e[1]+m[5]*e[2]));
+
+          real_t eta = 1.0/pow(1.0+l*log_beta, 2);
+          real_t grown[msize];
+          for(int j=0;j<msize;j++)
+            grown[j] = eta*m[j];
+
+          M.constrain(grown);
+        }
+        M.get_metric(&(next[i*msize]));
+      }
+
+#ifdef HAVE_MPI
+      if(nprocs>1)
+        _mesh->template halo_update<real_t, msize>(next);
+#endif
+
+#pragma omp parallel for schedule(static)
+      for(int k=0; k<nchanged; k++)
+        changed[changed_list[k]] = 0;
+
+      // Only the active vertices and the received halo vertices can have
+      // changed in this sweep.
+#ifdef HAVE_MPI
+      active.insert(active.end(), recv_halo.begin(), recv_halo.end());
+#endif
+      int nvisited = active.size();
+
+      changed_list.clear();
+#pragma omp parallel
+      {
+        std::vector<index_t> local_changed;
+#pragma omp for schedule(static) nowait
+        for(int k=0; k<nvisited; k++){
+          index_t i = active[k];
+          is_active[i] = 0;
+
+          real_t norm=0, delta=0;
+          for(int j=0;j<msize;j++){
+            norm = std::max(norm, fabs(metric[i*msize+j]));
+            delta = std::max(delta, fabs(next[i*msize+j]-metric[i*msize+j]));
+            metric[i*msize+j] = next[i*msize+j];
+          }
+          if(delta>tol*norm){
+            changed[i] = 1;
+            local_changed.push_back(i);
+          }
+        }
+
+#pragma omp critical
+        changed_list.insert(changed_list.end(), local_changed.begin(), local_changed.end());
+      }
     }
+
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_NNodes; i++)
+      _metric[i].set_metric(&(metric[i*msize]));
+
+    return iteration;
   }
 
   /*! Predict the number of elements in this partition when mesh satisfies metric tensor field.
@@ -768,100 +1098,543 @@ void fit_ellipsoid(int i, real_t *sm){
   }
 
  private:
-  
-  /// Least squared Hessian recovery.
-  void hessian_qls_kernel(const real_t *psi, int i, real_t *Hessian){
-    int min_patch_size = (dim==2?6:15); // In 3D, 10 is the minimum but can give crappy results.
 
-    std::set<index_t> patch = _mesh->get_node_patch(i, min_patch_size);
-    patch.insert(i);
+  struct constraint{
+    constraint_t type;
+    real_t value;
+    const real_t *field;
+    std::vector<real_t> values; // Copy of the field given to add_constraint().
+  };
 
-    if(dim==2){
-      // Form quadratic system to be solved. The quadratic fit is:
-      // P = a0*y^2+a1*x^2+a2*x*y+a3*y+a4*x+a5
-      // A = P^TP
-      Eigen::Matrix<real_t, 6, 6> A = Eigen::Matrix<real_t, 6, 6>::Zero(6,6);
-      Eigen::Matrix<real_t, 6, 1> b = Eigen::Matrix<real_t, 6, 1>::Zero(6);
+  static bool is_nelements_constraint(constraint_t type){
+    return type==NELEMENTS || type==MAX_NELEMENTS || type==MIN_NELEMENTS;
+  }
 
-      real_t x0=_mesh->_coords[i*2], y0=_mesh->_coords[i*2+1];
-      
-      for(typename std::set<index_t>::const_iterator n=patch.begin(); n!=patch.end(); n++){
-        real_t x=_mesh->_coords[(*n)*2]-x0, y=_mesh->_coords[(*n)*2+1]-y0;
+  /*! Apply a list of constraints. The list is split into runs of
+   * constraints on the eigenvalues of each tensor, which are applied in
+   * one sweep over the vertices, separated by element number constraints.
+   * The element number constraints need the predicted number of elements
+   * for the field as it stands, which is calculated once for each group
+   * and then scaled, and the scaling they impose is folded into the next
+   * sweep. The eigen-decomposition from the first sweep is kept for later
+   * sweeps.
+   */
+  void apply_constraints(const std::vector<constraint> &list){
+    assert(_metric!=NULL);
 
-        A[0]+=y*y*y*y;
-        A[6]+=x*x*y*y;  A[7]+=x*x*x*x;
-        A[12]+=x*y*y*y; A[13]+=x*x*x*y; A[14]+=x*x*y*y;
-        A[18]+=y*y*y;   A[19]+=x*x*y;   A[20]+=x*y*y;   A[21]+=y*y;
-        A[24]+=x*y*y;   A[25]+=x*x*x;   A[26]+=x*x*y;   A[27]+=x*y; A[28]+=x*x;
-        A[30]+=y*y;     A[31]+=x*x;     A[32]+=x*y;     A[33]+=y;   A[34]+=x;   A[35]+=1;
+    std::vector<real_t> D, V;
+    bool decomposed = false;
+    real_t scale = 1.0;
+
+    size_t begin = 0;
+    while(true){
+      size_t end = begin;
+      while(end<list.size() && !is_nelements_constraint(list[end].type))
+        end++;
+
+      bool keep = end<list.size();
+      if(begin<end){
+        if(keep && D.empty()){
+          D.resize(_NNodes*dim);
+          V.resize(_NNodes*dim*dim);
+        }
+
+#pragma omp parallel for schedule(static)
+        for(int i=0;i<_NNodes;i++){
+          real_t d[dim], v[dim*dim];
+          if(decomposed){
+            for(int j=0;j<dim;j++)
+              d[j] = D[i*dim+j];
+            for(int j=0;j<dim*dim;j++)
+              v[j] = V[i*dim*dim+j];
+          }else{
+            _metric[i].eigen_decomp(d, v);
+          }
+
+          for(int j=0;j<dim;j++)
+            d[j] *= scale;
+
+          for(size_t k=begin;k<end;k++)
+            apply_constraint(list[k], i, d);
+
+          if(keep){
+            for(int j=0;j<dim;j++)
+              D[i*dim+j] = d[j];
+            for(int j=0;j<dim*dim;j++)
+              V[i*dim*dim+j] = v[j];
+          }
 
-        b[0]+=psi[*n]*y*y; b[1]+=psi[*n]*x*x; b[2]+=psi[*n]*x*y; b[3]+=psi[*n]*y; b[4]+=psi[*n]*x; b[5]+=psi[*n];
+          _metric[i].eigen_undecomp(d, v);
+        }
+
+        decomposed = keep;
+        scale = 1.0;
+      }else if(scale!=1.0){
+#pragma omp parallel for schedule(static)
+        for(int i=0;i<_NNodes;i++)
+          _metric[i].scale(scale);
+
+        if(decomposed)
+          for(size_t i=0;i<D.size();i++)
+            D[i] *= scale;
+
+        scale = 1.0;
       }
-      A[1] = A[6]; A[2] = A[12]; A[3] = A[18]; A[4] = A[24]; A[5] = A[30];
-                   A[8] = A[13]; A[9] = A[19]; A[10]= A[25]; A[11]= A[31];
-                                 A[15]= A[20]; A[16]= A[26]; A[17]= A[32];
-                                               A[22]= A[27]; A[23]= A[33];
-                                                             A[29]= A[34];
 
-      Eigen::Matrix<real_t, 6, 1> a = Eigen::Matrix<real_t, 6, 1>::Zero(6);
-      A.svd().solve(b, &a);
+      if(!keep)
+        break;
 
-      Hessian[0] = 2*a[1]; // d2/dx2
-      Hessian[1] = a[2];   // d2/dxdy
-      Hessian[2] = 2*a[0]; // d2/dy2
+      // The predicted number of elements scales as scale^(dim/2).
+      real_t predicted = predict_nelements();
+      for(begin=end;begin<list.size() && is_nelements_constraint(list[begin].type);begin++){
+        real_t target = list[begin].value;
+        if((list[begin].type==MAX_NELEMENTS && predicted<=target) ||
+           (list[begin].type==MIN_NELEMENTS && predicted>=target))
+          continue;
 
-    }else if(dim==3){
-      // Form quadratic system to be solved. The quadratic fit is:
-      // P = 1 + x + y + z + x^2 + y^2 + z^2 + xy + xz + yz
-      // A = P^TP
-      Eigen::Matrix<real_t, 10, 10> A = Eigen::Matrix<real_t, 10, 10>::Zero(10,10);
-      Eigen::Matrix<real_t, 10, 1> b = Eigen::Matrix<real_t, 10, 1>::Zero(10);
-
-      real_t x0=_mesh->_coords[i*3], y0=_mesh->_coords[i*3+1], z0=_mesh->_coords[i*3+2];
-      assert(std::isfinite(x0));
-      assert(std::isfinite(y0));
-      assert(std::isfinite(z0));
-
-      for(typename std::set<index_t>::const_iterator n=patch.begin(); n!=patch.end(); n++){
-        real_t x=_mesh->_coords[(*n)*3]-x0, y=_mesh->_coords[(*n)*3+1]-y0, z=_mesh->_coords[(*n)*3+2]-z0;
-        assert(std::isfinite(x));
-        assert(std::isfinite(y));
-        assert(std::isfinite(z));
-        assert(std::isfinite(psi[*n]));
-
-        A[0]+=1;
-        A[10]+=x;   A[11]+=x*x;
-        A[20]+=y;   A[21]+=x*y;   A[22]+=y*y;
-        A[30]+=z;   A[31]+=x*z;   A[32]+=y*z;   A[33]+=z*z;
-        A[40]+=x*x; A[41]+=x*x*x; A[42]+=x*x*y; A[43]+=x*x*z; A[44]+=x*x*x*x;
-        A[50]+=x*y; A[51]+=x*x*y; A[52]+=x*y*y; A[53]+=x*y*z; A[54]+=x*x*x*y; A[55]+=x*x*y*y;
-        A[60]+=x*z; A[61]+=x*x*z; A[62]+=x*y*z; A[63]+=x*z*z; A[64]+=x*x*x*z; A[65]+=x*x*y*z; A[66]+=x*x*z*z;
-        A[70]+=y*y; A[71]+=x*y*y; A[72]+=y*y*y; A[73]+=y*y*z; A[74]+=x*x*y*y; A[75]+=x*y*y*y; A[76]+=x*y*y*z; A[77]+=y*y*y*y;
-        A[80]+=y*z; A[81]+=x*y*z; A[82]+=y*y*z; A[83]+=y*z*z; A[84]+=x*x*y*z; A[85]+=x*y*y*z; A[86]+=x*y*z*z; A[87]+=y*y*y*z; A[88]+=y*y*z*z;
-        A[90]+=z*z; A[91]+=x*z*z; A[92]+=y*z*z; A[93]+=z*z*z; A[94]+=x*x*z*z; A[95]+=x*y*z*z; A[96]+=x*z*z*z; A[97]+=y*y*z*z; A[98]+=y*z*z*z; A[99]+=z*z*z*z;
-
-        b[0]+=psi[*n]*1; b[1]+=psi[*n]*x; b[2]+=psi[*n]*y; b[3]+=psi[*n]*z; b[4]+=psi[*n]*x*x; b[5]+=psi[*n]*x*y; b[6]+=psi[*n]*x*z; b[7]+=psi[*n]*y*y; b[8]+=psi[*n]*y*z; b[9]+=psi[*n]*z*z;
+        real_t scale_factor = target/predicted;
+        if(dim==3)
+          scale_factor = pow(scale_factor, 2.0/3.0);
+
+        scale *= scale_factor;
+        predicted = target;
       }
-      
-      A[1] = A[10]; A[2]  = A[20]; A[3]  = A[30]; A[4]  = A[40]; A[5]  = A[50]; A[6]  = A[60]; A[7]  = A[70]; A[8]  = A[80]; A[9]  = A[90];
-                    A[12] = A[21]; A[13] = A[31]; A[14] = A[41]; A[15] = A[51]; A[16] = A[61]; A[17] = A[71]; A[18] = A[81]; A[19] = A[91];
-                                   A[23] = A[32]; A[24] = A[42]; A[25] = A[52]; A[26] = A[62]; A[27] = A[72]; A[28] = A[82]; A[29] = A[92];
-                                                  A[34] = A[43]; A[35] = A[53]; A[36] = A[63]; A[37] = A[73]; A[38] = A[83]; A[39] = A[93];
-                                                                 A[45] = A[54]; A[46] = A[64]; A[47] = A[74]; A[48] = A[84]; A[49] = A[94];
-                                                                                A[56] = A[65]; A[57] = A[75]; A[58] = A[85]; A[59] = A[95];
-                                                                                               A[67] = A[76]; A[68] = A[86]; A[69] = A[96];
-                                                                                                              A[78] = A[87]; A[79] = A[97];
-                                                                                                                             A[89] = A[98];
+    }
+  }
+
+  /// Apply a constraint to the eigenvalues of the metric at a vertex.
+  inline void apply_constraint(const constraint &c, int i, real_t *d) const{
+    switch(c.type){
+    case MAX_EDGE_LENGTH:{
+      real_t len = (c.field==NULL)?c.value:c.field[i];
+      for(int j=0;j<dim;j++)
+        d[j] = std::max(d[j], (real_t)(1.0/(len*len)));
+      break;
+    }
+    case MIN_EDGE_LENGTH:{
+      real_t len = (c.field==NULL)?c.value:c.field[i];
+      for(int j=0;j<dim;j++)
+        d[j] = std::min(d[j], (real_t)(1.0/(len*len)));
+      break;
+    }
+    case MAX_ASPECT_RATIO:{
+      real_t max_eigenvalue = d[0];
+      for(int j=1;j<dim;j++)
+        max_eigenvalue = std::max(max_eigenvalue, d[j]);
+      real_t min_aspect_eigenvalue = max_eigenvalue/(c.value*c.value);
+      for(int j=0;j<dim;j++)
+        d[j] = std::max(d[j], min_aspect_eigenvalue);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  /// Relax the metric on the mesh at vertex i towards the metric field.
+  void relax_metric(int i, double omega){
+    double M[dim==2?3:6];
+    _metric[i].get_metric(M);
+    for(int j=0; j<(dim==2?3:6); j++)
+      _mesh->metric[i*(dim==2?3:6)+j] = (1.0-omega)*_mesh->metric[i*(dim==2?3:6)+j] + omega*M[j];
+    MetricTensor<real_t,dim>::positive_definiteness(&(_mesh->metric[i*(dim==2?3:6)]));
+  }
+
+  /// Scale a recovered Hessian into a metric and merge it into the metric at vertex i.
+  void add_hessian(int i, real_t *h, real_t eta, int p_norm, bool add_to){
+    if(p_norm>0){
+      double m_det;
+      if(dim==2){
+        /*|h[0] h[1]|
+          |h[1] h[2]|*/
+        m_det = fabs(h[0]*h[2]-h[1]*h[1]);
+      }else if(dim==3){
+        /*|h[0] h[1] h[2]|
+          |h[1] h[3] h[4]|
+          |h[2] h[4] h[5]|
+
+          sympy
+          h0,h1,h2,h3,h4,h5 = symbols("h[0], h[1], h[2], h[3], h[4], h[5]")
+          M = Matrix([[h0, h1, h2],
+                      [h1, h3, h4],
+                      [h2, h4, h5]])
+          print_ccode(det(M))
+        */
+        m_det = fabs(h[0]*h[3]*h[5] - h[0]*pow(h[4], 2) - pow(h[1], 2)*h[5] + 2*h[1]*h[2]*h[4] - pow(h[2], 2)*h[3]);
+      }
+
+      double scaling_factor = eta * pow(m_det+DBL_EPSILON, -1.0 / (2.0 * p_norm + dim));
+
+      if(std::isnormal(scaling_factor)){
+        for(int j=0;j<(dim==2?3:6);j++)
+          h[j] *= scaling_factor;
+      }else{
+        if(dim==2){
+          h[0] = min_eigenvalue; h[1] = 0.0;
+                                 h[2] = min_eigenvalue;
+        }else{
+          h[0] = min_eigenvalue; h[1] = 0.0;            h[2] = 0.0;
+                                 h[3] = min_eigenvalue; h[4] = 0.0;
+                                                        h[5] = min_eigenvalue;
+        }
+      }
+    }else{
+      for(int j=0; j<(dim==2?3:6); j++)
+        h[j] *= eta;
+    }
+
+    if(add_to){
+      // Merge this metric with the existing metric field.
+      _metric[i].constrain(h);
+    }else{
+      _metric[i].set_metric(h);
+    }
+  }
+
+  /*! Calculate the lumped L2 projection weights: the volume of each
+   * element divided between its vertices, the gradients of its basis
+   * functions, and the inverse of the lumped mass at each vertex. They
+   * are kept until clear_hessian_recovery() is called.
+   */
+  void build_l2_projection(){
+    if(!l2_inv_mass.empty())
+      return;
+
+    const int nloc = dim+1;
+    l2_volume.resize(_NElements);
+    l2_basis_gradient.resize(_NElements*nloc*dim);
+    l2_inv_mass.resize(_NNodes);
+
+#pragma omp parallel
+    {
+#pragma omp for schedule(static)
+      for(int e=0; e<_NElements; e++){
+        const index_t *n = _mesh->get_element(e);
+        if(n[0]<0){
+          l2_volume[e] = 0.0;
+          continue;
+        }
+
+        // J = [x1-x0, x2-x0(, x3-x0)]; the gradients of the basis
+        // functions of vertices 1..dim are the rows of J^{-1}.
+        const real_t *x0 = _mesh->get_coords(n[0]);
+        real_t J[dim][dim];
+        for(int k=1;k<nloc;k++){
+          const real_t *x = _mesh->get_coords(n[k]);
+          for(int j=0;j<dim;j++)
+            J[j][k-1] = x[j]-x0[j];
+        }
+
+        real_t inv[dim][dim], det;
+        if(dim==2){
+          det = J[0][0]*J[1][1]-J[0][1]*J[1][0];
+          inv[0][0] =  J[1][1]/det; inv[0][1] = -J[0][1]/det;
+          inv[1][0] = -J[1][0]/det; inv[1][1] =  J[0][0]/det;
+        }else{
+          real_t c[3][3];
+          for(int r=0;r<3;r++)
+            for(int q=0;q<3;q++)
+              c[r][q] = J[(q+1)%3][(r+1)%3]*J[(q+2)%3][(r+2)%3] - J[(q+1)%3][(r+2)%3]*J[(q+2)%3][(r+1)%3];
+          det = J[0][0]*c[0][0]+J[0][1]*c[1][0]+J[0][2]*c[2][0];
+          for(int r=0;r<3;r++)
+            for(int q=0;q<3;q++)
+              inv[r][q] = c[r][q]/det;
+        }
 
-      Eigen::Matrix<real_t, 10, 1> a = Eigen::Matrix<real_t, 10, 1>::Zero(10);
-      A.svd().solve(b, &a);
+        real_t *grad = &(l2_basis_gradient[e*nloc*dim]);
+        for(int j=0;j<dim;j++){
+          grad[j] = 0.0;
+          for(int k=1;k<nloc;k++){
+            grad[k*dim+j] = inv[k-1][j];
+            grad[j] -= inv[k-1][j];
+          }
+        }
+
+        l2_volume[e] = fabs(det)/(dim==2?2.0:6.0)/nloc;
+      }
+
+#pragma omp for schedule(static)
+      for(int i=0; i<_NNodes; i++){
+        real_t mass = 0.0;
+        for(typename std::set<index_t>::const_iterator e=_mesh->NEList[i].begin(); e!=_mesh->NEList[i].end(); ++e)
+          mass += l2_volume[*e];
+        l2_inv_mass[i] = (mass>0.0)?1.0/mass:0.0;
+      }
+    }
+  }
+
+  /*! Recover the gradient of a field with ncomponents values per vertex
+   * by lumped L2 projection of its element-wise gradient. The gradient of
+   * component c is stored in grad[(i*ncomponents+c)*dim...].
+   */
+  void l2_projection_gradient(const real_t *psi, int ncomponents, std::vector<real_t> &element_grad, std::vector<real_t> &grad){
+    const int nloc = dim+1;
+    const int ngrad = ncomponents*dim;
+    element_grad.resize(_NElements*ngrad);
+    grad.resize(_NNodes*ngrad);
 
-      Hessian[0] = a[4]*2.0; // d2/dx2
-      Hessian[1] = a[5];     // d2/dxdy
-      Hessian[2] = a[6];     // d2/dxdz
-      Hessian[3] = a[7]*2.0; // d2/dy2
-      Hessian[4] = a[8];     // d2/dydz
-      Hessian[5] = a[9]*2.0; // d2/dz2
+#pragma omp parallel
+    {
+#pragma omp for schedule(static)
+      for(int e=0; e<_NElements; e++){
+        const index_t *n = _mesh->get_element(e);
+        real_t *g = &(element_grad[e*ngrad]);
+        for(int j=0;j<ngrad;j++)
+          g[j] = 0.0;
+        if(n[0]<0)
+          continue;
+
+        const real_t *basis = &(l2_basis_gradient[e*nloc*dim]);
+        for(int k=0;k<nloc;k++)
+          for(int c=0;c<ncomponents;c++){
+            real_t v = psi[n[k]*ncomponents+c]*l2_volume[e];
+            for(int j=0;j<dim;j++)
+              g[c*dim+j] += v*basis[k*dim+j];
+          }
+      }
+
+#pragma omp for schedule(static)
+      for(int i=0; i<_NNodes; i++){
+        real_t *g = &(grad[i*ngrad]);
+        for(int j=0;j<ngrad;j++)
+          g[j] = 0.0;
+        for(typename std::set<index_t>::const_iterator e=_mesh->NEList[i].begin(); e!=_mesh->NEList[i].end(); ++e)
+          for(int j=0;j<ngrad;j++)
+            g[j] += element_grad[(*e)*ngrad+j];
+        for(int j=0;j<ngrad;j++)
+          g[j] *= l2_inv_mass[i];
+      }
+    }
+  }
+
+  /*! Hessian recovery by double lumped L2 projection: the gradient is
+   * recovered at the vertices, and the Hessian is then recovered from the
+   * gradient in the same way and symmetrised. The recovered gradient is
+   * only first order accurate on the boundary, so the Hessian at and next
+   * to the boundary is taken from the interior.
+   */
+  void hessian_l2_projection(const real_t *psi, std::vector<real_t> &hessian){
+    build_l2_projection();
+
+    std::vector<real_t> element_grad, grad, grad2;
+    l2_projection_gradient(psi, 1, element_grad, grad);
+#ifdef HAVE_MPI
+    if(nprocs>1)
+      _mesh->template halo_update<real_t, dim>(grad);
+#endif
+    l2_projection_gradient(&(grad[0]), dim, element_grad, grad2);
+
+    hessian.resize(_NNodes*(dim==2?3:6));
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_NNodes; i++){
+      const real_t *H = &(grad2[i*dim*dim]);
+      real_t *h = &(hessian[i*(dim==2?3:6)]);
+      if(dim==2){
+        h[0] = H[0]; h[1] = 0.5*(H[1]+H[2]); h[2] = H[3];
+      }else{
+        h[0] = H[0]; h[1] = 0.5*(H[1]+H[3]); h[2] = 0.5*(H[2]+H[6]);
+        h[3] = H[4]; h[4] = 0.5*(H[5]+H[7]);
+        h[5] = H[8];
+      }
+    }
+
+    if(_mesh->boundary.empty())
+      return;
+
+    // The Hessian is polluted at the boundary vertices and their
+    // neighbours. Starting from the reliable interior, replace it in waves
+    // by the average over the neighbours which have already been set.
+    const std::vector<char> &on_boundary = _mesh->get_boundary_nodes();
+    std::vector<char> reliable(_NNodes), updated(_NNodes, 0);
+#pragma omp parallel for schedule(static)
+    for(int i=0; i<_NNodes; i++){
+      reliable[i] = !on_boundary[i];
+      for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[i].begin(); reliable[i] && n!=_mesh->NNList[i].end(); ++n)
+        if(on_boundary[*n])
+          reliable[i] = 0;
+    }
+
+    for(;;){
+      int nupdated = 0;
+#pragma omp parallel
+      {
+        // Only unreliable vertices are written and only reliable vertices are read.
+#pragma omp for schedule(static) reduction(+:nupdated)
+        for(int i=0; i<_NNodes; i++){
+          if(reliable[i])
+            continue;
+
+          real_t h[dim==2?3:6] = {0};
+          int cnt = 0;
+          for(typename std::vector<index_t>::const_iterator n=_mesh->NNList[i].begin(); n!=_mesh->NNList[i].end(); ++n){
+            if(!reliable[*n])
+              continue;
+            for(int j=0;j<(dim==2?3:6);j++)
+              h[j] += hessian[(*n)*(dim==2?3:6)+j];
+            cnt++;
+          }
+          if(cnt>0){
+            for(int j=0;j<(dim==2?3:6);j++)
+              hessian[i*(dim==2?3:6)+j] = h[j]/cnt;
+            updated[i] = 1;
+            nupdated++;
+          }
+        }
+
+#pragma omp for schedule(static)
+        for(int i=0; i<_NNodes; i++){
+          if(updated[i]){
+            reliable[i] = 1;
+            updated[i] = 0;
+          }
+        }
+      }
+
+      if(nupdated==0)
+        break;
+    }
+  }
+
+  /*! Monomials of the quadratic fit used for Hessian recovery.
+   * 2D: P = a0*y^2+a1*x^2+a2*x*y+a3*y+a4*x+a5
+   * 3D: P = 1 + x + y + z + x^2 + x*y + x*z + y^2 + y*z + z^2
+   */
+  static inline void quadratic_basis(const real_t *x, real_t *p){
+    if(dim==2){
+      p[0] = x[1]*x[1]; p[1] = x[0]*x[0]; p[2] = x[0]*x[1];
+      p[3] = x[1];      p[4] = x[0];      p[5] = 1.0;
+    }else{
+      p[0] = 1.0;       p[1] = x[0];      p[2] = x[1];      p[3] = x[2];
+      p[4] = x[0]*x[0]; p[5] = x[0]*x[1]; p[6] = x[0]*x[2];
+      p[7] = x[1]*x[1]; p[8] = x[1]*x[2]; p[9] = x[2]*x[2];
+    }
+  }
+
+  /*! Build the least squares Hessian recovery operator. The quadratic fit
+   * at each vertex only depends on the geometry of its patch, so the patch
+   * (stored CSR) and the rows of the pseudo-inverse of the normal
+   * equations that give the second derivatives are calculated once and
+   * reused for every field, until clear_hessian_recovery() is called.
+   */
+  void build_hessian_operator(){
+    if(!hessian_offsets.empty())
+      return;
+
+    const int nbasis = (dim==2?6:10);
+    const int nhessian = (dim==2?3:6);
+    int min_patch_size = (dim==2?6:15); // In 3D, 10 is the minimum but can give crappy results.
+
+    // Index of the monomial giving each Hessian component, and its coefficient.
+    const int hessian_basis_2d[] = {1, 2, 0};
+    const int hessian_basis_3d[] = {4, 5, 6, 7, 8, 9};
+    const real_t hessian_coeff_2d[] = {2.0, 1.0, 2.0};
+    const real_t hessian_coeff_3d[] = {2.0, 1.0, 1.0, 2.0, 1.0, 2.0};
+    const int *hessian_basis = (dim==2?hessian_basis_2d:hessian_basis_3d);
+    const real_t *hessian_coeff = (dim==2?hessian_coeff_2d:hessian_coeff_3d);
+
+    hessian_offsets.resize(_NNodes+1);
+    hessian_offsets[0] = 0;
+    hessian_pinv.resize(_NNodes*nhessian*nbasis);
+
+    std::vector< std::vector<index_t> > patches(_NNodes);
+
+#pragma omp parallel
+    {
+      Eigen::Matrix<real_t, nbasis, nbasis> A;
+      Eigen::Matrix<real_t, nbasis, nhessian> E, X;
+
+#pragma omp for schedule(static)
+      for(int i=0; i<_NNodes; i++){
+        std::set<index_t> patch = _mesh->get_node_patch(i, min_patch_size);
+        patch.insert(i);
+        patches[i].assign(patch.begin(), patch.end());
+        hessian_offsets[i+1] = patches[i].size();
+
+        // Form the normal equations A = P^TP.
+        A.setZero();
+        const real_t *x0 = _mesh->get_coords(i);
+        for(typename std::vector<index_t>::const_iterator n=patches[i].begin(); n!=patches[i].end(); ++n){
+          const real_t *x1 = _mesh->get_coords(*n);
+          real_t dx[dim], p[nbasis];
+          for(int j=0;j<dim;j++){
+            dx[j] = x1[j]-x0[j];
+            assert(std::isfinite(dx[j]));
+          }
+          quadratic_basis(dx, p);
+
+          for(int j=0;j<nbasis;j++)
+            for(int k=0;k<=j;k++)
+              A(j, k) += p[j]*p[k];
+        }
+        for(int j=0;j<nbasis;j++)
+          for(int k=j+1;k<nbasis;k++)
+            A(j, k) = A(k, j);
+
+        // The rows of the pseudo-inverse that give the second derivatives.
+        E.setZero();
+        for(int j=0;j<nhessian;j++)
+          E(hessian_basis[j], j) = hessian_coeff[j];
+        A.svd().solve(E, &X);
+
+        for(int j=0;j<nhessian;j++)
+          for(int k=0;k<nbasis;k++)
+            hessian_pinv[(i*nhessian+j)*nbasis+k] = X(k, j);
+      }
+
+#pragma omp single
+      {
+        for(int i=0; i<_NNodes; i++)
+          hessian_offsets[i+1] += hessian_offsets[i];
+        hessian_patch.resize(hessian_offsets[_NNodes]);
+      }
+
+#pragma omp for schedule(static)
+      for(int i=0; i<_NNodes; i++)
+        std::copy(patches[i].begin(), patches[i].end(), hessian_patch.begin()+hessian_offsets[i]);
+    }
+  }
+
+  /// Least squared Hessian recovery of several fields at vertex i using the precomputed operator.
+  void hessian_qls_kernel(int nfields, const real_t* const* psi, int i, real_t *Hessian){
+    const int nbasis = (dim==2?6:10);
+    const int nhessian = (dim==2?3:6);
+
+    real_t b_static[8*nbasis];
+    std::vector<real_t> b_dynamic;
+    real_t *b = b_static;
+    if(nfields>8){
+      b_dynamic.resize(nfields*nbasis);
+      b = &(b_dynamic[0]);
+    }
+    for(int j=0;j<nfields*nbasis;j++)
+      b[j] = 0.0;
+
+    // b = P^T psi, for each field.
+    const real_t *x0 = _mesh->get_coords(i);
+    for(index_t it=hessian_offsets[i]; it<hessian_offsets[i+1]; it++){
+      index_t n = hessian_patch[it];
+      const real_t *x1 = _mesh->get_coords(n);
+      real_t dx[dim], p[nbasis];
+      for(int j=0;j<dim;j++)
+        dx[j] = x1[j]-x0[j];
+      quadratic_basis(dx, p);
+
+      for(int k=0;k<nfields;k++){
+        real_t v = psi[k][n];
+        assert(std::isfinite(v));
+        for(int j=0;j<nbasis;j++)
+          b[k*nbasis+j] += v*p[j];
+      }
+    }
+
+    const real_t *pinv = &(hessian_pinv[i*nhessian*nbasis]);
+    for(int k=0;k<nfields;k++){
+      for(int j=0;j<nhessian;j++){
+        real_t sum = 0.0;
+        for(int l=0;l<nbasis;l++)
+          sum += pinv[j*nbasis+l]*b[k*nbasis+l];
+        Hessian[k*nhessian+j] = sum;
+      }
     }
   }
 
@@ -871,6 +1644,14 @@ private:
   MetricTensor<real_t,dim>* _metric;
   Mesh<real_t>* _mesh;
   double min_eigenvalue;
+  std::vector<constraint> constraints;
+
+  // Least squares Hessian recovery operator; see build_hessian_operator().
+  std::vector<index_t> hessian_offsets, hessian_patch;
+  std::vector<real_t> hessian_pinv;
+
+  // Lumped L2 projection weights; see build_l2_projection().
+  std::vector<real_t> l2_volume, l2_basis_gradient, l2_inv_mass;
 };
 
 #endif
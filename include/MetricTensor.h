@@ -38,6 +38,8 @@
 #ifndef METRICTENSOR_H
 #define METRICTENSOR_H
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 #include <Eigen/Core>
@@ -66,7 +68,9 @@ template<typename treal_t, int dim>
 template<typename treal_t, int dim> class MetricTensor{
 public:
   /// Default constructor.
-  MetricTensor(){};
+  MetricTensor(){
+    _decomposed = false;
+  }
 
   /// Default destructor.
   ~MetricTensor(){};
@@ -102,6 +106,14 @@ public:
   const MetricTensor& operator=(const MetricTensor<treal_t,dim> &metric){
     for(size_t i=0; i<(dim==2?3:6); i++)
       _metric[i] = metric._metric[i];
+
+    _decomposed = metric._decomposed;
+    if(_decomposed){
+      for(size_t i=0; i<dim; i++)
+        _eigenvalues[i] = metric._eigenvalues[i];
+      for(size_t i=0; i<dim*dim; i++)
+        _eigenvectors[i] = metric._eigenvectors[i];
+    }
     return *this;
   }
 
@@ -136,45 +148,45 @@ public:
     for(size_t i=0; i<(dim==2?3:6); i++)
       _metric[i] = metric[i];
 
-    positive_definiteness(_metric);
+    _decomposed = positive_definiteness(_metric, _eigenvalues, _eigenvectors);
   }
 
   // Enforce positive definiteness
   static void positive_definiteness(treal_t* metric){
-    Eigen::Matrix<treal_t, dim, dim> M;
+    treal_t D[dim], V[dim*dim];
+    positive_definiteness(metric, D, V);
+  }
+
+  /*! Enforce positive definiteness, returning the eigen-decomposition of
+   * the result.
+   * @return false if the tensor is zero, in which case it is left unchanged
+   * and the eigen-decomposition is not calculated.
+   */
+  static bool positive_definiteness(treal_t* metric, treal_t* D, treal_t* V){
+    treal_t M[dim==2?3:6];
+    for(size_t i=0; i<(dim==2?3:6); i++)
+      M[i] = metric[i];
 
     if(dim==2){
-      M << metric[0]+DBL_EPSILON, metric[1],
-           metric[1],             metric[2]+DBL_EPSILON;
+      M[0] += DBL_EPSILON;
+      M[2] += DBL_EPSILON;
     }else if(dim==3){
-      M << metric[0]+DBL_EPSILON, metric[1],             metric[2],
-           metric[1],             metric[3]+DBL_EPSILON, metric[4],
-           metric[2],             metric[4],             metric[5]+DBL_EPSILON;
+      M[0] += DBL_EPSILON;
+      M[3] += DBL_EPSILON;
+      M[5] += DBL_EPSILON;
     }
 
-    if(M.isZero())
-      return;
+    if(is_zero(M))
+      return false;
 
-    Eigen::EigenSolver< Eigen::Matrix<treal_t, dim, dim> > solver(M);
+    decompose(M, D, V);
 
-    Eigen::Matrix<treal_t, dim, 1> evalues = solver.eigenvalues().real().cwise().abs();
-    Eigen::Matrix<treal_t, dim, dim> evectors = solver.eigenvectors().real();
-    Eigen::Matrix<treal_t, dim, dim> Mp = evectors*evalues.asDiagonal()*evectors.transpose();
+    for(size_t i=0; i<dim; i++)
+      D[i] = fabs(D[i]);
 
-    if(dim==2){
-      metric[0] = Mp[0];
-      metric[1] = Mp[1];
-      metric[2] = Mp[3];
-    }else if(dim==3){
-      metric[0] = Mp[0];
-      metric[1] = Mp[1];
-      metric[2] = Mp[2];
-      metric[3] = Mp[4];
-      metric[4] = Mp[5];
-      metric[5] = Mp[8];
-    }
+    recompose(D, V, metric);
 
-    return;
+    return true;
   }
 
   /*! By default this calculates the superposition of two metrics where by default small
@@ -193,116 +205,83 @@ public:
 
     MetricTensor<treal_t,dim> metric(M_in);
 
-    // Make the tensor with the smallest aspect ratio the reference space Mr.
-    const treal_t *Mr=_metric, *Mi=metric._metric;
-    Eigen::Matrix<treal_t, dim, dim> M1;
-    if(dim==2)
-      M1 << _metric[0], _metric[1],
-            _metric[1], _metric[2];
-    else if(dim==3){
-      M1[0] = _metric[0]; M1[1] = _metric[1]; M1[2] = _metric[2];
-      M1[3] = _metric[1]; M1[4] = _metric[3]; M1[5] = _metric[4];
-      M1[6] = _metric[2]; M1[7] = _metric[4]; M1[8] = _metric[5];
-    }
-    
-    Eigen::EigenSolver< Eigen::Matrix<treal_t, dim, dim> > solver1(M1);
-    Eigen::Matrix<treal_t, dim, 1> evalues1 = solver1.eigenvalues().real().cwise().abs();
-    
-    treal_t aspect_r;
-    if(dim==2){
-      aspect_r = std::min(evalues1[0], evalues1[1])/
-        std::max(evalues1[0], evalues1[1]);
+    // Make the tensor with the smallest aspect ratio the reference space Mr,
+    // which is only needed through its decomposition Dr, Vr.
+    const treal_t *Mi=metric._metric;
+    update_decomposition();
 
+    treal_t aspect_r = aspect_ratio(_eigenvalues);
+    if(dim==2){
       // Just replace metric if it is foobar
       if(!std::isnormal(aspect_r)){
-	for(int i=0;i<3;i++)
-	  _metric[i] = M_in[i];
+	*this = metric;
 	return;
       }
     }
-    else if(dim==3)
-      aspect_r = std::min(std::min(evalues1[0], evalues1[1]), evalues1[2])/
-        std::max(std::max(evalues1[0], evalues1[1]), evalues1[2]);
-    
-    Eigen::Matrix<treal_t, dim, dim> M2;
-    if(dim==2)
-      M2 << metric._metric[0], metric._metric[1],
-            metric._metric[1], metric._metric[2];
-    else if(dim==3){
-      M2[0] = metric._metric[0]; M2[1] = metric._metric[1]; M2[2] = metric._metric[2];
-      M2[3] = metric._metric[1]; M2[4] = metric._metric[3]; M2[5] = metric._metric[4];
-      M2[6] = metric._metric[2]; M2[7] = metric._metric[4]; M2[8] = metric._metric[5];
-    }
-    
+
     // The input matrix could be zero if there is zero curvature in the local solution.
-    if(M2.isZero())
+    if(is_zero(metric._metric))
       return;
-    
-    Eigen::EigenSolver< Eigen::Matrix<treal_t, dim, dim> > solver2(M2);
-    Eigen::Matrix<treal_t, dim, 1> evalues2 = solver2.eigenvalues().real().cwise().abs();
-    
-    treal_t aspect_i;
-    if(dim==2)
-      aspect_i = std::min(evalues2[0], evalues2[1])/
-        std::max(evalues2[0], evalues2[1]);
-    else if (dim==3)
-      aspect_i = std::min(std::min(evalues2[0], evalues2[1]), evalues2[2])/
-        std::max(std::max(evalues2[0], evalues2[1]), evalues2[2]);
-    
+
+    metric.update_decomposition();
+
+    treal_t aspect_i = aspect_ratio(metric._eigenvalues);
+
+    const treal_t *Dr=_eigenvalues, *Vr=_eigenvectors;
     if(aspect_i>aspect_r){
       Mi=_metric;
-      Mr=metric._metric;
+      Dr=metric._eigenvalues;
+      Vr=metric._eigenvectors;
     }
-    
-    // Map Mi to the reference space where Mr==I
-    if(dim==2)
-      M1 << Mr[0], Mr[1],
-            Mr[1], Mr[2];
-    else if(dim==3)
-      M1 << Mr[0], Mr[1], Mr[2],
-            Mr[1], Mr[3], Mr[4],
-            Mr[2], Mr[4], Mr[5];
-    
-    Eigen::EigenSolver< Eigen::Matrix<treal_t, dim, dim> > solver(M1);
-    Eigen::Matrix<treal_t, dim, dim> F =
-      solver.eigenvalues().real().cwise().abs().cwise().sqrt().asDiagonal()*
-      solver.eigenvectors().real();
 
-    if(dim==2)
-      M2 << Mi[0], Mi[1],
-            Mi[1], Mi[2];
-    else if(dim==3)
-      M2 << Mi[0], Mi[1], Mi[2],
-            Mi[1], Mi[3], Mi[4],
-            Mi[2], Mi[4], Mi[5];
-    
-    Eigen::Matrix<treal_t, dim, dim> M = F.inverse().transpose()*M2*F.inverse();
-    
-    Eigen::EigenSolver< Eigen::Matrix<treal_t, dim, dim> > solver3(M);
-    Eigen::Matrix<treal_t, dim, 1> evalues = solver3.eigenvalues().real().cwise().abs();
-    Eigen::Matrix<treal_t, dim, dim> evectors = solver3.eigenvectors().real();
-    
+    // Map Mi to the reference space where Mr==I, M = F^-T*Mi*F^-1 where
+    // F = |Dr|^(1/2)*Vr so that Mr = F^T*F.
+    treal_t sqrt_d[dim];
+    for(size_t i=0; i<dim; i++)
+      sqrt_d[i] = sqrt(fabs(Dr[i]));
+
+    treal_t Mi_full[dim*dim], MiV[dim*dim];
+    full(Mi, Mi_full);
+    for(size_t i=0; i<dim; i++)
+      for(size_t k=0; k<dim; k++){
+        MiV[i*dim+k] = 0;
+        for(size_t j=0; j<dim; j++)
+          MiV[i*dim+k] += Mi_full[i*dim+j]*Vr[k*dim+j];
+      }
+
+    treal_t M[dim==2?3:6];
+    for(size_t a=0, ii=0; a<dim; a++)
+      for(size_t b=a; b<dim; b++, ii++){
+        treal_t vMv = 0;
+        for(size_t i=0; i<dim; i++)
+          vMv += Vr[a*dim+i]*MiV[i*dim+b];
+        M[ii] = vMv/(sqrt_d[a]*sqrt_d[b]);
+      }
+
+    treal_t evalues[dim], evectors[dim*dim];
+    decompose(M, evalues, evectors);
+
     if(perserved_small_edges)
       for(size_t i=0; i<dim; i++)
-        evalues[i] = std::max((treal_t) 1.0, evalues[i]);
+        evalues[i] = std::max((treal_t) 1.0, fabs(evalues[i]));
     else
       for(size_t i=0; i<dim; i++)
-        evalues[i] = std::min((treal_t) 1.0, evalues[i]);
-    
-    Eigen::Matrix<treal_t, dim, dim> Mc = F.transpose()*evectors*evalues.asDiagonal()*evectors.transpose()*F;
-
-    if(dim==2){
-      _metric[0] = Mc[0];
-      _metric[1] = Mc[1];
-      _metric[2] = Mc[3];
-    } else if(dim==3){
-      _metric[0] = Mc[0];
-      _metric[1] = Mc[1];
-      _metric[2] = Mc[2];
-      _metric[3] = Mc[4];
-      _metric[4] = Mc[5];
-      _metric[5] = Mc[8];
-    }
+        evalues[i] = std::min((treal_t) 1.0, fabs(evalues[i]));
+
+    // Map back, Mc = F^T*C*F.
+    treal_t C[dim==2?3:6], C_full[dim*dim];
+    recompose(evalues, evectors, C);
+    full(C, C_full);
+
+    for(size_t i=0, ii=0; i<dim; i++)
+      for(size_t j=i; j<dim; j++, ii++){
+        treal_t sum = 0;
+        for(size_t a=0; a<dim; a++)
+          for(size_t b=0; b<dim; b++)
+            sum += sqrt_d[a]*Vr[a*dim+i]*C_full[a*dim+b]*sqrt_d[b]*Vr[b*dim+j];
+        _metric[ii] = sum;
+      }
+    _decomposed = false;
 
     return;
   }
@@ -311,21 +290,12 @@ public:
    * @param max_ratio The maximum allowed ratio between edge lengths in the orthogonal
    */
   void limit_aspect_ratio(treal_t max_ratio){
-    Eigen::Matrix<treal_t, dim, dim> M1;
-    if(dim==2)
-      M1 << _metric[0], _metric[1],
-            _metric[1], _metric[2];
-    else if(dim==3){
-      M1[0] = _metric[0]; M1[1] = _metric[1]; M1[2] = _metric[2];
-      M1[3] = _metric[1]; M1[4] = _metric[3]; M1[5] = _metric[4];
-      M1[6] = _metric[2]; M1[7] = _metric[4]; M1[8] = _metric[5];
-    }
-    
-    Eigen::EigenSolver< Eigen::Matrix<treal_t, dim, dim> > solver1(M1);
-    
-    Eigen::Matrix<treal_t, dim, 1> evalues = solver1.eigenvalues().real().cwise().abs();
-    Eigen::Matrix<treal_t, dim, dim> evectors = solver1.eigenvectors().real();
-    
+    update_decomposition();
+    treal_t *evalues = _eigenvalues;
+
+    for(size_t i=0; i<dim; i++)
+      evalues[i] = fabs(evalues[i]);
+
     if(dim==2){
       if(evalues[0]<evalues[1]){
         evalues[0] = std::max(evalues[0], evalues[1]/(max_ratio*max_ratio));
@@ -339,21 +309,8 @@ public:
       for(int i=0;i<dim;i++)
         evalues[i] = std::max(evalues[i], min_eigenvalue);
     }
-    
-    Eigen::Matrix<treal_t, dim, dim> Mc = evectors*evalues.asDiagonal()*evectors.transpose();
-    
-    if(dim==2){
-      _metric[0] = Mc[0];
-      _metric[1] = Mc[1];
-      _metric[2] = Mc[3];
-    } else if(dim==3){
-      _metric[0] = Mc[0];
-      _metric[1] = Mc[1];
-      _metric[2] = Mc[2];
-      _metric[3] = Mc[4];
-      _metric[4] = Mc[5];
-      _metric[5] = Mc[8];
-    }
+
+    recompose(evalues, _eigenvectors, _metric);
 
     return;
   }
@@ -365,6 +322,10 @@ public:
   void scale(treal_t scale_factor){
     for(size_t i=0; i<(dim==2?3:6); i++)
       _metric[i] *= scale_factor;
+
+    if(_decomposed)
+      for(size_t i=0; i<dim; i++)
+        _eigenvalues[i] *= scale_factor;
   }
 
   treal_t average_length() const{
@@ -421,69 +382,154 @@ public:
     return sqrt(1.0/max_d); // ie, the min
   }
 
+  /*! Eigen-decomposition of the metric tensor.
+   * @param eigenvalues absolute values of the eigenvalues.
+   * @param eigenvectors the i'th eigenvector is eigenvectors[i*dim:(i+1)*dim].
+   */
   void eigen_decomp(treal_t* eigenvalues, treal_t* eigenvectors) const{
-    Eigen::Matrix<treal_t, dim, dim> M;
-    if(dim==2)
-      M << _metric[0], _metric[1],
-           _metric[1], _metric[2];
-    else if(dim==3)
-      M << _metric[0], _metric[1], _metric[2],
-           _metric[1], _metric[3], _metric[4],
-           _metric[2], _metric[4], _metric[5];
-    
-    if(M.isZero()){
+    if(_decomposed){
       for(size_t i=0; i<dim; i++)
-        eigenvalues[i] = 0.0;
-      
+        eigenvalues[i] = _eigenvalues[i];
       for(size_t i=0; i<dim*dim; i++)
-        eigenvectors[i] = 0.0;
+        eigenvectors[i] = _eigenvectors[i];
     }else{
-      Eigen::EigenSolver< Eigen::Matrix<treal_t, dim, dim> > solver(M);
-      
-      Eigen::Matrix<treal_t, dim, 1> evalues = solver.eigenvalues().real().cwise().abs();
-      Eigen::Matrix<treal_t, dim, dim> evectors = solver.eigenvectors().real();
-      
-      for(size_t i=0; i<dim; i++)
-        eigenvalues[i] = evalues[i];
-      
-      Eigen::Matrix<treal_t, dim, dim> Mp = evectors.transpose();
-      for(size_t i=0; i<dim*dim; i++)
-        eigenvectors[i] = Mp[i];
+      decompose(_metric, eigenvalues, eigenvectors);
     }
+
+    for(size_t i=0; i<dim; i++)
+      eigenvalues[i] = fabs(eigenvalues[i]);
   }
 
+  /*! Set the metric tensor from its eigen-decomposition, as given by
+   * eigen_decomp().
+   */
   void eigen_undecomp(const treal_t* D, const treal_t* V){
     // Insure eigenvalues are positive
-    treal_t eigenvalues[dim];
     for(size_t i=0; i<dim; i++)
-      eigenvalues[i] = fabs(D[i]);
+      _eigenvalues[i] = fabs(D[i]);
+    for(size_t i=0; i<dim*dim; i++)
+      _eigenvectors[i] = V[i];
+
+    recompose(_eigenvalues, _eigenvectors, _metric);
+    _decomposed = true;
+  }
+
+  /*! Eigen-decomposition of a symmetric tensor by Jacobi rotations. A 2x2
+   * tensor is diagonalised by a single rotation and a 3x3 tensor by a fixed
+   * number of cyclic sweeps, which converges to round-off. There are no
+   * data dependent loops, so a loop over many tensors can be vectorised.
+   * @param metric upper triangle of the tensor.
+   * @param eigenvalues the eigenvalues, which may be negative.
+   * @param eigenvectors the i'th eigenvector is eigenvectors[i*dim:(i+1)*dim].
+   */
+  static inline void decompose(const treal_t* metric, treal_t* eigenvalues, treal_t* eigenvectors){
+    treal_t A[dim*dim], V[dim*dim];
+    full(metric, A);
+    for(size_t i=0; i<dim; i++)
+      for(size_t j=0; j<dim; j++)
+        V[i*dim+j] = (i==j)?1:0;
+
+    if(dim==2){
+      jacobi_rotation(A, V, 0, 1);
+    }else{
+      for(int sweep=0; sweep<4; sweep++){
+        jacobi_rotation(A, V, 0, 1);
+        jacobi_rotation(A, V, 0, 2);
+        jacobi_rotation(A, V, 1, 2);
+      }
+    }
 
-    treal_t M[dim*dim];
+    // The columns of V are the eigenvectors.
     for(size_t i=0; i<dim; i++){
-      for(size_t j=0; j<dim; j++){
-        int ii = (i*dim) + j;
-        M[ii] = 0.0;
+      eigenvalues[i] = A[i*dim+i];
+      for(size_t j=0; j<dim; j++)
+        eigenvectors[i*dim+j] = V[j*dim+i];
+    }
+  }
+
+  /*! Inverse of decompose().
+   * @param metric upper triangle of the tensor.
+   */
+  static inline void recompose(const treal_t* eigenvalues, const treal_t* eigenvectors, treal_t* metric){
+    for(size_t i=0, ii=0; i<dim; i++)
+      for(size_t j=i; j<dim; j++, ii++){
+        metric[ii] = 0.0;
         for(size_t k=0; k<dim; k++)
-          M[ii]+=eigenvalues[k]*V[k*dim+i]*V[k*dim+j];
+          metric[ii] += eigenvalues[k]*eigenvectors[k*dim+i]*eigenvectors[k*dim+j];
       }
+  }
+
+private:
+  /// Calculate the eigen-decomposition of the tensor if it is not already known.
+  inline void update_decomposition(){
+    if(!_decomposed){
+      decompose(_metric, _eigenvalues, _eigenvectors);
+      _decomposed = true;
     }
+  }
 
-    if(dim==2){
-      _metric[0] = M[0];
-      _metric[1] = M[1];
-      _metric[2] = M[3];
-    }else if(dim==3){
-      _metric[0] = M[0];
-      _metric[1] = M[1];
-      _metric[2] = M[2];
-      _metric[3] = M[4];
-      _metric[4] = M[5];
-      _metric[5] = M[8];
+  /*! Apply the Jacobi rotation which zeros A[p][q] to the symmetric matrix
+   * A, and accumulate it into V. See Numerical Recipes, Section 11.1.
+   */
+  static inline void jacobi_rotation(treal_t* A, treal_t* V, int p, int q){
+    treal_t apq = A[p*dim+q];
+    treal_t tau = A[q*dim+q]-A[p*dim+p];
+
+    // t = tan(theta), written so that it is 0 rather than NaN when apq==0.
+    treal_t den = fabs(tau) + sqrt(tau*tau + 4*apq*apq);
+    treal_t t = (den>0)?((tau<0)?-2:2)*apq/den:0;
+    treal_t c = 1/sqrt(1+t*t);
+    treal_t s = t*c;
+
+    A[p*dim+p] -= t*apq;
+    A[q*dim+q] += t*apq;
+    A[p*dim+q] = A[q*dim+p] = 0;
+    if(dim==3){
+      int r = 3-p-q;
+      treal_t arp = A[r*dim+p], arq = A[r*dim+q];
+      A[r*dim+p] = A[p*dim+r] = c*arp - s*arq;
+      A[r*dim+q] = A[q*dim+r] = s*arp + c*arq;
+    }
+
+    for(size_t r=0; r<dim; r++){
+      treal_t vrp = V[r*dim+p], vrq = V[r*dim+q];
+      V[r*dim+p] = c*vrp - s*vrq;
+      V[r*dim+q] = s*vrp + c*vrq;
     }
   }
 
-private:
+  /// Expand the upper triangle into the full matrix.
+  static inline void full(const treal_t* metric, treal_t* M){
+    for(size_t i=0, ii=0; i<dim; i++)
+      for(size_t j=i; j<dim; j++, ii++)
+        M[i*dim+j] = M[j*dim+i] = metric[ii];
+  }
+
+  /// Same test as Eigen's isZero().
+  static inline bool is_zero(const treal_t* metric){
+    for(size_t i=0; i<(dim==2?3:6); i++)
+      if(fabs(metric[i])>Eigen::precision<treal_t>())
+        return false;
+    return true;
+  }
+
+  /// Ratio of the smallest to the largest absolute eigenvalue.
+  static inline treal_t aspect_ratio(const treal_t* eigenvalues){
+    treal_t lmin = fabs(eigenvalues[0]), lmax = fabs(eigenvalues[0]);
+    for(size_t i=1; i<dim; i++){
+      lmin = std::min(lmin, (treal_t)fabs(eigenvalues[i]));
+      lmax = std::max(lmax, (treal_t)fabs(eigenvalues[i]));
+    }
+    return lmin/lmax;
+  }
+
   treal_t _metric[dim==2?3:(dim==3?6:-1)];
+
+  // Eigen-decomposition of _metric, valid if _decomposed. It is kept up to
+  // date by the operations which work on the eigenvalues, and recalculated
+  // on demand after the others.
+  treal_t _eigenvalues[dim], _eigenvectors[dim*dim];
+  bool _decomposed;
 };
 
 template<typename treal_t, int dim>
@@ -0,0 +1,147 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#ifndef PRIORITYBUCKETS_H
+#define PRIORITYBUCKETS_H
+
+#include <algorithm>
+#include <cfloat>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "PragmaticTypes.h"
+
+/*! \brief Approximate priority ordering of items, such as vertices, by a
+ * scalar key, such as the worst quality of the surrounding elements.
+ *
+ * Keys are binned into a fixed number of equally sized buckets below a
+ * threshold by a parallel counting sort. Items are ordered by bucket,
+ * lowest key first, and by index within a bucket. This is enough to visit
+ * the worst parts of the mesh first without the cost of a full sort or of
+ * a concurrent heap.
+ */
+template<typename real_t>
+class PriorityBuckets{
+ public:
+  /// Default constructor.
+  PriorityBuckets(size_t nbuckets=64) : _nbuckets(nbuckets){}
+
+  /// Default destructor.
+  ~PriorityBuckets(){}
+
+  /*! Order the items with a key below threshold.
+   * @param key key of each item.
+   * @param threshold items with a key which is not below this value are dropped.
+   * @param order items retained, lowest key first.
+   * @returns the lowest key, or DBL_MAX if there are no items.
+   */
+  real_t sort(const std::vector<real_t>& key, real_t threshold, std::vector<index_t>& order){
+    index_t nitems = key.size();
+    real_t kmin = DBL_MAX;
+
+#pragma omp parallel reduction(min:kmin)
+    {
+#pragma omp single
+      {
+#ifdef _OPENMP
+        _nthreads = omp_get_num_threads();
+#else
+        _nthreads = 1;
+#endif
+        _counts.assign(_nthreads*_nbuckets, 0);
+      }
+
+#ifdef _OPENMP
+      size_t *count = &(_counts[omp_get_thread_num()*_nbuckets]);
+#else
+      size_t *count = &(_counts[0]);
+#endif
+
+#pragma omp for schedule(static)
+      for(index_t i=0;i<nitems;i++){
+        if(!(key[i]<threshold))
+          continue;
+
+        count[bucket(key[i], threshold)]++;
+        kmin = std::min(kmin, key[i]);
+      }
+
+      // Offsets, bucket major, so that each thread scatters into its own
+      // range of every bucket.
+#pragma omp single
+      {
+        size_t offset = 0;
+        for(size_t b=0;b<_nbuckets;b++){
+          for(int t=0;t<_nthreads;t++){
+            size_t cnt = _counts[t*_nbuckets+b];
+            _counts[t*_nbuckets+b] = offset;
+            offset += cnt;
+          }
+        }
+        order.resize(offset);
+      }
+
+      // The static schedule gives each thread the same items as above.
+#pragma omp for schedule(static)
+      for(index_t i=0;i<nitems;i++){
+        if(!(key[i]<threshold))
+          continue;
+
+        order[count[bucket(key[i], threshold)]++] = i;
+      }
+    }
+
+    return kmin;
+  }
+
+ private:
+  inline size_t bucket(real_t key, real_t threshold) const{
+    if(key<=0)
+      return 0;
+
+    return std::min((size_t)(_nbuckets*(key/threshold)), _nbuckets-1);
+  }
+
+  size_t _nbuckets;
+  int _nthreads;
+  std::vector<size_t> _counts;
+};
+
+#endif
@@ -409,6 +409,7 @@ template<typename real_t, int dim> class Refine{
           // Append vertices in recv_additional and send_additional to recv and send.
           // Mark how many vertices are added to each of these vectors.
           std::vector<size_t> recv_cnt(nprocs, 0), send_cnt(nprocs, 0);
+          _mesh->invalidate_halo_exchanger();
 
           for(int i=0;i<nprocs;++i){
             recv_cnt[i] = recv_additional[i].size();
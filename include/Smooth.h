@@ -58,6 +58,7 @@
 #include "Lock.h"
 #include "Mesh.h"
 #include "MetricTensor.h"
+#include "PriorityBuckets.h"
 
 
 /*! \brief Applies Laplacian smoothen in metric space.
@@ -78,6 +79,13 @@ template<typename real_t, int dim>
 
     epsilon_q = DBL_EPSILON;
 
+    priority_order = false;
+    qmin_target = -1.0;
+
+    halo_smoothing = false;
+    halo_in_flight = false;
+    boundary_smoothing = false;
+
     // Set the orientation of elements.
     property = NULL;
     int NElements = _mesh->get_number_elements();
@@ -106,35 +114,25 @@ template<typename real_t, int dim>
     delete property;
   }
 
-  // Smart laplacian mesh smoothing.
-  void smart_laplacian(int max_iterations=10, double quality_tol=-1.0){
+  /*! Smart laplacian mesh smoothing. The vertices are visited from a
+   * worklist: initially every vertex which may be moved, and afterwards
+   * only the neighbours of vertices which were moved in the previous
+   * iteration.
+   * @param max_iterations maximum number of iterations.
+   * @param quality_tol elements better than this are not improved. If not
+   * positive the mean element quality is used.
+   * @returns number of iterations performed; see get_convergence_history().
+   */
+  int smart_laplacian(int max_iterations=10, double quality_tol=-1.0){
     int NNodes = _mesh->get_number_nodes();
     int NElements = _mesh->get_number_elements();
-    std::vector< std::atomic<bool> > is_boundary(NNodes);
+    const std::vector<char> &is_fixed = fixed_vertices();
 
-#pragma omp parallel for
-    for(int n=0; n<NNodes; ++n){
-      is_boundary[n].store(false, std::memory_order_relaxed);
-    }
+    _mesh->template update_stale_quality<dim>();
 
     if(quality_tol>0){
       good_q = quality_tol;
-
-#pragma omp parallel for schedule(guided)
-      for(int i=0;i<NElements;i++){
-        const int *n=_mesh->get_element(i);
-        if(n[0]<0)
-          continue;
-
-        for(size_t j=0;j<nloc;j++){
-          if(_mesh->boundary[i*nloc+j]>0){
-            for(size_t k=1;k<nloc;k++){
-              is_boundary[n[(j+k)%nloc]].store(true, std::memory_order_relaxed);
-            }
-          }
-        }
-      }
-    }else{ // if(quality_tol < 0)
+    }else{
       double qsum=0;
 
 #pragma omp parallel for schedule(guided) reduction(+:qsum)
@@ -145,46 +143,61 @@ template<typename real_t, int dim>
           continue;
         }
         qsum+=_mesh->quality[i];
-
-        for(size_t j=0;j<nloc;j++){
-          if(_mesh->boundary[i*nloc+j]>0){
-            for(size_t k=1;k<nloc;k++){
-              is_boundary[n[(j+k)%nloc]].store(true, std::memory_order_relaxed);
-            }
-          }
-        }
       }
 
       good_q = qsum/NElements;
     }
 
-    // Use this to keep track of vertices that are still to be visited.
-    std::vector<int> active_vertices(NNodes, 1);
-
     if(vLocks.size() < NNodes)
       vLocks.resize(NNodes);
 
-    // First sweep through all vertices. Add vertices adjacent to any
-    // vertex moved into the active_vertex list.
+    // Smooth the partition boundary first; its last halo update
+    // completes while the local vertices are swept.
+    if(halo_smoothing)
+      smooth_halo_begin(&Smooth<real_t, dim>::smart_laplacian_kernel, is_fixed);
+
+    // Visiting state of each vertex; see requeue().
+    std::vector< std::atomic<int> > state(NNodes);
+
+    worklist.clear();
+    convergence_history.clear();
+
+    std::vector<index_t> offsets;
+
+    int iter=0;
 #pragma omp parallel
     {
-      std::vector<index_t> retry, next_retry;
+      int tid = 0;
+#ifdef _OPENMP
+      tid = omp_get_thread_num();
+#endif
+      std::vector<index_t> next, retry, next_retry;
 
-      int iter=0;
-      while((iter++) < max_iterations){
-#pragma omp for schedule(guided) nowait
-        for(index_t node=0; node<NNodes; ++node){
-          if((_mesh->is_halo_node(node)) || (_mesh->NNList[node].empty()) ||
-              is_boundary[node].load(std::memory_order_relaxed) || active_vertices[node]==0)
-            continue;
+#pragma omp for schedule(static)
+      for(index_t node=0; node<NNodes; ++node){
+        if(smoothable(node, is_fixed)){
+          state[node].store(0, std::memory_order_relaxed);
+          next.push_back(node);
+        }else{
+          state[node].store(-1, std::memory_order_relaxed);
+        }
+      }
+      gather_worklist(next, tid, offsets, state, 0);
 
-          bool abort = false;
+      while(iter<max_iterations && !worklist.empty()){
+        index_t nmoved = 0;
+        index_t nwork = worklist.size();
+
+#pragma omp for schedule(guided) nowait
+        for(index_t i=0; i<nwork; ++i){
+          index_t node = worklist[i];
 
           if(!vLocks[node].try_lock()){
             retry.push_back(node);
             continue;
           }
 
+          bool abort = false;
           for(const auto& it : _mesh->NNList[node]){
             if(vLocks[it].is_locked()){
               abort = true;
@@ -194,11 +207,10 @@ template<typename real_t, int dim>
 
           if(!abort){
             if(smart_laplacian_kernel(node)){
-              for(auto& it : _mesh->NNList[node]){
-                active_vertices[it] = 1;
-              }
+              nmoved++;
+              requeue(node, iter, state, next);
             }
-            active_vertices[node] = 0;
+            state[node].store(2*iter+1, std::memory_order_relaxed);
           }
           else
             retry.push_back(node);
@@ -210,16 +222,12 @@ template<typename real_t, int dim>
           next_retry.clear();
 
           for(const auto& node : retry){
-            if(active_vertices[node] == 0)
-              continue;
-
-            bool abort = false;
-
             if(!vLocks[node].try_lock()){
               next_retry.push_back(node);
               continue;
             }
 
+            bool abort = false;
             for(const auto& it : _mesh->NNList[node]){
               if(vLocks[it].is_locked()){
                 abort = true;
@@ -229,11 +237,10 @@ template<typename real_t, int dim>
 
             if(!abort){
               if(smart_laplacian_kernel(node)){
-                for(auto& it : _mesh->NNList[node]){
-                  active_vertices[it] = 1;
-                }
+                nmoved++;
+                requeue(node, iter, state, next);
               }
-              active_vertices[node] = 0;
+              state[node].store(2*iter+1, std::memory_order_relaxed);
             }
             else
               next_retry.push_back(node);
@@ -243,41 +250,78 @@ template<typename real_t, int dim>
 
           retry.swap(next_retry);
         }
+
+#pragma omp single
+        convergence_history.push_back(std::pair<index_t, index_t>(nwork, 0));
+
+#pragma omp atomic
+        convergence_history.back().second += nmoved;
+
+#pragma omp single
+        iter++;
+
+        gather_worklist(next, tid, offsets, state, 2*iter);
       }
     }
 
-    return;
+    if(halo_smoothing)
+      smooth_halo_end();
+
+    return iter;
+  }
+
+  /*! Convergence of the last call to smart_laplacian(). For each iteration
+   * this gives the number of vertices on the worklist and the number of
+   * vertices which were moved.
+   */
+  const std::vector< std::pair<index_t, index_t> > &get_convergence_history() const{
+    return convergence_history;
+  }
+
+  /*! Visit vertices approximately in order of increasing quality, worst
+   * first, rather than in index order. The order is revisited after every
+   * sweep and vertices whose elements are all good enough are skipped.
+   * @param enable use the priority order.
+   * @param target stop once the worst quality of the elements which may
+   * still be improved reaches this value. Ignored if not positive.
+   */
+  void set_priority_order(bool enable, real_t target=-1.0){
+    priority_order = enable;
+    qmin_target = target;
+  }
+
+  /*! Also smooth the owned vertices on the partition boundary. These are
+   * otherwise left untouched in an MPI parallel run. They are visited after
+   * the local sweep, in phases of vertices which are not adjacent to each
+   * other on any process, and the coordinates and metric are exchanged
+   * with the neighbouring processes after every phase.
+   * @param enable smooth the partition boundary vertices.
+   */
+  void set_halo_smoothing(bool enable){
+    halo_smoothing = enable;
+  }
+
+  /*! Also smooth the boundary vertices. A boundary vertex whose boundary
+   * facets all have the same boundary ID and lie in the same plane (on the
+   * same line in 2D) is moved within that plane. Vertices on corners and
+   * ridges are still fixed.
+   * @param enable smooth the boundary vertices.
+   */
+  void set_boundary_smoothing(bool enable){
+    boundary_smoothing = enable;
   }
 
   // Linf optimisation based smoothing..
   void optimisation_linf(int max_iterations=10, double quality_tol=-1.0){
     int NNodes = _mesh->get_number_nodes();
     int NElements = _mesh->get_number_elements();
-    std::vector< std::atomic<bool> > is_boundary(NNodes);
+    const std::vector<char> &is_fixed = fixed_vertices();
 
-#pragma omp parallel for
-    for(int n=0; n<NNodes; ++n){
-      is_boundary[n].store(false, std::memory_order_relaxed);
-    }
+    _mesh->template update_stale_quality<dim>();
 
     if(quality_tol>0){
       good_q = quality_tol;
-
-#pragma omp parallel for schedule(guided)
-      for(int i=0;i<NElements;i++){
-        const int *n=_mesh->get_element(i);
-        if(n[0]<0)
-          continue;
-
-        for(size_t j=0;j<nloc;j++){
-          if(_mesh->boundary[i*nloc+j]>0){
-            for(size_t k=1;k<nloc;k++){
-              is_boundary[n[(j+k)%nloc]].store(true, std::memory_order_relaxed);
-            }
-          }
-        }
-      }
-    }else{ // if(quality_tol < 0)
+    }else{
       double qsum=0;
 
 #pragma omp parallel for schedule(guided) reduction(+:qsum)
@@ -288,14 +332,6 @@ template<typename real_t, int dim>
           continue;
         }
         qsum+=_mesh->quality[i];
-
-        for(size_t j=0;j<nloc;j++){
-          if(_mesh->boundary[i*nloc+j]>0){
-            for(size_t k=1;k<nloc;k++){
-              is_boundary[n[(j+k)%nloc]].store(true, std::memory_order_relaxed);
-            }
-          }
-        }
       }
 
       good_q = qsum/NElements;
@@ -304,62 +340,70 @@ template<typename real_t, int dim>
     // Use this to keep track of vertices that are still to be visited.
     std::vector<int> active_vertices(NNodes, 1);
 
+    // One workspace per thread for the kernels; see quality_workspace().
+    int nthreads = 1;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+    if(new_quality_workspace.size() < (size_t)nthreads)
+      new_quality_workspace.resize(nthreads);
+
     if(vLocks.size() < NNodes)
       vLocks.resize(NNodes);
 
-    // First sweep through all vertices. Add vertices adjacent to any
-    // vertex moved into the active_vertex list.
-#pragma omp parallel
-    {
-      std::vector<index_t> retry, next_retry;
-
-      int iter=0;
-      while((iter++) < max_iterations){
-#pragma omp for schedule(guided) nowait
+    // Smooth the partition boundary first; its last halo update
+    // completes while the local vertices are swept.
+    if(halo_smoothing)
+      smooth_halo_begin(&Smooth<real_t, dim>::optimisation_linf_kernel, is_fixed);
+
+    int iter=0;
+    while(iter < max_iterations){
+      // Sweeps until the order in which vertices are visited is revisited.
+      int nsweeps = max_iterations-iter;
+      index_t nvisit = NNodes;
+
+      if(priority_order){
+        // Visit the active vertices with the worst elements first. Vertices
+        // whose elements are all good enough are not visited at all.
+        vertex_quality.resize(NNodes);
+#pragma omp parallel for schedule(guided)
         for(index_t node=0; node<NNodes; ++node){
-          if((_mesh->is_halo_node(node)) || (_mesh->NNList[node].empty()) ||
-              is_boundary[node].load(std::memory_order_relaxed) || active_vertices[node]==0)
-            continue;
-
-          bool abort = false;
-
-          if(!vLocks[node].try_lock()){
-            retry.push_back(node);
-            continue;
-          }
-
-          for(const auto& it : _mesh->NNList[node]){
-            if(vLocks[it].is_locked()){
-              abort = true;
-              break;
-            }
+          real_t q = DBL_MAX;
+          if(!((_mesh->is_halo_node(node)) || (_mesh->NNList[node].empty()) ||
+               is_fixed[node] || active_vertices[node]==0)){
+            for(const auto& e : _mesh->NEList[node])
+              q = std::min(q, _mesh->quality[e]);
           }
+          vertex_quality[node] = q;
+        }
 
-          if(!abort){
-            if(optimisation_linf_kernel(node)){
-              for(auto& it : _mesh->NNList[node]){
-                active_vertices[it] = 1;
-              }
-            }
-            active_vertices[node] = 0;
-          }
-          else
-            retry.push_back(node);
+        real_t qmin = buckets.sort(vertex_quality, good_q, order);
+        if(order.empty() || (qmin_target>0 && qmin>=qmin_target))
+          break;
 
-          vLocks[node].unlock();
-        }
+        nsweeps = 1;
+        nvisit = order.size();
+      }
+      iter += nsweeps;
 
-        while(retry.size()>0){
-          next_retry.clear();
+      // Sweep through the vertices. Add vertices adjacent to any
+      // vertex moved into the active_vertex list.
+#pragma omp parallel
+      {
+        std::vector<index_t> retry, next_retry;
 
-          for(const auto& node : retry){
-            if(active_vertices[node] == 0)
+        for(int sweep=0; sweep<nsweeps; ++sweep){
+#pragma omp for schedule(guided) nowait
+          for(index_t i=0; i<nvisit; ++i){
+            index_t node = priority_order?order[i]:i;
+            if((_mesh->is_halo_node(node)) || (_mesh->NNList[node].empty()) ||
+                is_fixed[node] || active_vertices[node]==0)
               continue;
 
             bool abort = false;
 
             if(!vLocks[node].try_lock()){
-              next_retry.push_back(node);
+              retry.push_back(node);
               continue;
             }
 
@@ -379,71 +423,79 @@ template<typename real_t, int dim>
               active_vertices[node] = 0;
             }
             else
-              next_retry.push_back(node);
+              retry.push_back(node);
 
             vLocks[node].unlock();
           }
 
-          retry.swap(next_retry);
+          while(retry.size()>0){
+            next_retry.clear();
+
+            for(const auto& node : retry){
+              if(active_vertices[node] == 0)
+                continue;
+
+              bool abort = false;
+
+              if(!vLocks[node].try_lock()){
+                next_retry.push_back(node);
+                continue;
+              }
+
+              for(const auto& it : _mesh->NNList[node]){
+                if(vLocks[it].is_locked()){
+                  abort = true;
+                  break;
+                }
+              }
+
+              if(!abort){
+                if(optimisation_linf_kernel(node)){
+                  for(auto& it : _mesh->NNList[node]){
+                    active_vertices[it] = 1;
+                  }
+                }
+                active_vertices[node] = 0;
+              }
+              else
+                next_retry.push_back(node);
+
+              vLocks[node].unlock();
+            }
+
+            retry.swap(next_retry);
+          }
         }
       }
     }
 
+    if(halo_smoothing)
+      smooth_halo_end();
+
     return;
   }
 
   // Laplacian smoothing
   void laplacian(int max_iterations=10){
     int NNodes = _mesh->get_number_nodes();
-    int NElements = _mesh->get_number_elements();
-    std::vector< std::atomic<bool> > is_boundary(NNodes);
-
-#pragma omp parallel for
-    for(int n=0; n<NNodes; ++n){
-      is_boundary[n].store(false, std::memory_order_relaxed);
-    }
-
-#pragma omp parallel for schedule(guided)
-      for(int i=0;i<NElements;i++){
-        const int *n=_mesh->get_element(i);
-        if(n[0]<0)
-          continue;
-
-        for(size_t j=0;j<nloc;j++){
-          if(_mesh->boundary[i*nloc+j]>0){
-            for(size_t k=1;k<nloc;k++){
-              is_boundary[n[(j+k)%nloc]].store(true, std::memory_order_relaxed);
-            }
-          }
-        }
-      }
+    const std::vector<char> &is_fixed = fixed_vertices();
 
     if(vLocks.size() < NNodes)
       vLocks.resize(NNodes);
 
+    // Smooth the partition boundary first; its last halo update
+    // completes while the local vertices are swept.
+    if(halo_smoothing)
+      smooth_halo_begin(&Smooth<real_t, dim>::laplacian_kernel, is_fixed);
+
     // Sweep through all vertices.
 #pragma omp parallel
     {
-#pragma omp for schedule(guided)
-      for(int i=0;i<NElements;i++){
-        const int *n=_mesh->get_element(i);
-        if(n[0]==-1)
-          continue;
-
-        for(size_t j=0;j<nloc;j++){
-          if(_mesh->boundary[i*nloc+j]>0){
-            for(size_t k=1;k<nloc;k++){
-              is_boundary[n[(j+k)%nloc]].store(true, std::memory_order_relaxed);
-            }
-          }
-        }
-      }
-
       std::vector<index_t> retry, next_retry;
 #pragma omp for schedule(guided) nowait
       for(index_t node=0; node<NNodes; ++node){
         if((_mesh->is_halo_node(node)) || (_mesh->NNList[node].empty()) ||
-            is_boundary[node].load(std::memory_order_relaxed))
+            is_fixed[node])
           continue;
 
         bool abort = false;
@@ -497,12 +549,310 @@ template<typename real_t, int dim>
         retry.swap(next_retry);
       }
     }
+
+    if(halo_smoothing)
+      smooth_halo_end();
     
     return;
   }
 
  private:
 
+  /*! Smooth the owned vertices which are shared with other processes. In
+   * each phase a vertex is smoothed if it has a higher priority than all
+   * of its neighbours which are still waiting to be smoothed. The priority
+   * is derived from the global numbering, so all processes agree and no
+   * two adjacent vertices are moved in the same phase. The halo update
+   * of the last phase is left in flight so that the local sweeps can run
+   * while it completes; see smooth_halo_end().
+   */
+  void smooth_halo_begin(bool (Smooth<real_t, dim>::*kernel)(index_t), const std::vector<char> &is_fixed){
+#ifdef HAVE_MPI
+    if(mpi_nparts<2)
+      return;
+
+    MPI_Comm comm = _mesh->get_mpi_comm();
+    int NNodes = _mesh->get_number_nodes();
+
+    std::vector<index_t> pending, selected, next_pending;
+    halo_pending.assign(NNodes, 0);
+    for(const auto& node : _mesh->send_halo){
+      if(_mesh->is_owned_node(node) && !_mesh->NNList[node].empty() &&
+         !is_fixed[node]){
+        pending.push_back(node);
+        halo_pending[node] = 1;
+      }
+    }
+    _mesh->template halo_update<int, 1>(halo_pending);
+
+    halo_recv_pending.clear();
+    for(const auto& node : _mesh->recv_halo){
+      if(halo_pending[node])
+        halo_recv_pending.push_back(node);
+    }
+
+    int npending = pending.size();
+    MPI_Allreduce(MPI_IN_PLACE, &npending, 1, MPI_INT, MPI_SUM, comm);
+    while(npending>0){
+      selected.clear();
+      next_pending.clear();
+      for(const auto& node : pending){
+        bool local_max = true;
+        for(const auto& it : _mesh->NNList[node]){
+          if(halo_pending[it] && halo_precedes(it, node)){
+            local_max = false;
+            break;
+          }
+        }
+
+        if(local_max)
+          selected.push_back(node);
+        else
+          next_pending.push_back(node);
+      }
+      pending.swap(next_pending);
+
+      int nselected = selected.size();
+#pragma omp parallel for schedule(guided)
+      for(int i=0;i<nselected;i++)
+        (this->*kernel)(selected[i]);
+
+      for(const auto& node : selected)
+        halo_pending[node] = 0;
+
+      _mesh->template halo_update_begin<real_t, dim>(_mesh->_coords);
+      _mesh->template halo_update_begin<double, (dim==2?3:6)>(_mesh->metric);
+      _mesh->template halo_update_begin<int, 1>(halo_pending);
+      halo_in_flight = true;
+
+      npending = pending.size();
+      MPI_Allreduce(MPI_IN_PLACE, &npending, 1, MPI_INT, MPI_SUM, comm);
+      if(npending==0)
+        break;
+
+      smooth_halo_end();
+    }
+#endif
+  }
+
+  /*! Complete the halo update started by smooth_halo_begin() and update
+   * the quality around the halo copies which were smoothed by their owner.
+   */
+  void smooth_halo_end(){
+#ifdef HAVE_MPI
+    if(!halo_in_flight)
+      return;
+
+    _mesh->template halo_update_end<real_t, dim>(_mesh->_coords);
+    _mesh->template halo_update_end<double, (dim==2?3:6)>(_mesh->metric);
+    _mesh->template halo_update_end<int, 1>(halo_pending);
+    halo_in_flight = false;
+
+    std::vector<index_t> next_pending;
+    for(const auto& node : halo_recv_pending){
+      if(halo_pending[node]){
+        next_pending.push_back(node);
+      }else{
+        for(const auto& e : _mesh->NEList[node])
+          update_quality(e);
+      }
+    }
+    halo_recv_pending.swap(next_pending);
+#endif
+  }
+
+  /// Returns true if the vertex may be moved by the local sweeps.
+  inline bool smoothable(index_t node, const std::vector<char> &is_fixed) const{
+    return !(_mesh->is_halo_node(node) || _mesh->NNList[node].empty() || is_fixed[node]);
+  }
+
+  /*! Flags marking the vertices which the smoothers may not move. These
+   * are the boundary vertices, except with boundary smoothing enabled when
+   * only the vertices for which flat_boundary() fails are fixed.
+   */
+  const std::vector<char> &fixed_vertices(){
+    const std::vector<char> &is_boundary = _mesh->get_boundary_nodes();
+    if(!boundary_smoothing)
+      return is_boundary;
+
+    int NNodes = _mesh->get_number_nodes();
+    fixed_vertex.resize(NNodes);
+    surface_vertex.resize(NNodes);
+    surface_normal.resize(NNodes*dim);
+
+#pragma omp parallel for schedule(guided)
+    for(int node=0; node<NNodes; ++node){
+      surface_vertex[node] = is_boundary[node] && flat_boundary(node, &surface_normal[node*dim]);
+      fixed_vertex[node] = is_boundary[node] && !surface_vertex[node];
+    }
+
+    return fixed_vertex;
+  }
+
+  /*! Returns true if all the boundary facets around a vertex have the same
+   * boundary ID and the same normal, to round-off.
+   * @param normal set to the unit normal of the facets.
+   */
+  bool flat_boundary(index_t node, real_t *normal) const{
+    int id = 0;
+    for(const auto& e : _mesh->NEList[node]){
+      const index_t *n=_mesh->get_element(e);
+      for(size_t j=0;j<nloc;j++){
+        int facet_id = _mesh->boundary[e*nloc+j];
+        if(n[j]==node || facet_id<=0)
+          continue;
+
+        real_t fn[dim];
+        if(dim==2){
+          const real_t *x1 = _mesh->get_coords(n[(j+1)%3]);
+          const real_t *x2 = _mesh->get_coords(n[(j+2)%3]);
+          fn[0] = x2[1]-x1[1];
+          fn[1] = x1[0]-x2[0];
+        }else{
+          const real_t *x1 = _mesh->get_coords(n[(j+1)%4]);
+          const real_t *x2 = _mesh->get_coords(n[(j+2)%4]);
+          const real_t *x3 = _mesh->get_coords(n[(j+3)%4]);
+          real_t u[] = {x2[0]-x1[0], x2[1]-x1[1], x2[2]-x1[2]};
+          real_t v[] = {x3[0]-x1[0], x3[1]-x1[1], x3[2]-x1[2]};
+          fn[0] = u[1]*v[2]-u[2]*v[1];
+          fn[1] = u[2]*v[0]-u[0]*v[2];
+          fn[2] = u[0]*v[1]-u[1]*v[0];
+        }
+        real_t mag = 0;
+        for(size_t k=0;k<dim;k++)
+          mag += fn[k]*fn[k];
+        mag = sqrt(mag);
+        for(size_t k=0;k<dim;k++)
+          fn[k] /= mag;
+
+        if(id==0){
+          id = facet_id;
+          for(size_t k=0;k<dim;k++)
+            normal[k] = fn[k];
+          continue;
+        }
+
+        // The orientation of the facet is arbitrary.
+        real_t cos_theta = 0;
+        for(size_t k=0;k<dim;k++)
+          cos_theta += fn[k]*normal[k];
+        if(facet_id!=id || 1.0-fabs(cos_theta)>1.0e-12)
+          return false;
+      }
+    }
+
+    return id!=0;
+  }
+
+  /*! Remove the component of v normal to the boundary if node is a vertex
+   * which slides along the boundary.
+   * @returns false if nothing is left of v.
+   */
+  inline bool project_to_surface(index_t node, double *v) const{
+    if(!boundary_smoothing || !surface_vertex[node])
+      return true;
+
+    const real_t *normal = &(surface_normal[node*dim]);
+    double vn = 0;
+    for(size_t k=0;k<dim;k++)
+      vn += v[k]*normal[k];
+
+    double mag = 0;
+    for(size_t k=0;k<dim;k++){
+      v[k] -= vn*normal[k];
+      mag += v[k]*v[k];
+    }
+
+    return std::isnormal(mag);
+  }
+
+  /*! Put the neighbours of a vertex which has been moved in iteration iter
+   * on the worklist for the next iteration. The state of each vertex is
+   * 2*iter while it waits to be visited in iteration iter, 2*iter+1 once it
+   * has been visited, and negative if it may not be moved. A neighbour still
+   * waiting to be visited in this iteration will see the new position anyway.
+   */
+  inline void requeue(index_t node, int iter, std::vector< std::atomic<int> > &state, std::vector<index_t> &next){
+    for(const auto& it : _mesh->NNList[node]){
+      int last = state[it].load(std::memory_order_relaxed);
+      if(last<0 || last==2*iter || last==2*(iter+1))
+        continue;
+
+      if(state[it].exchange(2*(iter+1), std::memory_order_relaxed)!=2*(iter+1))
+        next.push_back(it);
+    }
+  }
+
+  /*! Concatenate the per-thread lists of vertices into the worklist, in
+   * index order as far as possible. Must be called by every thread of the
+   * parallel region; next is cleared.
+   * @param state visiting state of each vertex; see requeue().
+   * @param target state of the vertices which are on the worklist.
+   */
+  void gather_worklist(std::vector<index_t> &next, int tid, std::vector<index_t> &offsets,
+                       const std::vector< std::atomic<int> > &state, int target){
+    index_t NNodes = state.size();
+
+    // The team may be smaller than the maximum number of threads.
+#pragma omp single
+    {
+      int nthreads = 1;
+#ifdef _OPENMP
+      nthreads = omp_get_num_threads();
+#endif
+      offsets.assign(nthreads+1, 0);
+    }
+
+    offsets[tid+1] = next.size();
+#pragma omp barrier
+#pragma omp single
+    {
+      for(size_t i=1;i<offsets.size();i++)
+        offsets[i] += offsets[i-1];
+    }
+
+    if(offsets.back()*8>NNodes){
+      // It is cheaper to scan for the vertices than to sort them.
+      next.clear();
+#pragma omp for schedule(static)
+      for(index_t node=0; node<NNodes; ++node){
+        if(state[node].load(std::memory_order_relaxed)==target)
+          next.push_back(node);
+      }
+
+      offsets[tid+1] = next.size();
+#pragma omp barrier
+#pragma omp single
+      {
+        for(size_t i=1;i<offsets.size();i++)
+          offsets[i] += offsets[i-1];
+      }
+    }else{
+      std::sort(next.begin(), next.end());
+    }
+
+#pragma omp single
+    worklist.resize(offsets.back());
+
+    std::copy(next.begin(), next.end(), worklist.begin()+offsets[tid]);
+    next.clear();
+
+#pragma omp barrier
+  }
+
+  /// Order in which adjacent partition boundary vertices are smoothed.
+  inline bool halo_precedes(index_t a, index_t b) const{
+    index_t ga = _mesh->lnn2gnn[a];
+    index_t gb = _mesh->lnn2gnn[b];
+
+    // Hash the global numbers so the phases do not follow the numbering.
+    uint32_t ha = (uint32_t)ga*2654435761u;
+    uint32_t hb = (uint32_t)gb*2654435761u;
+    if(ha!=hb)
+      return ha>hb;
+    return ga>gb;
+  }
+
   // Laplacian smooth kernels
   inline bool laplacian_kernel(index_t node){
     bool update;
@@ -573,82 +923,168 @@ template<typename real_t, int dim>
   }
   
   inline void laplacian_2d_kernel(index_t node, real_t *p){
-    std::set<index_t> patch(_mesh->get_node_patch(node));
-    
     real_t x0 = get_x(node);
     real_t y0 = get_y(node);
-    
-    Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic> A = Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic>::Zero(2, 2);
-    Eigen::Matrix<real_t, Eigen::Dynamic, 1> q = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(2);
-    
+
+    // Accumulate the symmetric system, A = [a00 a01; a01 a11].
+    real_t a00=0, a01=0, a11=0, q0=0, q1=0;
+
     const real_t *m0 = _mesh->get_metric(node);
-    for(const auto& il : patch){
+    for(const auto& il : _mesh->NNList[node]){
       real_t x = get_x(il)-x0;
       real_t y = get_y(il)-y0;
-      
+
       const real_t *m1 = _mesh->get_metric(il);
       double m[] = {0.5*(m0[0]+m1[0]), 0.5*(m0[1]+m1[1]), 0.5*(m0[2]+m1[2])};
 
-      q[0] += (m[0]*x + m[1]*y);
-      q[1] += (m[1]*x + m[2]*y);
-      
-      A[0] += m[0]; A[1] += m[1];
-      A[3] += m[2];
+      q0 += (m[0]*x + m[1]*y);
+      q1 += (m[1]*x + m[2]*y);
+
+      a00 += m[0]; a01 += m[1];
+      a11 += m[2];
     }
-    A[2]=A[1];
-    
-    // Want to solve the system Ap=q to find the new position, p.
-    Eigen::Matrix<real_t, Eigen::Dynamic, 1> b = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(2);
-    A.svd().solve(q, &b);
-    
-    for(size_t i=0;i<2;i++)
-      p[i] = b[i];
-    
+
+    if(boundary_smoothing && surface_vertex[node]){
+      // Minimise along the boundary, p = x0 + s*t.
+      const real_t *normal = &(surface_normal[node*2]);
+      real_t t[] = {-normal[1], normal[0]};
+      real_t tAt = t[0]*(a00*t[0] + a01*t[1]) + t[1]*(a01*t[0] + a11*t[1]);
+      real_t s = (tAt>0)?(t[0]*q0 + t[1]*q1)/tAt:0;
+
+      p[0] = x0 + s*t[0];
+      p[1] = y0 + s*t[1];
+
+      return;
+    }
+
+    // Want to solve the system Ap=q to find the new position, p. A is a
+    // sum of metric tensors so it is normally well conditioned and
+    // Cramer's rule can be used.
+    real_t det = a00*a11 - a01*a01;
+    if(det > 1.0e-10*a00*a11){
+      p[0] = (a11*q0 - a01*q1)/det;
+      p[1] = (a00*q1 - a01*q0)/det;
+    }else{
+      Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic> A = Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic>::Zero(2, 2);
+      Eigen::Matrix<real_t, Eigen::Dynamic, 1> q = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(2);
+      A[0] = a00; A[1] = a01;
+      A[2] = a01; A[3] = a11;
+      q[0] = q0; q[1] = q1;
+
+      Eigen::Matrix<real_t, Eigen::Dynamic, 1> b = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(2);
+      A.svd().solve(q, &b);
+
+      for(size_t i=0;i<2;i++)
+        p[i] = b[i];
+    }
+
     p[0] += x0;
     p[1] += y0;
-    
+
     return;
   }
-  
+
   inline void laplacian_3d_kernel(index_t node, real_t *p){
-    std::set<index_t> patch(_mesh->get_node_patch(node));
-    
     real_t x0 = get_x(node);
     real_t y0 = get_y(node);
     real_t z0 = get_z(node);
-    
-    Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic> A = Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic>::Zero(3, 3);
-    Eigen::Matrix<real_t, Eigen::Dynamic, 1> q = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(3);
-    
+
+    // Accumulate the symmetric system, A = [a00 a01 a02; a01 a11 a12; a02 a12 a22].
+    real_t a00=0, a01=0, a02=0, a11=0, a12=0, a22=0, q0=0, q1=0, q2=0;
+
     const real_t *m0 = _mesh->get_metric(node);
-    for(const auto& il : patch){
+    for(const auto& il : _mesh->NNList[node]){
       real_t x = get_x(il)-x0;
       real_t y = get_y(il)-y0;
       real_t z = get_z(il)-z0;
-      
+
       const real_t *m1 = _mesh->get_metric(il);
       double m[] = {0.5*(m0[0]+m1[0]), 0.5*(m0[1]+m1[1]), 0.5*(m0[2]+m1[2]),
-		                       0.5*(m0[3]+m1[3]), 0.5*(m0[4]+m1[4]),
-		                                          0.5*(m0[5]+m1[5])};
+                                       0.5*(m0[3]+m1[3]), 0.5*(m0[4]+m1[4]),
+                                                          0.5*(m0[5]+m1[5])};
+
+      q0 += m[0]*x + m[1]*y + m[2]*z;
+      q1 += m[1]*x + m[3]*y + m[4]*z;
+      q2 += m[2]*x + m[4]*y + m[5]*z;
+
+      a00 += m[0]; a01 += m[1]; a02 += m[2];
+      a11 += m[3]; a12 += m[4];
+      a22 += m[5];
+    }
+
+    if(boundary_smoothing && surface_vertex[node]){
+      // Minimise over the boundary plane, p = x0 + s0*t0 + s1*t1. The
+      // tangents are built from the coordinate axis least aligned with the
+      // normal so that they stay exactly in an axis aligned plane.
+      const real_t *normal = &(surface_normal[node*3]);
+      int k = 0;
+      for(int i=1;i<3;i++)
+        if(fabs(normal[i])<fabs(normal[k]))
+          k = i;
+      real_t e[] = {0, 0, 0};
+      e[k] = 1;
+
+      real_t t0[] = {e[1]*normal[2]-e[2]*normal[1], e[2]*normal[0]-e[0]*normal[2], e[0]*normal[1]-e[1]*normal[0]};
+      real_t mag = sqrt(t0[0]*t0[0] + t0[1]*t0[1] + t0[2]*t0[2]);
+      for(int i=0;i<3;i++)
+        t0[i] /= mag;
+      real_t t1[] = {normal[1]*t0[2]-normal[2]*t0[1], normal[2]*t0[0]-normal[0]*t0[2], normal[0]*t0[1]-normal[1]*t0[0]};
+
+      real_t At0[] = {a00*t0[0] + a01*t0[1] + a02*t0[2],
+                      a01*t0[0] + a11*t0[1] + a12*t0[2],
+                      a02*t0[0] + a12*t0[1] + a22*t0[2]};
+      real_t At1[] = {a00*t1[0] + a01*t1[1] + a02*t1[2],
+                      a01*t1[0] + a11*t1[1] + a12*t1[2],
+                      a02*t1[0] + a12*t1[1] + a22*t1[2]};
+
+      real_t b00 = t0[0]*At0[0] + t0[1]*At0[1] + t0[2]*At0[2];
+      real_t b01 = t0[0]*At1[0] + t0[1]*At1[1] + t0[2]*At1[2];
+      real_t b11 = t1[0]*At1[0] + t1[1]*At1[1] + t1[2]*At1[2];
+      real_t r0 = t0[0]*q0 + t0[1]*q1 + t0[2]*q2;
+      real_t r1 = t1[0]*q0 + t1[1]*q1 + t1[2]*q2;
+
+      real_t s0=0, s1=0;
+      real_t det = b00*b11 - b01*b01;
+      if(det > 1.0e-10*b00*b11){
+        s0 = (b11*r0 - b01*r1)/det;
+        s1 = (b00*r1 - b01*r0)/det;
+      }
 
-      q[0] += m[0]*x + m[1]*y + m[2]*z;
-      q[1] += m[1]*x + m[3]*y + m[4]*z;
-      q[2] += m[2]*x + m[4]*y + m[5]*z;
+      p[0] = x0 + s0*t0[0] + s1*t1[0];
+      p[1] = y0 + s0*t0[1] + s1*t1[1];
+      p[2] = z0 + s0*t0[2] + s1*t1[2];
 
-      A[0] += m[0]; A[1] += m[1]; A[2] += m[2];
-      A[4] += m[3]; A[5] += m[4];
-      A[8] += m[5];
+      return;
     }
-    A[3] = A[1];
-    A[6] = A[2];
-    A[7] = A[5];
 
-    // Want to solve the system Ap=q to find the new position, p.
-    Eigen::Matrix<real_t, Eigen::Dynamic, 1> b = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(3);
-    A.svd().solve(q, &b);
+    // Want to solve the system Ap=q to find the new position, p, by
+    // Cramer's rule unless A is close to singular.
+    real_t c00 = a11*a22 - a12*a12;
+    real_t c01 = a02*a12 - a01*a22;
+    real_t c02 = a01*a12 - a02*a11;
+    real_t det = a00*c00 + a01*c01 + a02*c02;
+    if(det > 1.0e-10*a00*a11*a22){
+      real_t c11 = a00*a22 - a02*a02;
+      real_t c12 = a01*a02 - a00*a12;
+      real_t c22 = a00*a11 - a01*a01;
+
+      p[0] = (c00*q0 + c01*q1 + c02*q2)/det;
+      p[1] = (c01*q0 + c11*q1 + c12*q2)/det;
+      p[2] = (c02*q0 + c12*q1 + c22*q2)/det;
+    }else{
+      Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic> A = Eigen::Matrix<real_t, Eigen::Dynamic, Eigen::Dynamic>::Zero(3, 3);
+      Eigen::Matrix<real_t, Eigen::Dynamic, 1> q = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(3);
+      A[0] = a00; A[1] = a01; A[2] = a02;
+      A[3] = a01; A[4] = a11; A[5] = a12;
+      A[6] = a02; A[7] = a12; A[8] = a22;
+      q[0] = q0; q[1] = q1; q[2] = q2;
 
-    for(int i=0;i<3;i++)
-      p[i] = b[i];
+      Eigen::Matrix<real_t, Eigen::Dynamic, 1> b = Eigen::Matrix<real_t, Eigen::Dynamic, 1>::Zero(3);
+      A.svd().solve(q, &b);
+
+      for(int i=0;i<3;i++)
+        p[i] = b[i];
+    }
 
     p[0] += x0;
     p[1] += y0;
@@ -713,7 +1149,7 @@ template<typename real_t, int dim>
     if(!valid){
       // Try the mid point.
       for(size_t j=0;j<3;j++)
-        p[j] = 0.5*(p[j] +  _mesh->_coords[node*2+j]);
+        p[j] = 0.5*(p[j] +  _mesh->_coords[node*3+j]);
       
       valid = generate_location_3d(node, p, mp);
     }
@@ -753,6 +1189,8 @@ template<typename real_t, int dim>
   }
 
   inline bool optimisation_linf_2d_kernel(index_t n0){
+    std::vector<double> &new_quality = quality_workspace();
+
     const double *m0 = _mesh->get_metric(n0);
     const double *x0 = _mesh->get_coords(n0);
     
@@ -783,7 +1221,9 @@ template<typename real_t, int dim>
       const double *x1 = _mesh->get_coords(n1);
       const double *x2 = _mesh->get_coords(n2);
       
-      property->lipnikov_grad(loc, x0, x1, x2, m0, grad_w);
+      property->lipnikov_grad(x0, x1, x2, m0, grad_w);
+      if(!project_to_surface(n0, grad_w))
+        return false;
       
       double mag = sqrt(grad_w[0]*grad_w[0]+grad_w[1]*grad_w[1]);
       assert(mag!=0);
@@ -798,7 +1238,7 @@ template<typename real_t, int dim>
     double alpha;
     {
       double bbox[] = {DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX};
-      for(const auto& it : _mesh->NEList[n0]){
+      for(const auto& it : _mesh->NNList[n0]){
         const double *x1 = _mesh->get_coords(it);
         
         bbox[0] = std::min(bbox[0], x1[0]);
@@ -827,7 +1267,7 @@ template<typename real_t, int dim>
       const double *x2 = _mesh->get_coords(n2);
 	
       double grad[2];
-      property->lipnikov_grad(loc, x0, x1, x2, m0, grad);
+      property->lipnikov_grad(x0, x1, x2, m0, grad);
 	
       double new_alpha =
           (_mesh->quality[it]-worst_element.first)/
@@ -848,7 +1288,7 @@ template<typename real_t, int dim>
       double new_x0[2];
       for(int i=0;i<2;i++){
         new_x0[i] = x0[i] + alpha*search[i];
-        if(!std::isnormal(new_x0[i]))
+        if(!std::isfinite(new_x0[i]))
           return false;
       }
 
@@ -858,45 +1298,17 @@ template<typename real_t, int dim>
       if(!valid)
         continue;
       
-      // Need to check that we have not decreased the Linf norm. Start by assuming the best.
-      linf_update = true;
-      std::vector<double> new_quality;
-      for(const auto& it : _mesh->NEList[n0]){
-        const index_t *n=_mesh->get_element(it);
-        size_t loc=0;
-        for(;loc<3;loc++)
-          if(n[loc]==n0)
-            break;
-	
-        int n1 = n[(loc+1)%3];
-        int n2 = n[(loc+2)%3];
-
-        const double *x1 = _mesh->get_coords(n1);
-        const double *x2 = _mesh->get_coords(n2);
-
-        const double *m1 = _mesh->get_metric(n1);
-        const double *m2 = _mesh->get_metric(n2);
-
-        double new_q = property->lipnikov(new_x0, x1, x2, new_m0, m1, m2);
-        new_quality.push_back(new_q);
-
-        if(!std::isnormal(new_q) || new_quality.back()<worst_element.first){
-          linf_update = false;
-          break;
-        }
-      }
+      // Need to check that we have not decreased the Linf norm.
+      linf_update = patch_quality(n0, new_x0, new_m0, worst_element.first, new_quality);
       
       if(!linf_update)
         continue;
       
       // Update information
-      // go backwards and pop quality
       assert(_mesh->NEList[n0].size()==new_quality.size());
-      for(typename std::set<index_t>::const_reverse_iterator it=_mesh->NEList[n0].rbegin();it!=_mesh->NEList[n0].rend();++it){
-        _mesh->quality[*it] = new_quality.back();
-        new_quality.pop_back();
-      }
-      assert(new_quality.empty());
+      size_t j=0;
+      for(const auto& it : _mesh->NEList[n0])
+        _mesh->quality[it] = new_quality[j++];
       
       for(size_t i=0;i<dim;i++)
         _mesh->_coords[n0*dim+i] = new_x0[i];
@@ -904,9 +1316,6 @@ template<typename real_t, int dim>
       for(size_t i=0;i<msize;i++)
         _mesh->metric[n0*msize+i] = new_m0[i];
 
-      for(auto& e : _mesh->NEList[n0])
-        update_quality_2d(e);
-
       break;
     }
   
@@ -914,6 +1323,8 @@ template<typename real_t, int dim>
   }
 
   inline bool optimisation_linf_3d_kernel(index_t n0){
+    std::vector<double> &new_quality = quality_workspace();
+
     const double *m0 = _mesh->get_metric(n0);
     const double *x0 = _mesh->get_coords(n0);
     
@@ -966,7 +1377,9 @@ template<typename real_t, int dim>
       const double *x2 = _mesh->get_coords(n2);
       const double *x3 = _mesh->get_coords(n3);
       
-      property->lipnikov_grad(loc, x0, x1, x2, x3, m0, grad_w);
+      property->lipnikov_grad(x0, x1, x2, x3, m0, grad_w);
+      if(!project_to_surface(n0, grad_w))
+        return false;
       
       double mag = sqrt(grad_w[0]*grad_w[0] + grad_w[1]*grad_w[1] + grad_w[2]*grad_w[2]);
       if(!std::isnormal(mag)){
@@ -985,7 +1398,7 @@ template<typename real_t, int dim>
     double alpha;
     {
       double bbox[] = {DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX, DBL_MAX, -DBL_MAX};
-      for(const auto& it : _mesh->NEList[n0]){
+      for(const auto& it : _mesh->NNList[n0]){
         const double *x1 = _mesh->get_coords(it);
 	
         bbox[0] = std::min(bbox[0], x1[0]);
@@ -1038,7 +1451,7 @@ template<typename real_t, int dim>
       const double *x3 = _mesh->get_coords(n3);
 	
       double grad[3];
-      property->lipnikov_grad(loc, x0, x1, x2, x3, m0, grad);
+      property->lipnikov_grad(x0, x1, x2, x3, m0, grad);
 	
       double new_alpha =
           (_mesh->quality[it]-worst_element.first)/
@@ -1067,85 +1480,126 @@ template<typename real_t, int dim>
       if(!valid)
         continue;
 
-      // Need to check that we have not decreased the Linf norm. Start by assuming the best.
-      linf_update = true;
-      std::vector<double> new_quality;
-      for(const auto& it : _mesh->NEList[n0]){
-        const index_t *n=_mesh->get_element(it);
-        size_t loc=0;
-        for(;loc<4;loc++)
-          if(n[loc]==n0)
-            break;
+      // Need to check that we have not decreased the Linf norm.
+      linf_update = patch_quality(n0, new_x0, new_m0, worst_element.first, new_quality);
+
+      if(!linf_update)
+        continue;
+
+      // Update information
+      assert(_mesh->NEList[n0].size()==new_quality.size());
+      size_t j=0;
+      for(const auto& it : _mesh->NEList[n0])
+        _mesh->quality[it] = new_quality[j++];
+      
+      for(size_t i=0;i<dim;i++)
+        _mesh->_coords[n0*dim+i] = new_x0[i];
+      
+      for(size_t i=0;i<msize;i++)
+        _mesh->metric[n0*msize+i] = new_m0[i];
+
+      break;
+    }
+  
+    return linf_update;
+  }
+
+  /// Workspace of the calling thread for the new element qualities of a patch.
+  inline std::vector<double>& quality_workspace(){
+    int tid = 0;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+#endif
+    return new_quality_workspace[tid];
+  }
 
-        int n1, n2, n3;
+  /*! Evaluate the quality of the elements around n0, in the order of
+   * NEList[n0], as if n0 were moved to x0 with metric m0. The elements
+   * are evaluated in batches and the evaluation stops after the first
+   * batch which contains an element no better than worst_q.
+   * @returns true if every element is better than worst_q.
+   */
+  inline bool patch_quality(index_t n0, const double *x0, const double *m0, double worst_q, std::vector<double>& new_quality){
+    const int B = ElementProperty<real_t>::batch_size;
+    const int nl = dim+1;
+    const int ms = (dim==2?3:6);
+
+    double x[nl*dim*B], m[nl*ms*B], q[B];
+
+    new_quality.resize(_mesh->NEList[n0].size());
+    size_t cnt=0;
+    int nb=0;
+    for(const auto& it : _mesh->NEList[n0]){
+      const index_t *n=_mesh->get_element(it);
+      size_t loc=0;
+      for(;loc<nl;loc++)
+        if(n[loc]==n0)
+          break;
+
+      // Put n0 first while preserving the orientation of the element.
+      index_t v[nl];
+      v[0] = n0;
+      if(dim==2){
+        v[1] = n[(loc+1)%3];
+        v[2] = n[(loc+2)%3];
+      }else{
         switch(loc){
         case 0:
-          n1 = n[1];
-          n2 = n[2];
-          n3 = n[3];
+          v[1] = n[1];
+          v[2] = n[2];
+          v[3] = n[3];
           break;
         case 1:
-          n1 = n[2];
-          n2 = n[0];
-          n3 = n[3];
+          v[1] = n[2];
+          v[2] = n[0];
+          v[3] = n[3];
           break;
         case 2:
-          n1 = n[0];
-          n2 = n[1];
-          n3 = n[3];
+          v[1] = n[0];
+          v[2] = n[1];
+          v[3] = n[3];
           break;
         case 3:
-          n1 = n[0];
-          n2 = n[2];
-          n3 = n[1];
+          v[1] = n[0];
+          v[2] = n[2];
+          v[3] = n[1];
           break;
         }
-	
-        const double *x1 = _mesh->get_coords(n1);
-        const double *x2 = _mesh->get_coords(n2);
-        const double *x3 = _mesh->get_coords(n3);
+      }
 
+      for(int i=0;i<nl;i++){
+        const double *xi = (i==0)?x0:_mesh->get_coords(v[i]);
+        const double *mi = (i==0)?m0:_mesh->get_metric(v[i]);
+        for(int k=0;k<dim;k++)
+          x[(dim*i+k)*B+nb] = xi[k];
+        for(int k=0;k<ms;k++)
+          m[(ms*i+k)*B+nb] = mi[k];
+      }
+      nb++;
 
-        const double *m1 = _mesh->get_metric(n1);
-        const double *m2 = _mesh->get_metric(n2);
-        const double *m3 = _mesh->get_metric(n3);
+      if(nb<B && cnt+nb<new_quality.size())
+        continue;
 
-        double new_q = property->lipnikov(new_x0, x1, x2, x3, new_m0, m1, m2, m3);
+      if(dim==2)
+        property->lipnikov_batch2d(nb, x, m, q);
+      else
+        property->lipnikov_batch3d(nb, x, m, q);
 
-        if(new_q>worst_element.first){
-          new_quality.push_back(new_q);
+      for(int e=0;e<nb;e++){
+        if(dim==2){
+          if(!std::isnormal(q[e]) || q[e]<worst_q)
+            return false;
         }else{
           // This means that the linear approximation was not sufficient.
-          linf_update = false;
-          break;
+          if(!(q[e]>worst_q))
+            return false;
         }
+        new_quality[cnt++] = q[e];
       }
-      
-      if(!linf_update)
-        continue;
-
-      // Update information
-      // go backwards and pop quality
-      assert(_mesh->NEList[n0].size()==new_quality.size());
-      for(typename std::set<index_t>::const_reverse_iterator it=_mesh->NEList[n0].rbegin();it!=_mesh->NEList[n0].rend();++it){
-        _mesh->quality[*it] = new_quality.back();
-        new_quality.pop_back();
-      }
-      assert(new_quality.empty());
-      
-      for(size_t i=0;i<dim;i++)
-        _mesh->_coords[n0*dim+i] = new_x0[i];
-      
-      for(size_t i=0;i<msize;i++)
-        _mesh->metric[n0*msize+i] = new_m0[i];
-
-      for(auto& e : _mesh->NEList[n0])
-        update_quality_3d(e);
-
-      break;
+      nb=0;
     }
-  
-    return linf_update;
+
+    return true;
   }
 
   inline real_t get_x(index_t nid){
@@ -1461,6 +1915,32 @@ template<typename real_t, int dim>
 
   int mpi_nparts, rank;
   real_t good_q, epsilon_q;
+
+  // Priority ordering of vertices.
+  bool priority_order;
+  real_t qmin_target;
+  PriorityBuckets<real_t> buckets;
+  std::vector<real_t> vertex_quality;
+  std::vector<index_t> order;
+
+  bool halo_smoothing;
+
+  // State of the partition boundary smoothing between smooth_halo_begin() and smooth_halo_end().
+  bool halo_in_flight;
+  std::vector<int> halo_pending;
+  std::vector<index_t> halo_recv_pending;
+
+  // Boundary vertices which may slide along a flat part of the boundary.
+  bool boundary_smoothing;
+  std::vector<char> fixed_vertex, surface_vertex;
+  std::vector<real_t> surface_normal;
+
+  // Per-thread workspace of the L-infinity optimisation kernels.
+  std::vector< std::vector<double> > new_quality_workspace;
+
+  // Vertices to be visited by smart_laplacian and its convergence history.
+  std::vector<index_t> worklist;
+  std::vector< std::pair<index_t, index_t> > convergence_history;
 };
 
 #endif
@@ -39,6 +39,7 @@
 #define SWAPPING_H
 
 #include <algorithm>
+#include <cfloat>
 #include <set>
 #include <vector>
 
@@ -46,14 +47,7 @@
 #include "ElementProperty.h"
 #include "Lock.h"
 #include "Mesh.h"
-
-#ifdef HAVE_BOOST_UNORDERED_MAP_HPP
-#include <boost/unordered_map.hpp>
-  typedef boost::unordered_map< index_t, std::set<index_t> > propagation_map;
-#else
-#include <map>
-  typedef std::map< index_t, std::set<index_t> > propagation_map;
-#endif
+#include "PriorityBuckets.h"
 
 /*! \brief Performs edge/face swapping.
  *
@@ -86,6 +80,10 @@ template<typename real_t, int dim> class Swapping{
     }
 
     nnodes_reserve = 0;
+    metric_delaunay = false;
+
+    priority_order = false;
+    qmin_target = -1.0;
   }
 
   /// Default destructor.
@@ -94,11 +92,37 @@ template<typename real_t, int dim> class Swapping{
       delete property;
   }
 
-  void swap(real_t quality_tolerance){
+  /*! Visit vertices approximately in order of increasing quality, worst
+   * first, rather than in index order. Vertices without any element below
+   * the quality tolerance are then not visited at all.
+   * @param enable use the priority order.
+   * @param target return without swapping if the minimum element quality
+   * has already reached this value. Ignored if not positive.
+   */
+  void set_priority_order(bool enable, real_t target=-1.0){
+    priority_order = enable;
+    qmin_target = target;
+  }
+
+  /*! Swap edges (and in 3D, faces) of elements whose quality is below a tolerance.
+   * @param quality_tolerance elements with a lower quality are considered for swapping.
+   * @param use_metric_delaunay in 2D, only consider flipping edges which
+   * are not locally Delaunay in the metric averaged over the two elements
+   * (Lawson's algorithm). A flip must still improve the worst quality of
+   * the pair to be accepted. The in-circle test rejects most candidates
+   * before any quality is evaluated, which makes swapping faster, but it
+   * also rejects flips that would improve the quality, so the mean quality
+   * is similar while the minimum quality can be much worse than with the
+   * default criterion.
+   */
+  void swap(real_t quality_tolerance, bool use_metric_delaunay=false){
     size_t NNodes = _mesh->get_number_nodes();
     size_t NElements = _mesh->get_number_elements();
 
     min_Q = quality_tolerance;
+    metric_delaunay = use_metric_delaunay;
+
+    _mesh->template update_stale_quality<dim>();
 
     if(nnodes_reserve<NNodes){
       nnodes_reserve = NNodes;
@@ -108,6 +132,25 @@ template<typename real_t, int dim> class Swapping{
       vLocks.resize(NNodes);
     }
 
+    index_t nvisit = NNodes;
+    if(priority_order){
+      // Worst quality of the elements around each vertex.
+      vertex_quality.resize(NNodes);
+#pragma omp parallel for schedule(guided)
+      for(index_t node=0; node<nvisit; ++node){
+        real_t q = DBL_MAX;
+        for(auto& ele : _mesh->NEList[node])
+          q = std::min(q, _mesh->quality[ele]);
+        vertex_quality[node] = q;
+      }
+
+      real_t qmin = buckets.sort(vertex_quality, min_Q, order);
+      if(order.empty() || (qmin_target>0 && qmin>=qmin_target))
+        return;
+
+      nvisit = order.size();
+    }
+
 #pragma omp parallel
     {
       // Vector "retry" is used to store aborted vertices.
@@ -115,8 +158,12 @@ template<typename real_t, int dim> class Swapping{
       std::vector<index_t> retry, next_retry;
       std::vector<index_t> this_round, next_round;
       std::vector<index_t> locks_held;
+
+      // Workspace reused for every vertex so that the sweep does not allocate.
+      std::vector<index_t> edges, patch;
 #pragma omp for schedule(guided) nowait
-      for(index_t node=0; node<NNodes; ++node){
+      for(index_t i=0; i<nvisit; ++i){
+        index_t node = priority_order?order[i]:i;
         bool abort = false;
 
         if(!vLocks[node].try_lock()){
@@ -134,31 +181,8 @@ template<typename real_t, int dim> class Swapping{
         }
 
         if(!abort){
-          std::set< Edge<index_t> > active_edges;
-          for(auto& ele : _mesh->NEList[node]){
-            if(_mesh->quality[ele] < min_Q){
-              const index_t* n = _mesh->get_element(ele);
-              for(int i=0; i<nloc; ++i){
-                if(node < n[i])
-                  active_edges.insert(Edge<index_t>(node, n[i]));
-              }
-            }
-          }
-
-          for(auto& edge : active_edges){
-            marked_edges[edge.edge.first].erase(edge.edge.second);
-            propagation_map pMap;
-            bool swapped = swap_kernel(edge, pMap);
-
-            if(swapped){
-              for(auto& entry : pMap){
-                for(auto& v : entry.second){
-                  marked_edges[entry.first].insert(v);
-                  next_round.push_back(entry.first);
-                }
-              }
-            }
-          }
+          collect_edges(node, edges);
+          swap_edges(node, edges, patch, next_round);
         }
         else
           retry.push_back(node);
@@ -193,24 +217,8 @@ template<typename real_t, int dim> class Swapping{
           }
 
           if(!abort){
-            std::set<index_t> marked_edges_copy = marked_edges[node];
-            marked_edges[node].clear();
-
-            for(auto& target : marked_edges_copy){
-              Edge<index_t> edge(node, target);
-              propagation_map pMap;
-              marked_edges[edge.edge.first].erase(edge.edge.second);
-              bool swapped = swap_kernel(edge, pMap);
-
-              if(swapped){
-                for(auto& entry : pMap){
-                  for(auto& v : entry.second){
-                    marked_edges[entry.first].insert(v);
-                    next_round.push_back(entry.first);
-                  }
-                }
-              }
-            }
+            collect_marked_edges(node, edges);
+            swap_edges(node, edges, patch, next_round);
           }
           else
             next_retry.push_back(node);
@@ -249,31 +257,8 @@ template<typename real_t, int dim> class Swapping{
           }
 
           if(!abort){
-            std::set< Edge<index_t> > active_edges;
-            for(auto& ele : _mesh->NEList[node]){
-              if(_mesh->quality[ele] < min_Q){
-                const index_t* n = _mesh->get_element(ele);
-                for(int i=0; i<nloc; ++i){
-                  if(node < n[i])
-                    active_edges.insert(Edge<index_t>(node, n[i]));
-                }
-              }
-            }
-
-            for(auto& edge : active_edges){
-              marked_edges[edge.edge.first].erase(edge.edge.second);
-              propagation_map pMap;
-              bool swapped = swap_kernel(edge, pMap);
-
-              if(swapped){
-                for(auto& entry : pMap){
-                  for(auto& v : entry.second){
-                    marked_edges[entry.first].insert(v);
-                    next_round.push_back(entry.first);
-                  }
-                }
-              }
-            }
+            collect_edges(node, edges);
+            swap_edges(node, edges, patch, next_round);
           }
           else
             retry.push_back(node);
@@ -308,24 +293,8 @@ template<typename real_t, int dim> class Swapping{
             }
 
             if(!abort){
-              std::set<index_t> marked_edges_copy = marked_edges[node];
-              marked_edges[node].clear();
-
-              for(auto& target : marked_edges_copy){
-                Edge<index_t> edge(node, target);
-                propagation_map pMap;
-                marked_edges[edge.edge.first].erase(edge.edge.second);
-                bool swapped = swap_kernel(edge, pMap);
-
-                if(swapped){
-                  for(auto& entry : pMap){
-                    for(auto& v : entry.second){
-                      marked_edges[entry.first].insert(v);
-                      next_round.push_back(entry.first);
-                    }
-                  }
-                }
-              }
+              collect_marked_edges(node, edges);
+              swap_edges(node, edges, patch, next_round);
             }
             else
               next_retry.push_back(node);
@@ -348,180 +317,257 @@ template<typename real_t, int dim> class Swapping{
 
  private:
 
-  inline bool swap_kernel(const Edge<index_t>& edge, propagation_map& pMap){
+  /*! Collect the edges node-n, node<n, of the poor elements around node.
+   * Any edges still marked on node are subsumed and so are cleared.
+   */
+  inline void collect_edges(index_t node, std::vector<index_t>& edges){
+    marked_edges[node].clear();
+
+    edges.clear();
+    for(auto& ele : _mesh->NEList[node]){
+      if(_mesh->quality[ele] < min_Q){
+        const index_t* n = _mesh->get_element(ele);
+        for(size_t i=0; i<nloc; ++i){
+          if(node < n[i] && std::find(edges.begin(), edges.end(), n[i])==edges.end())
+            edges.push_back(n[i]);
+        }
+      }
+    }
+    std::sort(edges.begin(), edges.end());
+  }
+
+  /// Take the edges marked on node.
+  inline void collect_marked_edges(index_t node, std::vector<index_t>& edges){
+    edges.assign(marked_edges[node].begin(), marked_edges[node].end());
+    marked_edges[node].clear();
+    std::sort(edges.begin(), edges.end());
+  }
+
+  /// Try to swap the edges node-edges[i] and, in 3D, the faces around node.
+  inline void swap_edges(index_t node, const std::vector<index_t>& edges,
+                         std::vector<index_t>& patch, std::vector<index_t>& next_round){
+    for(auto& target : edges){
+      unmark_edge(node, target);
+      swap_kernel(Edge<index_t>(node, target), next_round);
+    }
+
+    if(dim==3)
+      swap_kernel3d_face(node, patch, next_round);
+  }
+
+  /*! Mark the edge i-j to be revisited. Marks are kept on the lower vertex
+   * of the edge, which is queued in next_round when the mark is new.
+   */
+  inline void mark_edge(index_t i, index_t j, std::vector<index_t>& next_round){
+    if(j<i)
+      std::swap(i, j);
+
+    std::vector<index_t>& marks = marked_edges[i];
+    if(std::find(marks.begin(), marks.end(), j)==marks.end()){
+      marks.push_back(j);
+      next_round.push_back(i);
+    }
+  }
+
+  /// Remove the mark, if any, on the edge i-j, i<j.
+  inline void unmark_edge(index_t i, index_t j){
+    std::vector<index_t>& marks = marked_edges[i];
+    typename std::vector<index_t>::iterator it = std::find(marks.begin(), marks.end(), j);
+    if(it!=marks.end()){
+      *it = marks.back();
+      marks.pop_back();
+    }
+  }
+
+  inline bool swap_kernel(const Edge<index_t>& edge, std::vector<index_t>& next_round){
     if(dim==2)
-      return swap_kernel2d(edge, pMap);
+      return swap_kernel2d(edge, next_round);
     else
-      return swap_kernel3d(edge, pMap);
+      return swap_kernel3d(edge, next_round);
   }
 
-  /*
-  void swap3d(real_t Q_min){
-    // Process face-to-edge swap.
-    for(int c=0;c<max_colour;c++){
-      for(size_t i=0;i<graph.size();i++){
-        int eid0 = renumber[i];
-
-        if(colour[i]==c && (partialEEList.count(eid0)>0)){
+  /*! Face-to-edge (2-3) swaps of the faces incident to a vertex.
+   * Only faces containing node are considered so that both elements
+   * sharing the face, and therefore all vertices of the hull, are
+   * protected by the locks held on node and its neighbours.
+   * @param node vertex whose incident faces are considered.
+   * @param patch workspace for the elements around node.
+   * @param next_round vertices with edges marked to be revisited.
+   */
+  inline bool swap_kernel3d_face(index_t node, std::vector<index_t>& patch, std::vector<index_t>& next_round){
+    bool swapped = false, restart = true;
+    while(restart){
+      restart = false;
+
+      // Both elements sharing a face incident to node are in the patch of
+      // node, so the neighbour across a face is found without touching NEList.
+      patch.assign(_mesh->NEList[node].begin(), _mesh->NEList[node].end());
+      for(size_t p=0;p<patch.size() && !restart;p++){
+        index_t eid0 = patch[p];
+        if(!(_mesh->quality[eid0] < min_Q))
+          continue;
 
-          // Check this is not deleted.
-          const int *n=_mesh->get_element(eid0);
-          if(n[0]<0)
+        const index_t *n = _mesh->get_element(eid0);
+        for(int j=0;j<4;j++){
+          if(n[j]==node)
             continue;
 
-          assert(partialEEList[eid0].size()==4);
+          // Face opposite n[j], oriented so that hull[0-3] has the same
+          // orientation as eid0.
+          index_t hull[5];
+          if(j==0){
+            hull[0] = n[1]; hull[1] = n[3]; hull[2] = n[2]; hull[3] = n[0];
+          }else if(j==1){
+            hull[0] = n[2]; hull[1] = n[3]; hull[2] = n[0]; hull[3] = n[1];
+          }else if(j==2){
+            hull[0] = n[0]; hull[1] = n[3]; hull[2] = n[1]; hull[3] = n[2];
+          }else{
+            hull[0] = n[0]; hull[1] = n[1]; hull[2] = n[2]; hull[3] = n[3];
+          }
 
-          // Check adjacency is not toxic.
-          bool toxic = false;
-          for(int j=0;j<4;j++){
-            int eid1 = partialEEList[eid0][j];
-            if(eid1==-1)
+          // Find the element on the other side of the face. If there is
+          // none then this is a surface facet and it cannot be swapped.
+          index_t eid1 = -1;
+          for(auto& ele : patch){
+            if(ele==eid0)
               continue;
-
-            const int *m=_mesh->get_element(eid1);
-            if(m[0]<0){
-              toxic = true;
+            const index_t *m = _mesh->get_element(ele);
+            int shared = 0;
+            for(int k=0;k<4;k++)
+              shared += (m[k]==hull[0] || m[k]==hull[1] || m[k]==hull[2]);
+            if(shared==3){
+              eid1 = ele;
               break;
             }
           }
-          if(toxic)
+
+          // Faces between two poor elements have already been tried from the
+          // element with the lower ID.
+          if(eid1<0 || (eid1<eid0 && _mesh->quality[eid1]<min_Q))
             continue;
 
-          // Create set of nodes for quick lookup.
-          std::set<int> ele0_set;
-          for(int j=0;j<4;j++)
-            ele0_set.insert(n[j]);
+          // Start again on the modified patch if the swap succeeded.
+          if(swap_face(eid0, eid1, hull, next_round)){
+            swapped = restart = true;
+            break;
+          }
+        }
+      }
+    }
 
-          for(int j=0;j<4;j++){
-            int eid1 = partialEEList[eid0][j];
-            if(eid1==-1)
-              continue;
+    return swapped;
+  }
 
-            std::vector<int> hull(5, -1);
-            if(j==0){
-              hull[0] = n[1];
-              hull[1] = n[3];
-              hull[2] = n[2];
-              hull[3] = n[0];
-            }else if(j==1){
-              hull[0] = n[2];
-              hull[1] = n[3];
-              hull[2] = n[0];
-              hull[3] = n[1];
-            }else if(j==2){
-              hull[0] = n[0];
-              hull[1] = n[3];
-              hull[2] = n[1];
-              hull[3] = n[2];
-            }else if(j==3){
-              hull[0] = n[0];
-              hull[1] = n[1];
-              hull[2] = n[2];
-              hull[3] = n[3];
-            }
+  /// 2-element to 3-element swap of the face hull[0-2] shared by eid0 and eid1.
+  inline bool swap_face(index_t eid0, index_t eid1, index_t *hull, std::vector<index_t>& next_round){
+    const index_t *n = _mesh->get_element(eid0);
+    const index_t *m = _mesh->get_element(eid1);
+    for(int k=0;k<4;k++){
+      if(m[k]!=hull[0] && m[k]!=hull[1] && m[k]!=hull[2]){
+        hull[4] = m[k];
+        break;
+      }
+    }
 
-            const int *m=_mesh->get_element(eid1);
-            assert(m[0]>=0);
+    if(_mesh->is_halo_node(hull[3]) && _mesh->is_halo_node(hull[4]))
+      return false;
+    if(_mesh->is_halo_node(hull[0]) && _mesh->is_halo_node(hull[1]) && _mesh->is_halo_node(hull[2]))
+      return false;
 
-            for(int k=0;k<4;k++)
-              if(ele0_set.count(m[k])==0){
-                hull[4] = m[k];
-                break;
-              }
-            assert(hull[4]!=-1);
-
-            // New element: 0143
-            real_t q0 = property->lipnikov(_mesh->get_coords(hull[0]),
-                                           _mesh->get_coords(hull[1]),
-                                           _mesh->get_coords(hull[4]),
-                                           _mesh->get_coords(hull[3]),
-                                           _mesh->get_metric(hull[0]),
-                                           _mesh->get_metric(hull[1]),
-                                           _mesh->get_metric(hull[4]),
-                                           _mesh->get_metric(hull[3]));
-
-            // New element: 1243
-            real_t q1 = property->lipnikov(_mesh->get_coords(hull[1]),
-                                           _mesh->get_coords(hull[2]),
-                                           _mesh->get_coords(hull[4]),
-                                           _mesh->get_coords(hull[3]),
-                                           _mesh->get_metric(hull[1]),
-                                           _mesh->get_metric(hull[2]),
-                                           _mesh->get_metric(hull[4]),
-                                           _mesh->get_metric(hull[3]));
-
-            // New element:2043
-            real_t q2 = property->lipnikov(_mesh->get_coords(hull[2]),
-                                           _mesh->get_coords(hull[0]),
-                                           _mesh->get_coords(hull[4]),
-                                           _mesh->get_coords(hull[3]),
-                                           _mesh->get_metric(hull[2]),
-                                           _mesh->get_metric(hull[0]),
-                                           _mesh->get_metric(hull[4]),
-                                           _mesh->get_metric(hull[3]));
-
-            if(std::min(quality[eid0],quality[eid1]) < std::min(q0, std::min(q1, q2))){
-              // Cache boundary values
-              int eid0_b0, eid0_b1, eid0_b2, eid1_b0, eid1_b1, eid1_b2;
-              for(int face=0; face<nloc; ++face){
-                if(n[face] == hull[0])
-                  eid0_b0 = _mesh->boundary[eid0*nloc+face];
-                else if(n[face] == hull[1])
-                  eid0_b1 = _mesh->boundary[eid0*nloc+face];
-                else if(n[face] == hull[2])
-                  eid0_b2 = _mesh->boundary[eid0*nloc+face];
-
-                if(m[face] == hull[0])
-                  eid1_b0 = _mesh->boundary[eid1*nloc+face];
-                else if(m[face] == hull[1])
-                  eid1_b1 = _mesh->boundary[eid1*nloc+face];
-                else if(m[face] == hull[2])
-                  eid1_b2 = _mesh->boundary[eid1*nloc+face];
-              }
+    // The new edge must not already exist.
+    if(std::find(_mesh->NNList[hull[3]].begin(), _mesh->NNList[hull[3]].end(), hull[4])!=_mesh->NNList[hull[3]].end())
+      return false;
 
-              _mesh->erase_element(eid0);
-              _mesh->erase_element(eid1);
-
-              int e0[] = {hull[0], hull[1], hull[4], hull[3]};
-              int b0[] = {0, 0, eid0_b2, eid1_b2};
-              int eid0 = _mesh->append_element(e0, b0);
-              quality.push_back(q0);
-
-              int e1[] = {hull[1], hull[2], hull[4], hull[3]};
-              int b1[] = {0, 0, eid0_b0, eid1_b0};
-              int eid1 = _mesh->append_element(e1, b1);
-              quality.push_back(q1);
-
-              int e2[] = {hull[2], hull[0], hull[4], hull[3]};
-              int b2[] = {0, 0, eid0_b1, eid1_b1};
-              int eid2 = _mesh->append_element(e2, b2);
-              quality.push_back(q2);
-
-              _mesh->NNList[hull[3]].push_back(hull[4]);
-              _mesh->NNList[hull[4]].push_back(hull[3]);
-              _mesh->NEList[hull[0]].insert(eid0);
-              _mesh->NEList[hull[0]].insert(eid2);
-              _mesh->NEList[hull[1]].insert(eid0);
-              _mesh->NEList[hull[1]].insert(eid1);
-              _mesh->NEList[hull[2]].insert(eid1);
-              _mesh->NEList[hull[2]].insert(eid2);
-              _mesh->NEList[hull[3]].insert(eid0);
-              _mesh->NEList[hull[3]].insert(eid1);
-              _mesh->NEList[hull[3]].insert(eid2);
-              _mesh->NEList[hull[4]].insert(eid0);
-              _mesh->NEList[hull[4]].insert(eid1);
-              _mesh->NEList[hull[4]].insert(eid2);
+    const index_t new_elements[] = {hull[0], hull[1], hull[4], hull[3],
+                                    hull[1], hull[2], hull[4], hull[3],
+                                    hull[2], hull[0], hull[4], hull[3]};
 
-              break;
-            }
-          }
+    // The hull is only convex with respect to the new edge if all new
+    // elements are positively oriented.
+    for(int k=0;k<3;k++){
+      const index_t *e = new_elements+k*4;
+      if(property->volume(_mesh->get_coords(e[0]), _mesh->get_coords(e[1]),
+                          _mesh->get_coords(e[2]), _mesh->get_coords(e[3]))<=0)
+        return false;
+    }
+
+    // Check new minimum quality.
+    real_t min_quality = std::min(_mesh->quality[eid0], _mesh->quality[eid1]);
+    real_t newq[3];
+    for(int k=0;k<3;k++){
+      const index_t *e = new_elements+k*4;
+      newq[k] = property->lipnikov(_mesh->get_coords(e[0]), _mesh->get_coords(e[1]),
+                                   _mesh->get_coords(e[2]), _mesh->get_coords(e[3]),
+                                   _mesh->get_metric(e[0]), _mesh->get_metric(e[1]),
+                                   _mesh->get_metric(e[2]), _mesh->get_metric(e[3]));
+      if(!(newq[k] > min_quality))
+        return false;
+    }
+
+    // Cache boundary values.
+    int bn[3], bm[3];
+    for(size_t face=0; face<nloc; ++face){
+      for(int k=0;k<3;k++){
+        if(n[face] == hull[k])
+          bn[k] = _mesh->boundary[eid0*nloc+face];
+        if(m[face] == hull[k])
+          bm[k] = _mesh->boundary[eid1*nloc+face];
+      }
+    }
+
+    const int new_boundaries[] = {0, 0, bn[2], bm[2],
+                                  0, 0, bn[0], bm[0],
+                                  0, 0, bn[1], bm[1]};
+
+    _mesh->erase_element(eid0);
+    _mesh->erase_element(eid1);
+
+    // Recycle both element IDs and allocate one more.
+    index_t new_eids[3];
+    new_eids[0] = eid0;
+    new_eids[1] = eid1;
+#pragma omp atomic capture
+    {
+      new_eids[2] = _mesh->NElements;
+      _mesh->NElements++;
+    }
+
+    if(_mesh->_ENList.size() < (new_eids[2]+1)*nloc){
+      ENList_lock.lock();
+      if(_mesh->_ENList.size() < (new_eids[2]+1)*nloc){
+        _mesh->_ENList.resize(2*(new_eids[2]+1)*nloc);
+        _mesh->boundary.resize(2*(new_eids[2]+1)*nloc);
+        _mesh->quality.resize(2*(new_eids[2]+1)*nloc);
+      }
+      ENList_lock.unlock();
+    }
+
+    _mesh->NNList[hull[3]].push_back(hull[4]);
+    _mesh->NNList[hull[4]].push_back(hull[3]);
+
+    for(int k=0;k<3;k++){
+      index_t eid = new_eids[k];
+      for(size_t i=0;i<nloc;i++){
+        _mesh->_ENList[eid*nloc+i] = new_elements[k*4+i];
+        _mesh->boundary[eid*nloc+i] = new_boundaries[k*4+i];
+      }
+      _mesh->quality[eid] = newq[k];
+
+      for(size_t p=0; p<nloc; ++p){
+        index_t v1 = new_elements[k*4+p];
+        _mesh->NEList[v1].insert(eid);
+
+        for(size_t q=p+1; q<nloc; ++q){
+          index_t v2 = new_elements[k*4+q];
+          mark_edge(v1, v2, next_round);
         }
       }
     }
+
+    return true;
   }
-  */
 
-  inline bool swap_kernel2d(const Edge<index_t>& edge, propagation_map& pMap){
+  inline bool swap_kernel2d(const Edge<index_t>& edge, std::vector<index_t>& next_round){
     index_t i = edge.edge.first;
     index_t j = edge.edge.second;
 
@@ -579,6 +625,13 @@ template<typename real_t, int dim> class Swapping{
     if(_mesh->is_halo_node(k)&& _mesh->is_halo_node(l))
       return false;
 
+    // The in-circle test rejects most candidates without evaluating the
+    // quality. Because the averaged metric differs from one pair of
+    // elements to the next, Lawson flips alone can cycle, so a flip must
+    // still improve the worst quality below.
+    if(metric_delaunay && !in_metric_circumcircle(n[n_off], n[(n_off+1)%3], n[(n_off+2)%3], l))
+      return false;
+
     int n_swap[] = {n[n_off], m[m_off],       n[(n_off+2)%3]}; // new eid0
     int m_swap[] = {n[n_off], n[(n_off+1)%3], m[m_off]};       // new eid1
 
@@ -632,10 +685,10 @@ template<typename real_t, int dim> class Swapping{
         _mesh->boundary[eid1*nloc+cnt] = bm_swap[cnt];
       }
 
-      pMap[std::min(i, k)].insert(std::max(i, k));
-      pMap[std::min(i, l)].insert(std::max(i, l));
-      pMap[std::min(j, k)].insert(std::max(j, k));
-      pMap[std::min(j, l)].insert(std::max(j, l));
+      mark_edge(i, k, next_round);
+      mark_edge(i, l, next_round);
+      mark_edge(j, k, next_round);
+      mark_edge(j, l, next_round);
 
       return true;
     }
@@ -643,21 +696,82 @@ template<typename real_t, int dim> class Swapping{
     return false;
   }
 
-  inline bool swap_kernel3d(const Edge<index_t>& edge, propagation_map& pMap){
+  /*! In-circle test in the metric averaged over the four vertices of a pair
+   * of triangles sharing an edge.
+   * @param a, b, c vertices of a positively oriented triangle.
+   * @param p vertex opposite the triangle.
+   * @returns true if p lies strictly inside the metric circumcircle of (a, b, c).
+   */
+  inline bool in_metric_circumcircle(index_t a, index_t b, index_t c, index_t p) const{
+    const index_t tri[] = {a, b, c};
+
+    const double *ma = _mesh->get_metric(a);
+    const double *mb = _mesh->get_metric(b);
+    const double *mc = _mesh->get_metric(c);
+    const double *mp = _mesh->get_metric(p);
+    real_t m[3];
+    for(int i=0;i<3;i++)
+      m[i] = 0.25*(ma[i] + mb[i] + mc[i] + mp[i]);
+
+    // Lift the vertices, relative to p, onto the metric paraboloid.
+    const real_t *xp = _mesh->get_coords(p);
+    real_t d[3][3];
+    for(int i=0;i<3;i++){
+      const real_t *x = _mesh->get_coords(tri[i]);
+      d[i][0] = x[0]-xp[0];
+      d[i][1] = x[1]-xp[1];
+      d[i][2] = m[0]*d[i][0]*d[i][0] + 2*m[1]*d[i][0]*d[i][1] + m[2]*d[i][1]*d[i][1];
+    }
+
+    real_t det = d[0][0]*(d[1][1]*d[2][2] - d[1][2]*d[2][1])
+      - d[0][1]*(d[1][0]*d[2][2] - d[1][2]*d[2][0])
+      + d[0][2]*(d[1][0]*d[2][1] - d[1][1]*d[2][0]);
+
+    // Co-circular vertices are not flipped, otherwise the swap could cycle.
+    real_t scale = fabs(d[0][0])*(fabs(d[1][1]*d[2][2]) + fabs(d[1][2]*d[2][1]))
+      + fabs(d[0][1])*(fabs(d[1][0]*d[2][2]) + fabs(d[1][2]*d[2][0]))
+      + fabs(d[0][2])*(fabs(d[1][0]*d[2][1]) + fabs(d[1][1]*d[2][0]));
+
+    return property->getOrientation()*det > 1.0e-10*scale;
+  }
+
+  /*! Edge removal by retriangulating the ring of vertices around the edge.
+   * The triangulation of the ring polygon maximising the minimum quality of
+   * the resulting elements is found by dynamic programming over
+   * sub-polygons (Klincsek, 1980; Shewchuk, 2002), so each candidate
+   * triangle, and the pair of elements it forms with nk and nl, is
+   * evaluated at most once.
+   */
+  inline bool swap_kernel3d(const Edge<index_t>& edge, std::vector<index_t>& next_round){
     index_t nk = edge.edge.first;
     index_t nl = edge.edge.second;
 
     if(_mesh->is_halo_node(nk) && _mesh->is_halo_node(nl))
       return false;
 
-    std::set<index_t> neigh_elements;
-    set_intersection(_mesh->NEList[nk].begin(), _mesh->NEList[nk].end(),
-                     _mesh->NEList[nl].begin(), _mesh->NEList[nl].end(),
-                     inserter(neigh_elements, neigh_elements.begin()));
+    // Elements around the edge. Rings which are too large are not considered.
+    index_t neigh_elements[max_ring_size];
+    size_t nelements = 0;
+    {
+      std::set<index_t>::const_iterator ik=_mesh->NEList[nk].begin(), il=_mesh->NEList[nl].begin();
+      while(ik!=_mesh->NEList[nk].end() && il!=_mesh->NEList[nl].end()){
+        if(*ik<*il){
+          ++ik;
+        }else if(*il<*ik){
+          ++il;
+        }else{
+          if(nelements==max_ring_size)
+            return false;
+          neigh_elements[nelements++] = *ik;
+          ++ik;
+          ++il;
+        }
+      }
+    }
 
     bool abort = true;
-    for(auto& e : neigh_elements){
-      if(_mesh->quality[e] < min_Q){
+    for(size_t e=0;e<nelements;e++){
+      if(_mesh->quality[neigh_elements[e]] < min_Q){
         abort = false;
         break;
       }
@@ -667,586 +781,125 @@ template<typename real_t, int dim> class Swapping{
       return false;
 
     double min_quality = 1.0;
-    std::vector<index_t> constrained_edges_unsorted;
-    std::map<int, std::map<index_t, int> > b;
-    std::vector<int> element_order, e_to_eid;
-
-    for(auto& it : neigh_elements){
-      min_quality = std::min(min_quality, _mesh->quality[it]);
-
-      const int *m=_mesh->get_element(it);
-      if(m[0]<0){
-        return false;
-      }
+    index_t constrained_edges_unsorted[2*max_ring_size];
+    int bk_unsorted[max_ring_size], bl_unsorted[max_ring_size];
+    {
+      for(size_t e=0;e<nelements;e++){
+        index_t it = neigh_elements[e];
+        min_quality = std::min(min_quality, _mesh->quality[it]);
 
-      e_to_eid.push_back(it);
+        const int *m=_mesh->get_element(it);
+        if(m[0]<0){
+          return false;
+        }
 
-      for(int j=0;j<4;j++){
-        if((m[j]!=nk)&&(m[j]!=nl)){
-          constrained_edges_unsorted.push_back(m[j]);
-        }else if(m[j] == nk){
-          b[it][nk] = _mesh->boundary[nloc*(it)+j];
-        }else{ // if(m[j] == nl)
-          b[it][nl] = _mesh->boundary[nloc*(it)+j];
+        size_t loc = 0;
+        for(int j=0;j<4;j++){
+          if((m[j]!=nk)&&(m[j]!=nl)){
+            constrained_edges_unsorted[e*2+loc++] = m[j];
+          }else if(m[j] == nk){
+            bk_unsorted[e] = _mesh->boundary[nloc*(it)+j];
+          }else{ // if(m[j] == nl)
+            bl_unsorted[e] = _mesh->boundary[nloc*(it)+j];
+          }
         }
+        assert(loc==2);
       }
     }
 
-    size_t nelements = neigh_elements.size();
-    assert(nelements*2==constrained_edges_unsorted.size());
-    assert(b.size() == nelements);
-
-    // Sort edges.
-    std::vector<index_t> constrained_edges;
-    std::vector<bool> sorted(nelements, false);
-    constrained_edges.push_back(constrained_edges_unsorted[0]);
-    constrained_edges.push_back(constrained_edges_unsorted[1]);
-    element_order.push_back(e_to_eid[0]);
-    for(size_t j=1;j<nelements;j++){
-      for(size_t e=1;e<nelements;e++){
+    // Sort edges into a ring. ring[e] and ring[e+1] are the vertices of the
+    // e'th element which are not on the edge being removed, while bk[e] and
+    // bl[e] are that element's facets opposite nk and nl respectively.
+    size_t m = nelements;
+    index_t ring[max_ring_size+1];
+    int bk[max_ring_size], bl[max_ring_size];
+    bool sorted[max_ring_size];
+    std::fill(sorted, sorted+m, false);
+    ring[0] = constrained_edges_unsorted[0];
+    ring[1] = constrained_edges_unsorted[1];
+    bk[0] = bk_unsorted[0];
+    bl[0] = bl_unsorted[0];
+    for(size_t j=1;j<m;j++){
+      bool found = false;
+      for(size_t e=1;e<m;e++){
         if(sorted[e])
           continue;
-        if(*constrained_edges.rbegin()==constrained_edges_unsorted[e*2]){
-          constrained_edges.push_back(constrained_edges_unsorted[e*2]);
-          constrained_edges.push_back(constrained_edges_unsorted[e*2+1]);
-          element_order.push_back(e_to_eid[e]);
-          sorted[e]=true;
-          break;
-        }else if(*constrained_edges.rbegin()==constrained_edges_unsorted[e*2+1]){
-          constrained_edges.push_back(constrained_edges_unsorted[e*2+1]);
-          constrained_edges.push_back(constrained_edges_unsorted[e*2]);
-          element_order.push_back(e_to_eid[e]);
-          sorted[e]=true;
-          break;
+        if(ring[j]==constrained_edges_unsorted[e*2]){
+          ring[j+1] = constrained_edges_unsorted[e*2+1];
+        }else if(ring[j]==constrained_edges_unsorted[e*2+1]){
+          ring[j+1] = constrained_edges_unsorted[e*2];
+        }else{
+          continue;
         }
+        bk[j] = bk_unsorted[e];
+        bl[j] = bl_unsorted[e];
+        sorted[e] = true;
+        found = true;
+        break;
       }
-    }
 
-    if(*constrained_edges.begin() != *constrained_edges.rbegin()){
-      return false;
-    }
-    assert(element_order.size() == nelements);
-
-    double orig_vol = 0.0;
-    for(auto& ele : neigh_elements){
-      const index_t* n = _mesh->get_element(ele);
-      orig_vol += property->volume(_mesh->get_coords(n[0]), _mesh->get_coords(n[1]),
-          _mesh->get_coords(n[2]), _mesh->get_coords(n[3]));
+      if(!found)
+        return false;
     }
 
-    std::vector< std::vector<index_t> > new_elements;
-    std::vector< std::vector<int> > new_boundaries;
-    if(nelements==3){
-      // This is the 3-element to 2-element swap.
-      new_elements.resize(1);
-      new_boundaries.resize(1);
-
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(b[element_order[1]][nk]);
-      new_boundaries[0].push_back(b[element_order[2]][nk]);
-      new_boundaries[0].push_back(b[element_order[0]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(b[element_order[2]][nl]);
-      new_boundaries[0].push_back(b[element_order[1]][nl]);
-      new_boundaries[0].push_back(b[element_order[0]][nl]);
-      new_boundaries[0].push_back(0);
-    }else if(nelements==4){
-      // This is the 4-element to 4-element swap.
-      new_elements.resize(2);
-      new_boundaries.resize(2);
-
-      // Option 1.
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[3]][nk]);
-      new_boundaries[0].push_back(b[element_order[0]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(b[element_order[2]][nk]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[1]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(b[element_order[3]][nl]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[0]][nl]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[2]][nl]);
-      new_boundaries[0].push_back(b[element_order[1]][nl]);
-      new_boundaries[0].push_back(0);
-
-      // Option 2
-      new_elements[1].push_back(constrained_edges[0]);
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(constrained_edges[4]);
-      new_elements[1].push_back(nl);
-      new_boundaries[1].push_back(b[element_order[1]][nk]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(b[element_order[0]][nk]);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[0]);
-      new_elements[1].push_back(constrained_edges[4]);
-      new_elements[1].push_back(constrained_edges[6]);
-      new_elements[1].push_back(nl);
-      new_boundaries[1].push_back(b[element_order[2]][nk]);
-      new_boundaries[1].push_back(b[element_order[3]][nk]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[0]);
-      new_elements[1].push_back(constrained_edges[4]);
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(nk);
-      new_boundaries[1].push_back(b[element_order[1]][nl]);
-      new_boundaries[1].push_back(b[element_order[0]][nl]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[0]);
-      new_elements[1].push_back(constrained_edges[6]);
-      new_elements[1].push_back(constrained_edges[4]);
-      new_elements[1].push_back(nk);
-      new_boundaries[1].push_back(b[element_order[2]][nl]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(b[element_order[3]][nl]);
-      new_boundaries[1].push_back(0);
-    }else if(nelements==5){
-      // This is the 5-element to 6-element swap.
-      new_elements.resize(5);
-      new_boundaries.resize(5);
-
-      // Option 1
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(b[element_order[1]][nk]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[0]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[2]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(constrained_edges[8]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(b[element_order[4]][nk]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[3]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[1]][nl]);
-      new_boundaries[0].push_back(b[element_order[0]][nl]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[2]][nl]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[8]);
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[4]][nl]);
-      new_boundaries[0].push_back(b[element_order[3]][nl]);
-      new_boundaries[0].push_back(0);
-
-      // Option 2
-      new_elements[1].push_back(constrained_edges[0]);
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(constrained_edges[8]);
-      new_elements[1].push_back(nl);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(b[element_order[4]][nk]);
-      new_boundaries[1].push_back(b[element_order[0]][nk]);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(constrained_edges[6]);
-      new_elements[1].push_back(constrained_edges[8]);
-      new_elements[1].push_back(nl);
-      new_boundaries[1].push_back(b[element_order[3]][nk]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(constrained_edges[4]);
-      new_elements[1].push_back(constrained_edges[6]);
-      new_elements[1].push_back(nl);
-      new_boundaries[1].push_back(b[element_order[2]][nk]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(b[element_order[1]][nk]);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[0]);
-      new_elements[1].push_back(constrained_edges[8]);
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(nk);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(b[element_order[0]][nl]);
-      new_boundaries[1].push_back(b[element_order[4]][nl]);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(constrained_edges[8]);
-      new_elements[1].push_back(constrained_edges[6]);
-      new_elements[1].push_back(nk);
-      new_boundaries[1].push_back(b[element_order[3]][nl]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(0);
-
-      new_elements[1].push_back(constrained_edges[2]);
-      new_elements[1].push_back(constrained_edges[6]);
-      new_elements[1].push_back(constrained_edges[4]);
-      new_elements[1].push_back(nk);
-      new_boundaries[1].push_back(b[element_order[2]][nl]);
-      new_boundaries[1].push_back(b[element_order[1]][nl]);
-      new_boundaries[1].push_back(0);
-      new_boundaries[1].push_back(0);
-
-      // Option 3
-      new_elements[2].push_back(constrained_edges[4]);
-      new_elements[2].push_back(constrained_edges[0]);
-      new_elements[2].push_back(constrained_edges[2]);
-      new_elements[2].push_back(nl);
-      new_boundaries[2].push_back(b[element_order[0]][nk]);
-      new_boundaries[2].push_back(b[element_order[1]][nk]);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(0);
-
-      new_elements[2].push_back(constrained_edges[4]);
-      new_elements[2].push_back(constrained_edges[8]);
-      new_elements[2].push_back(constrained_edges[0]);
-      new_elements[2].push_back(nl);
-      new_boundaries[2].push_back(b[element_order[4]][nk]);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(0);
-
-      new_elements[2].push_back(constrained_edges[4]);
-      new_elements[2].push_back(constrained_edges[6]);
-      new_elements[2].push_back(constrained_edges[8]);
-      new_elements[2].push_back(nl);
-      new_boundaries[2].push_back(b[element_order[3]][nk]);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(b[element_order[2]][nk]);
-      new_boundaries[2].push_back(0);
-
-      new_elements[2].push_back(constrained_edges[4]);
-      new_elements[2].push_back(constrained_edges[2]);
-      new_elements[2].push_back(constrained_edges[0]);
-      new_elements[2].push_back(nk);
-      new_boundaries[2].push_back(b[element_order[0]][nl]);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(b[element_order[1]][nl]);
-      new_boundaries[2].push_back(0);
-
-      new_elements[2].push_back(constrained_edges[4]);
-      new_elements[2].push_back(constrained_edges[0]);
-      new_elements[2].push_back(constrained_edges[8]);
-      new_elements[2].push_back(nk);
-      new_boundaries[2].push_back(b[element_order[4]][nl]);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(0);
-
-      new_elements[2].push_back(constrained_edges[4]);
-      new_elements[2].push_back(constrained_edges[8]);
-      new_elements[2].push_back(constrained_edges[6]);
-      new_elements[2].push_back(nk);
-      new_boundaries[2].push_back(b[element_order[3]][nl]);
-      new_boundaries[2].push_back(b[element_order[2]][nl]);
-      new_boundaries[2].push_back(0);
-      new_boundaries[2].push_back(0);
-
-      // Option 4
-      new_elements[3].push_back(constrained_edges[6]);
-      new_elements[3].push_back(constrained_edges[2]);
-      new_elements[3].push_back(constrained_edges[4]);
-      new_elements[3].push_back(nl);
-      new_boundaries[3].push_back(b[element_order[1]][nk]);
-      new_boundaries[3].push_back(b[element_order[2]][nk]);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(0);
-
-      new_elements[3].push_back(constrained_edges[6]);
-      new_elements[3].push_back(constrained_edges[0]);
-      new_elements[3].push_back(constrained_edges[2]);
-      new_elements[3].push_back(nl);
-      new_boundaries[3].push_back(b[element_order[0]][nk]);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(0);
-
-      new_elements[3].push_back(constrained_edges[6]);
-      new_elements[3].push_back(constrained_edges[8]);
-      new_elements[3].push_back(constrained_edges[0]);
-      new_elements[3].push_back(nl);
-      new_boundaries[3].push_back(b[element_order[4]][nk]);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(b[element_order[3]][nk]);
-      new_boundaries[3].push_back(0);
-
-      new_elements[3].push_back(constrained_edges[6]);
-      new_elements[3].push_back(constrained_edges[4]);
-      new_elements[3].push_back(constrained_edges[2]);
-      new_elements[3].push_back(nk);
-      new_boundaries[3].push_back(b[element_order[1]][nl]);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(b[element_order[2]][nl]);
-      new_boundaries[3].push_back(0);
-
-      new_elements[3].push_back(constrained_edges[6]);
-      new_elements[3].push_back(constrained_edges[2]);
-      new_elements[3].push_back(constrained_edges[0]);
-      new_elements[3].push_back(nk);
-      new_boundaries[3].push_back(b[element_order[0]][nl]);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(0);
-
-      new_elements[3].push_back(constrained_edges[6]);
-      new_elements[3].push_back(constrained_edges[0]);
-      new_elements[3].push_back(constrained_edges[8]);
-      new_elements[3].push_back(nk);
-      new_boundaries[3].push_back(b[element_order[4]][nl]);
-      new_boundaries[3].push_back(b[element_order[3]][nl]);
-      new_boundaries[3].push_back(0);
-      new_boundaries[3].push_back(0);
-
-      // Option 5
-      new_elements[4].push_back(constrained_edges[8]);
-      new_elements[4].push_back(constrained_edges[0]);
-      new_elements[4].push_back(constrained_edges[2]);
-      new_elements[4].push_back(nl);
-      new_boundaries[4].push_back(b[element_order[0]][nk]);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(b[element_order[4]][nk]);
-      new_boundaries[4].push_back(0);
-
-      new_elements[4].push_back(constrained_edges[8]);
-      new_elements[4].push_back(constrained_edges[2]);
-      new_elements[4].push_back(constrained_edges[4]);
-      new_elements[4].push_back(nl);
-      new_boundaries[4].push_back(b[element_order[1]][nk]);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(0);
-
-      new_elements[4].push_back(constrained_edges[8]);
-      new_elements[4].push_back(constrained_edges[4]);
-      new_elements[4].push_back(constrained_edges[6]);
-      new_elements[4].push_back(nl);
-      new_boundaries[4].push_back(b[element_order[2]][nk]);
-      new_boundaries[4].push_back(b[element_order[3]][nk]);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(0);
-
-      new_elements[4].push_back(constrained_edges[8]);
-      new_elements[4].push_back(constrained_edges[2]);
-      new_elements[4].push_back(constrained_edges[0]);
-      new_elements[4].push_back(nk);
-      new_boundaries[4].push_back(b[element_order[0]][nl]);
-      new_boundaries[4].push_back(b[element_order[4]][nl]);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(0);
-
-      new_elements[4].push_back(constrained_edges[8]);
-      new_elements[4].push_back(constrained_edges[4]);
-      new_elements[4].push_back(constrained_edges[2]);
-      new_elements[4].push_back(nk);
-      new_boundaries[4].push_back(b[element_order[1]][nl]);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(0);
-
-      new_elements[4].push_back(constrained_edges[8]);
-      new_elements[4].push_back(constrained_edges[6]);
-      new_elements[4].push_back(constrained_edges[4]);
-      new_elements[4].push_back(nk);
-      new_boundaries[4].push_back(b[element_order[2]][nl]);
-      new_boundaries[4].push_back(0);
-      new_boundaries[4].push_back(b[element_order[3]][nl]);
-      new_boundaries[4].push_back(0);
-    }else if(nelements==6){
-      // This is the 6-element to 8-element swap.
-      new_elements.resize(1);
-      new_boundaries.resize(1);
-
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[10]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[5]][nk]);
-      new_boundaries[0].push_back(b[element_order[0]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(constrained_edges[8]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(b[element_order[3]][nk]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[2]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[10]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[1]][nk]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[10]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[8]);
-      new_elements[0].push_back(nl);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[4]][nk]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[0]);
-      new_elements[0].push_back(constrained_edges[10]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(b[element_order[5]][nl]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[0]][nl]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[6]);
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[8]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[3]][nl]);
-      new_boundaries[0].push_back(b[element_order[2]][nl]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[2]);
-      new_elements[0].push_back(constrained_edges[10]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(b[element_order[1]][nl]);
-      new_boundaries[0].push_back(0);
-
-      new_elements[0].push_back(constrained_edges[4]);
-      new_elements[0].push_back(constrained_edges[10]);
-      new_elements[0].push_back(constrained_edges[8]);
-      new_elements[0].push_back(nk);
-      new_boundaries[0].push_back(b[element_order[4]][nl]);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(0);
-      new_boundaries[0].push_back(0);
-    }else{
+    // If this is a surface edge, it cannot be swapped.
+    if(ring[0] != ring[m])
       return false;
-    }
 
-    nelements = new_elements[0].size()/4;
+    // If the ring is oriented the other way about the edge then so are the
+    // new elements.
+    bool flip = property->volume(_mesh->get_coords(ring[0]), _mesh->get_coords(ring[1]),
+                                 _mesh->get_coords(nk), _mesh->get_coords(nl)) < 0;
+
+    // Q[i][j] is the best minimum quality with which the sub-polygon
+    // ring[i..j] can be triangulated, and K[i][j] the apex of the triangle
+    // on ring[i]-ring[j] achieving it. Sub-polygons which cannot beat the
+    // current minimum quality are discarded.
+    real_t Q[max_ring_size][max_ring_size], qk[max_ring_size][max_ring_size], ql[max_ring_size][max_ring_size];
+    int K[max_ring_size][max_ring_size];
+    for(size_t i=0;i+1<m;i++)
+      Q[i][i+1] = DBL_MAX;
+
+    for(size_t len=2;len<m;len++){
+      for(size_t i=0;i+len<m;i++){
+        size_t j = i+len;
+        Q[i][j] = std::max(min_quality, 0.0);
+        K[i][j] = -1;
+
+        // Unless this is the ring edge ring[0]-ring[m-1], ring[i]-ring[j]
+        // will be a new edge and so must not already exist.
+        if(j-i != m-1 && std::find(_mesh->NNList[ring[i]].begin(), _mesh->NNList[ring[i]].end(), ring[j]) != _mesh->NNList[ring[i]].end())
+          continue;
 
-    // Check new minimum quality.
-    std::vector<double> new_min_quality(new_elements.size());
-    std::vector< std::vector<double> > newq(new_elements.size());
-    int best_option=0;
-    for(size_t option=0;option<new_elements.size();option++){
-      newq[option].resize(nelements);
-      for(size_t j=0;j<nelements;j++){
-        newq[option][j] = property->lipnikov(_mesh->get_coords(new_elements[option][j*4+0]),
-                                             _mesh->get_coords(new_elements[option][j*4+1]),
-                                             _mesh->get_coords(new_elements[option][j*4+2]),
-                                             _mesh->get_coords(new_elements[option][j*4+3]),
-                                             _mesh->get_metric(new_elements[option][j*4+0]),
-                                             _mesh->get_metric(new_elements[option][j*4+1]),
-                                             _mesh->get_metric(new_elements[option][j*4+2]),
-                                             _mesh->get_metric(new_elements[option][j*4+3]));
-
-        if(newq[option][j] < 0.0){
-          index_t stash_id = new_elements[option][j*4];
-          new_elements[option][j*4] = new_elements[option][j*4+1];
-          new_elements[option][j*4+1] = stash_id;
-          int stash_b = new_boundaries[option][j*4];
-          new_boundaries[option][j*4] = new_boundaries[option][j*4+1];
-          new_boundaries[option][j*4+1] = stash_b;
-          newq[option][j] = -newq[option][j];
-        }
-      }
+        for(size_t k=i+1;k<j;k++){
+          if(std::min(Q[i][k], Q[k][j]) <= Q[i][j])
+            continue;
 
-      new_min_quality[option] = newq[option][0];
-      for(size_t j=0;j<nelements;j++)
-        new_min_quality[option] = std::min(newq[option][j], new_min_quality[option]);
-    }
+          const index_t *v0 = flip?ring+k:ring+i;
+          const index_t *v1 = flip?ring+i:ring+k;
+          real_t q_l = property->lipnikov(_mesh->get_coords(*v0), _mesh->get_coords(*v1),
+                                          _mesh->get_coords(ring[j]), _mesh->get_coords(nl),
+                                          _mesh->get_metric(*v0), _mesh->get_metric(*v1),
+                                          _mesh->get_metric(ring[j]), _mesh->get_metric(nl));
+          if(!(q_l > Q[i][j]))
+            continue;
 
+          real_t q_k = property->lipnikov(_mesh->get_coords(*v1), _mesh->get_coords(*v0),
+                                          _mesh->get_coords(ring[j]), _mesh->get_coords(nk),
+                                          _mesh->get_metric(*v1), _mesh->get_metric(*v0),
+                                          _mesh->get_metric(ring[j]), _mesh->get_metric(nk));
+          if(!(q_k > Q[i][j]))
+            continue;
 
-    for(size_t option=1;option<new_elements.size();option++){
-      if(new_min_quality[option]>new_min_quality[best_option]){
-        best_option = option;
+          Q[i][j] = std::min(std::min(Q[i][k], Q[k][j]), std::min(q_l, q_k));
+          K[i][j] = k;
+          ql[i][j] = q_l;
+          qk[i][j] = q_k;
+        }
       }
     }
 
-    if(new_min_quality[best_option] <= min_quality)
-      return false;
-
-    double new_vol = 0.0;
-    for(int j=0;j<nelements;j++){
-      const index_t* n = &new_elements[best_option][j*4];
-      new_vol += property->volume(_mesh->get_coords(n[0]), _mesh->get_coords(n[1]),
-          _mesh->get_coords(n[2]), _mesh->get_coords(n[3]));
-    }
-
-    if(fabs(new_vol - orig_vol) > DBL_EPSILON)
+    if(K[0][m-1]<0)
       return false;
 
     // Update NNList
@@ -1258,17 +911,19 @@ template<typename real_t, int dim> class Swapping{
     _mesh->NNList[nl].erase(vit);
 
     // Remove old elements.
-    for(auto& it : neigh_elements)
-      _mesh->erase_element(it);
+    for(size_t e=0;e<nelements;e++)
+      _mesh->erase_element(neigh_elements[e]);
 
     // Add new elements and mark edges for propagation.
     // First, recycle element IDs.
-    std::deque<index_t> new_eids;
-    for(auto& ele : neigh_elements)
-      new_eids.push_back(ele);
+    size_t new_nelements = 2*(m-2);
+    index_t new_eids[2*max_ring_size];
+    size_t recycled = 0;
+    for(size_t e=0;e<nelements && recycled<new_nelements;e++)
+      new_eids[recycled++] = neigh_elements[e];
 
     // Next, find how many new elements we have to allocate
-    int extra_elements = nelements - neigh_elements.size();
+    int extra_elements = new_nelements - recycled;
     if(extra_elements > 0){
       index_t new_eid;
 #pragma omp atomic capture
@@ -1288,34 +943,76 @@ template<typename real_t, int dim> class Swapping{
       }
 
       for(int i=0; i<extra_elements; ++i)
-        new_eids.push_back(new_eid++);
+        new_eids[recycled++] = new_eid++;
     }
 
-    for(size_t j=0;j<nelements;j++){
-      index_t eid = new_eids[0];
-      new_eids.pop_front();
-      for(size_t i=0;i<nloc;i++){
-        _mesh->_ENList[eid*nloc+i]=new_elements[best_option][j*4+i];
-        _mesh->boundary[eid*nloc+i]=new_boundaries[best_option][j*4+i];
+    // Walk the triangulation from the ring edge ring[0]-ring[m-1].
+    size_t stack[2*max_ring_size], top = 0, cnt = 0;
+    stack[top++] = 0;
+    stack[top++] = m-1;
+    while(top>0){
+      size_t j = stack[--top];
+      size_t i = stack[--top];
+      if(j-i<2)
+        continue;
+
+      size_t k = K[i][j];
+      stack[top++] = i;
+      stack[top++] = k;
+      stack[top++] = k;
+      stack[top++] = j;
+
+      // The new edge ring[i]-ring[j].
+      if(j-i != m-1){
+        _mesh->NNList[ring[i]].push_back(ring[j]);
+        _mesh->NNList[ring[j]].push_back(ring[i]);
       }
-      _mesh->quality[eid]=newq[best_option][j];
 
-      for(int p=0; p<nloc; ++p){
-        index_t v1 = new_elements[best_option][j*4+p];
-        _mesh->NEList[v1].insert(eid);
+      // Boundary of the facet of the triangle opposite each of its vertices.
+      size_t t[] = {flip?k:i, flip?i:k, j};
+      int bt_l[3], bt_k[3];
+      for(int p=0;p<3;p++){
+        size_t a = std::min(t[(p+1)%3], t[(p+2)%3]);
+        size_t b = std::max(t[(p+1)%3], t[(p+2)%3]);
+        if(b==a+1){
+          bt_l[p] = bk[a];
+          bt_k[p] = bl[a];
+        }else if(a==0 && b==m-1){
+          bt_l[p] = bk[m-1];
+          bt_k[p] = bl[m-1];
+        }else{
+          bt_l[p] = 0;
+          bt_k[p] = 0;
+        }
+      }
 
-        for(int q=p+1; q<nloc; ++q){
-          index_t v2 = new_elements[best_option][j*4+q];
-          std::vector<index_t>::iterator vit = std::find(_mesh->NNList[v1].begin(), _mesh->NNList[v1].end(), v2);
-          if(vit == _mesh->NNList[v1].end()){
-            _mesh->NNList[v1].push_back(v2);
-            _mesh->NNList[v2].push_back(v1);
-          }
+      const index_t ele_l[] = {ring[t[0]], ring[t[1]], ring[t[2]], nl};
+      const int b_l[] = {bt_l[0], bt_l[1], bt_l[2], 0};
+      const index_t ele_k[] = {ring[t[1]], ring[t[0]], ring[t[2]], nk};
+      const int b_k[] = {bt_k[1], bt_k[0], bt_k[2], 0};
+
+      for(int side=0;side<2;side++){
+        index_t eid = new_eids[cnt++];
+        const index_t *ele = side==0?ele_l:ele_k;
+        const int *b = side==0?b_l:b_k;
+        for(size_t p=0;p<nloc;p++){
+          _mesh->_ENList[eid*nloc+p] = ele[p];
+          _mesh->boundary[eid*nloc+p] = b[p];
+        }
+        _mesh->quality[eid] = side==0?ql[i][j]:qk[i][j];
+
+        for(size_t p=0; p<nloc; ++p){
+          index_t v1 = ele[p];
+          _mesh->NEList[v1].insert(eid);
 
-          pMap[std::min(v1,v2)].insert(std::max(v1,v2));
+          for(size_t q=p+1; q<nloc; ++q){
+            index_t v2 = ele[q];
+            mark_edge(v1, v2, next_round);
+          }
         }
       }
     }
+    assert(cnt==new_nelements);
 
     return true;
   }
@@ -1331,8 +1028,21 @@ template<typename real_t, int dim> class Swapping{
   static const size_t nloc=dim+1;
   static const size_t msize=(dim==2?3:6);
 
-  std::vector< std::set<index_t> > marked_edges;
+  // Largest ring of elements around an edge considered for edge removal.
+  static const size_t max_ring_size=16;
+
+  // Edges to be revisited, kept as a flat list of the upper vertex of each
+  // edge on its lower vertex.
+  std::vector< std::vector<index_t> > marked_edges;
   real_t min_Q;
+  bool metric_delaunay;
+
+  // Priority ordering of vertices.
+  bool priority_order;
+  real_t qmin_target;
+  PriorityBuckets<real_t> buckets;
+  std::vector<real_t> vertex_quality;
+  std::vector<index_t> order;
 };
 
 #endif
@@ -0,0 +1,43 @@
+/* Start of code generated by generate_Steiner_ellipse_2d.py. Warning - be careful about modifying
+any of the generated code directly.  Any changes/fixes should be done
+in the code generation script generation.*/
+
+
+#ifndef GENERATE_STEINER_ELLIPSE_2D_H
+#define GENERATE_STEINER_ELLIPSE_2D_H
+
+namespace pragmatic
+{
+
+void generate_Steiner_ellipse(const double *x1, const double *x2, const double *x3, double *sm);
+
+/* Calculate the Steiner ellipses of a block of n triangles. The
+   coordinates are interleaved by element, x[(v*2+d)*n+e] being
+   component d of vertex v of element e, and the metrics are returned
+   as sm[j*n+e], j=0..2, in the same upper triangular order as
+   generate_Steiner_ellipse(). Inlined so that the loop over the block
+   is vectorised.*/
+inline void generate_Steiner_ellipse_block_2d(int n, const double *x, double *sm){
+#pragma omp simd
+  for(int e=0;e<n;e++){
+    double J00 = x[2*n+e] - x[0*n+e];
+    double J10 = x[3*n+e] - x[1*n+e];
+    double J01 = x[4*n+e] - x[0*n+e];
+    double J11 = x[5*n+e] - x[1*n+e];
+
+    // Adjugate of J; the rows of J^-1 are the gradients g1..g2.
+    double idet = 1.0/(J00*J11 - J01*J10);
+
+    double g10 =  J11*idet, g11 = -J01*idet;
+    double g20 = -J10*idet, g21 =  J00*idet;
+    double g00 = -g10-g20, g01 = -g11-g21;
+
+    sm[0*n+e] = 0.5*(g00*g00 + g10*g10 + g20*g20);
+    sm[1*n+e] = 0.5*(g00*g01 + g10*g11 + g20*g21);
+    sm[2*n+e] = 0.5*(g01*g01 + g11*g11 + g21*g21);
+  }
+}
+
+}
+
+#endif
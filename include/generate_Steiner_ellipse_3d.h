@@ -11,6 +11,45 @@ namespace pragmatic
 
 void generate_Steiner_ellipse(const double *x1, const double *x2, const double *x3, const double *x4, double *sm);
 
+/* Calculate the Steiner ellipses of a block of n tetrahedra. The
+   coordinates are interleaved by element, x[(v*3+d)*n+e] being
+   component d of vertex v of element e, and the metrics are returned
+   as sm[j*n+e], j=0..5, in the same upper triangular order as
+   generate_Steiner_ellipse(). Inlined so that the loop over the block
+   is vectorised.*/
+inline void generate_Steiner_ellipse_block_3d(int n, const double *x, double *sm){
+#pragma omp simd
+  for(int e=0;e<n;e++){
+    double J00 = x[3*n+e] - x[0*n+e];
+    double J10 = x[4*n+e] - x[1*n+e];
+    double J20 = x[5*n+e] - x[2*n+e];
+    double J01 = x[6*n+e] - x[0*n+e];
+    double J11 = x[7*n+e] - x[1*n+e];
+    double J21 = x[8*n+e] - x[2*n+e];
+    double J02 = x[9*n+e] - x[0*n+e];
+    double J12 = x[10*n+e] - x[1*n+e];
+    double J22 = x[11*n+e] - x[2*n+e];
+
+    // Adjugate of J; the rows of J^-1 are the gradients g1..g3.
+    double c00 = J11*J22 - J12*J21, c01 = J02*J21 - J01*J22, c02 = J01*J12 - J02*J11;
+    double c10 = J12*J20 - J10*J22, c11 = J00*J22 - J02*J20, c12 = J02*J10 - J00*J12;
+    double c20 = J10*J21 - J11*J20, c21 = J01*J20 - J00*J21, c22 = J00*J11 - J01*J10;
+    double idet = 1.0/(J00*c00 + J01*c10 + J02*c20);
+
+    double g10 = c00*idet, g11 = c01*idet, g12 = c02*idet;
+    double g20 = c10*idet, g21 = c11*idet, g22 = c12*idet;
+    double g30 = c20*idet, g31 = c21*idet, g32 = c22*idet;
+    double g00 = -g10-g20-g30, g01 = -g11-g21-g31, g02 = -g12-g22-g32;
+
+    sm[0*n+e] = 0.5*(g00*g00 + g10*g10 + g20*g20 + g30*g30);
+    sm[1*n+e] = 0.5*(g00*g01 + g10*g11 + g20*g21 + g30*g31);
+    sm[2*n+e] = 0.5*(g00*g02 + g10*g12 + g20*g22 + g30*g32);
+    sm[3*n+e] = 0.5*(g01*g01 + g11*g11 + g21*g21 + g31*g31);
+    sm[4*n+e] = 0.5*(g01*g02 + g11*g12 + g21*g22 + g31*g32);
+    sm[5*n+e] = 0.5*(g02*g02 + g12*g12 + g22*g22 + g32*g32);
+  }
+}
+
 }
 
 #endif
@@ -296,7 +296,7 @@ extern "C" {
       }
     }
   }
-/*
+
   void pragmatic_get_lnn2gnn(int *nodes_per_partition, int *lnn2gnn){
     std::vector<int> _NPNodes, _lnn2gnn;
     ((Mesh<double> *)_pragmatic_mesh)->get_global_node_numbering(_NPNodes, _lnn2gnn);
@@ -308,7 +308,7 @@ extern "C" {
     for(size_t i=0;i<len1;i++)
       lnn2gnn[i] = _lnn2gnn[i];
   }
-*/
+
   void pragmatic_get_metric(double *metric){
     if(((Mesh<double> *)_pragmatic_mesh)->get_number_dimensions()==2){
       ((MetricField<double,2> *)_pragmatic_metric_field)->get_metric(metric);
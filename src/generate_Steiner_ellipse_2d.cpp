@@ -0,0 +1,25 @@
+
+/* Start of code generated by generate_Steiner_ellipse_2d.py. Warning - be careful about modifying
+   any of the generated code directly.  Any changes/fixes should be done
+   in the code generation script generation.
+ */
+
+#include <generate_Steiner_ellipse_2d.h>
+
+
+void pragmatic::generate_Steiner_ellipse(const double *x1, const double *x2, const double *x3, double *sm){
+  // # From http://en.wikipedia.org/wiki/Steiner_ellipse
+
+  double x[6];
+  for(int i=0;i<2;i++){
+    x[i] = x1[i]; x[2+i] = x2[i]; x[4+i] = x3[i];
+  }
+
+  generate_Steiner_ellipse_block_2d(1, x, sm);
+
+  return;
+}
+
+/* End of code generated by generate_Steiner_ellipse_2d.py. Warning - be careful about
+   modifying any of the generated code directly.  Any changes/fixes
+   should be done in the code generation script generation.*/
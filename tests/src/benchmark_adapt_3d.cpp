@@ -72,6 +72,7 @@ int main(int argc, char **argv){
 
   // Benchmark times.
   double time_coarsen=0, time_refine=0, time_swap=0, time_smooth=0, time_adapt=0;
+  size_t iterations=0;
 
   Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box50x50x50.vtu");
   mesh->create_boundary();
@@ -80,7 +81,7 @@ int main(int argc, char **argv){
   char filename[4096];
 
   if(rank==0)
-    std::cout<<"BENCHMARK: time_coarsen time_refine time_swap time_smooth time_adapt\n";
+    std::cout<<"BENCHMARK: time_coarsen time_refine time_swap time_smooth time_adapt iterations\n";
   for(int t=0;t<51;t++){
     size_t NNodes = mesh->get_number_nodes();
 
@@ -131,6 +132,7 @@ int main(int argc, char **argv){
     for(size_t I=0;I<5;I++){
       for(size_t i=0;i<10;i++){
         double L_ref = std::max(alpha*L_max, L_up);
+        if(t>0) iterations++;
 
         tic = get_wtime();
         coarsen.coarsen(L_low, L_ref);
@@ -256,7 +258,8 @@ int main(int argc, char **argv){
                <<std::setw(11)<<time_refine/t<<" "
                <<std::setw(9)<<time_swap/t<<" "
                <<std::setw(11)<<time_smooth/t<<" "
-               <<std::setw(10)<<time_adapt/t<<std::endl
+               <<std::setw(10)<<time_adapt/t<<" "
+               <<std::setw(10)<<(double)iterations/t<<std::endl
                <<"NNodes, NElements, t = "<<mesh->get_number_nodes()<<", "<<mesh->get_number_elements()<< ", " << t <<std::endl;
 
     if(verbose){
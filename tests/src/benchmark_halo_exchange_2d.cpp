@@ -0,0 +1,113 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "ticker.h"
+
+// Time halo updates of a scalar and a 2D metric field, with neighbours on
+// the same node exchanged through messages and through shared memory.
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box200x200.vtu");
+
+  size_t NNodes = mesh->get_number_nodes();
+  std::vector<double> psi(NNodes), metric(NNodes*3);
+
+  HaloExchanger &halo = mesh->get_halo_exchanger();
+  int nshared = halo.get_number_shared_neighbours();
+  MPI_Allreduce(MPI_IN_PLACE, &nshared, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  if(rank==0)
+    std::cout<<"BENCHMARK: path time_scalar time_metric (usec per update), "<<nshared/2<<" shared neighbour pairs\n";
+
+  const int nupdates=1000;
+  for(int path=0;path<2;path++){
+    bool use_shared_memory = path==1;
+    halo.set_shared_memory(use_shared_memory);
+
+    double time[2];
+    for(int field=0;field<2;field++){
+      // Warm up, so that buffers and windows are not created in the timed loop.
+      for(int i=0;i<10;i++){
+        if(field==0)
+          halo.update<double, 1>(psi);
+        else
+          halo.update<double, 3>(metric);
+      }
+
+      MPI_Barrier(MPI_COMM_WORLD);
+      double tic = get_wtime();
+      for(int i=0;i<nupdates;i++){
+        if(field==0)
+          halo.update<double, 1>(psi);
+        else
+          halo.update<double, 3>(metric);
+      }
+      time[field] = (get_wtime()-tic)/nupdates;
+      MPI_Allreduce(MPI_IN_PLACE, &(time[field]), 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    }
+
+    if(rank==0)
+      std::cout<<"BENCHMARK: "
+               <<std::setw(8)<<(use_shared_memory?"shared":"messages")<<" "
+               <<std::setw(11)<<time[0]*1e6<<" "
+               <<std::setw(11)<<time[1]*1e6<<std::endl;
+  }
+
+  mesh->free_halo_exchanger();
+  delete mesh;
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,172 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+#include "ticker.h"
+
+#include "generate_Steiner_ellipse_2d.h"
+#include "generate_Steiner_ellipse_3d.h"
+
+#include <mpi.h>
+
+// Time the generation of a metric from the mesh itself, by averaging
+// the Steiner ellipses of the elements and by fitting an ellipse to the
+// edges of each patch. The batched Steiner ellipse kernel is compared
+// with calling the single element kernel for each element.
+template<int dim> void benchmark(const char *filename, int rank){
+  Mesh<double> *mesh=VTKTools<double>::import_vtu(filename);
+
+  int NElements = mesh->get_number_elements();
+  int nloc = dim+1;
+  int msize = dim==2?3:6;
+
+  const int ntimes=5;
+  double time_element=0, time_steiner=0, time_fit=0, tic;
+
+  std::vector<double> sm(NElements*msize);
+  for(int t=0;t<ntimes;t++){
+    tic = get_wtime();
+#pragma omp parallel for
+    for(int i=0;i<NElements;i++){
+      const index_t *n=mesh->get_element(i);
+      if(dim==2)
+        pragmatic::generate_Steiner_ellipse(mesh->get_coords(n[0]), mesh->get_coords(n[1]), mesh->get_coords(n[2]), sm.data()+i*msize);
+      else
+        pragmatic::generate_Steiner_ellipse(mesh->get_coords(n[0]), mesh->get_coords(n[1]), mesh->get_coords(n[2]), mesh->get_coords(n[3]), sm.data()+i*msize);
+    }
+    time_element += get_wtime()-tic;
+  }
+
+  // Every edge of an element should have unit length in its Steiner ellipse.
+  double max_error=0;
+  for(int i=0;i<NElements;i++){
+    const index_t *n=mesh->get_element(i);
+    for(int j=0;j<nloc;j++){
+      for(int k=j+1;k<nloc;k++){
+        double l;
+        if(dim==2)
+          l = ElementProperty<double>::length2d(mesh->get_coords(n[j]), mesh->get_coords(n[k]), sm.data()+i*msize);
+        else
+          l = ElementProperty<double>::length3d(mesh->get_coords(n[j]), mesh->get_coords(n[k]), sm.data()+i*msize);
+        max_error = std::max(max_error, fabs(l-1));
+      }
+    }
+  }
+
+  double lmean_steiner, lmean_fit;
+  for(int t=0;t<ntimes;t++){
+    MetricField<double,dim> metric_field(*mesh);
+
+    tic = get_wtime();
+    metric_field.generate_Steiner_ellipse(1.0);
+    time_steiner += get_wtime()-tic;
+
+    metric_field.update_mesh();
+    lmean_steiner = mesh->get_lmean();
+  }
+
+  for(int t=0;t<ntimes;t++){
+    MetricField<double,dim> metric_field(*mesh);
+
+    tic = get_wtime();
+    metric_field.generate_mesh_metric(1.0);
+    time_fit += get_wtime()-tic;
+
+    metric_field.update_mesh();
+    lmean_fit = mesh->get_lmean();
+  }
+
+  delete mesh;
+
+  if(rank==0){
+    std::cout<<"BENCHMARK: "
+             <<std::setw(3)<<dim<<" "
+             <<std::setw(9)<<NElements<<" "
+             <<std::setw(12)<<time_element/ntimes<<" "
+             <<std::setw(12)<<time_steiner/ntimes<<" "
+             <<std::setw(12)<<time_fit/ntimes<<std::endl;
+
+    std::cout<<"Expecting unit edge lengths in the Steiner ellipses: ";
+    if(max_error<1.0e-10)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (max error="<<max_error<<")"<<std::endl;
+
+    std::cout<<"Expecting mean edge length ~ 1 for the Steiner ellipse metric: ";
+    if(fabs(lmean_steiner-1)<0.2)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (lmean="<<lmean_steiner<<")"<<std::endl;
+
+    std::cout<<"Expecting mean edge length ~ 1 for the fitted metric: ";
+    if(fabs(lmean_fit-1)<0.2)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (lmean="<<lmean_fit<<")"<<std::endl;
+  }
+}
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  if(rank==0)
+    std::cout<<"BENCHMARK: dim NElements time_element time_steiner time_fit\n";
+
+  benchmark<2>("../data/box200x200.vtu", rank);
+  benchmark<3>("../data/box50x50x50.vtu", rank);
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,188 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cfloat>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <omp.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+
+#include "Coarsen.h"
+#include "Refine.h"
+#include "Smooth.h"
+#include "Swapping.h"
+#include "ticker.h"
+
+#include <mpi.h>
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  bool verbose = false;
+  if(argc>1){
+    verbose = std::string(argv[1])=="-v";
+  }
+
+  if(rank==0)
+    std::cout<<"BENCHMARK: order time_swap time_smooth time_adapt NElements qmean qmin\n";
+
+  // Compare visiting vertices in index order with visiting the worst first.
+  for(int order=0;order<2;order++){
+    bool use_priority_order = order==1;
+
+    Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box200x200.vtu");
+    mesh->create_boundary();
+
+    MetricField<double,2> metric_field(*mesh);
+
+    size_t NNodes = mesh->get_number_nodes();
+    double eta=0.001;
+
+    std::vector<double> psi(NNodes);
+    for(size_t i=0;i<NNodes;i++){
+      double x = 2*mesh->get_coords(i)[0]-1;
+      double y = 2*mesh->get_coords(i)[1]-1;
+
+      psi[i] = 0.1*sin(50*x) + atan2(-0.1, (double)(2*x - sin(5*y)));
+    }
+
+    metric_field.add_field(&(psi[0]), eta, 2);
+    metric_field.update_mesh();
+
+    // See Eqn 7; X Li et al, Comp Methods Appl Mech Engrg 194 (2005) 4915-4950
+    double L_up = sqrt(2.0);
+    double L_low = L_up/2;
+
+    Coarsen<double, 2> coarsen(*mesh);
+    Refine<double, 2> refine(*mesh);
+    Smooth<double, 2> smooth(*mesh);
+    Swapping<double, 2> swapping(*mesh);
+
+    swapping.set_priority_order(use_priority_order);
+    smooth.set_priority_order(use_priority_order);
+
+    double time_swap=0, time_smooth=0, time_adapt=get_wtime(), tic;
+
+    double L_max = mesh->maximal_edge_length();
+    double alpha = sqrt(2.0)/2;
+    for(size_t i=0;i<20;i++){
+      double L_ref = std::max(alpha*L_max, L_up);
+
+      coarsen.coarsen(L_low, L_ref);
+
+      tic = get_wtime();
+      swapping.swap(0.7);
+      time_swap += get_wtime() - tic;
+      if(verbose){
+        std::cout<<"INFO: Verify quality after swapping.\n";
+        mesh->verify();
+      }
+
+      refine.refine(L_ref);
+
+      L_max = mesh->maximal_edge_length();
+
+      if((L_max-L_up)<0.01)
+        break;
+    }
+
+    mesh->defragment();
+
+    tic = get_wtime();
+    smooth.optimisation_linf(10);
+    time_smooth += get_wtime() - tic;
+
+    time_adapt = get_wtime()-time_adapt;
+
+    double qmean = mesh->get_qmean();
+    double qmin = mesh->get_qmin();
+    int NElements = mesh->get_number_elements();
+
+    long double perimeter = mesh->calculate_perimeter();
+    long double area = mesh->calculate_area();
+
+    if(verbose)
+      VTKTools<double>::export_vtu(use_priority_order?"../data/benchmark_priority_2d-priority":"../data/benchmark_priority_2d-index", mesh);
+
+    delete mesh;
+
+    if(rank==0){
+      std::cout<<"BENCHMARK: "
+               <<std::setw(5)<<(use_priority_order?"priority":"index")<<" "
+               <<std::setw(9)<<time_swap<<" "
+               <<std::setw(11)<<time_smooth<<" "
+               <<std::setw(10)<<time_adapt<<" "
+               <<std::setw(9)<<NElements<<" "
+               <<std::setw(5)<<qmean<<" "
+               <<std::setw(4)<<qmin<<std::endl;
+
+      std::cout<<"Expecting qmin>0.1: ";
+      if(qmin>0.1)
+        std::cout<<"pass"<<std::endl;
+      else
+        std::cout<<"fail (qmin="<<qmin<<")"<<std::endl;
+
+      std::cout<<"Expecting perimeter == 4: ";
+      if(fabs(perimeter-4)<DBL_EPSILON)
+        std::cout<<"pass"<<std::endl;
+      else
+        std::cout<<"fail (perimeter="<<perimeter<<")"<<std::endl;
+
+      std::cout<<"Expecting area == 1: ";
+      if(fabs(area-1)<DBL_EPSILON)
+        std::cout<<"pass"<<std::endl;
+      else
+        std::cout<<"fail (area="<<area<<")"<<std::endl;
+    }
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,223 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cfloat>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include <omp.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+#include "ElementProperty.h"
+#include "ticker.h"
+
+#include <mpi.h>
+
+// Scalar mean quality, one element at a time.
+double scalar_qmean(Mesh<double> *mesh, ElementProperty<double> &property){
+  int dim = mesh->get_number_dimensions();
+  int NElements = mesh->get_number_elements();
+
+  double sum=0;
+  for(int i=0;i<NElements;i++){
+    const int *n=mesh->get_element(i);
+    if(dim==2)
+      sum += property.lipnikov(mesh->get_coords(n[0]), mesh->get_coords(n[1]), mesh->get_coords(n[2]),
+                               mesh->get_metric(n[0]), mesh->get_metric(n[1]), mesh->get_metric(n[2]));
+    else
+      sum += property.lipnikov(mesh->get_coords(n[0]), mesh->get_coords(n[1]), mesh->get_coords(n[2]), mesh->get_coords(n[3]),
+                               mesh->get_metric(n[0]), mesh->get_metric(n[1]), mesh->get_metric(n[2]), mesh->get_metric(n[3]));
+  }
+
+  return sum/NElements;
+}
+
+// Gather a block of elements into the structure of arrays layout used by
+// ElementProperty::lipnikov_batch2d/3d.
+void gather_block(Mesh<double> *mesh, int b, int n, double *x, double *m){
+  const int B = ElementProperty<double>::batch_size;
+  int dim = mesh->get_number_dimensions();
+  int nloc = dim+1;
+  int msize = (dim==2)?3:6;
+
+  for(int e=0;e<n;e++){
+    const int *ele=mesh->get_element(b+e);
+    for(int i=0;i<nloc;i++){
+      const double *xi = mesh->get_coords(ele[i]);
+      const double *mi = mesh->get_metric(ele[i]);
+      for(int k=0;k<dim;k++)
+        x[(dim*i+k)*B+e] = xi[k];
+      for(int k=0;k<msize;k++)
+        m[(msize*i+k)*B+e] = mi[k];
+    }
+  }
+}
+
+// Batched mean quality. If the blocks have already been gathered then
+// only the functional is evaluated.
+double batched_qmean(Mesh<double> *mesh, ElementProperty<double> &property,
+                     std::vector<double> &x, std::vector<double> &m, bool gather){
+  const int B = ElementProperty<double>::batch_size;
+  int dim = mesh->get_number_dimensions();
+  int NElements = mesh->get_number_elements();
+  int xsize = dim*(dim+1)*B;
+  int msize = ((dim==2)?3:6)*(dim+1)*B;
+
+  double sum=0;
+  for(int b=0;b<NElements;b+=B){
+    int n = std::min(B, NElements-b);
+    double *xb = &(x[(b/B)*xsize]);
+    double *mb = &(m[(b/B)*msize]);
+    if(gather)
+      gather_block(mesh, b, n, xb, mb);
+
+    double q[B];
+    if(dim==2)
+      property.lipnikov_batch2d(n, xb, mb, q);
+    else
+      property.lipnikov_batch3d(n, xb, mb, q);
+
+    for(int e=0;e<n;e++)
+      sum+=q[e];
+  }
+
+  return sum/NElements;
+}
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  const int ntimes=20;
+
+  if(rank==0)
+    std::cout<<"BENCHMARK: dim NElements scalar(elements/s) batched(elements/s) gather+batched(elements/s)\n";
+
+  for(int dim=2;dim<=3;dim++){
+    Mesh<double> *mesh;
+    if(dim==2)
+      mesh=VTKTools<double>::import_vtu("../data/box200x200.vtu");
+    else
+      mesh=VTKTools<double>::import_vtu("../data/box50x50x50.vtu");
+
+    size_t NNodes = mesh->get_number_nodes();
+    int NElements = mesh->get_number_elements();
+
+    // Anisotropic metric so that the elements have a spread of qualities.
+    if(dim==2){
+      MetricField<double,2> metric_field(*mesh);
+      for(size_t i=0;i<NNodes;i++){
+        double x = mesh->get_coords(i)[0];
+        double y = mesh->get_coords(i)[1];
+        double m[] = {100.0+1000.0*x*x, 50.0*x*y, 100.0+1000.0*y*y};
+        metric_field.set_metric(m, i);
+      }
+      metric_field.update_mesh();
+    }else{
+      MetricField<double,3> metric_field(*mesh);
+      for(size_t i=0;i<NNodes;i++){
+        double x = mesh->get_coords(i)[0];
+        double y = mesh->get_coords(i)[1];
+        double z = mesh->get_coords(i)[2];
+        double m[] = {100.0+1000.0*x*x, 50.0*x*y, 50.0*x*z,
+                      100.0+1000.0*y*y, 50.0*y*z,
+                      100.0+1000.0*z*z};
+        metric_field.set_metric(m, i);
+      }
+      metric_field.update_mesh();
+    }
+
+    const int *n=mesh->get_element(0);
+    ElementProperty<double> *property;
+    if(dim==2)
+      property = new ElementProperty<double>(mesh->get_coords(n[0]), mesh->get_coords(n[1]), mesh->get_coords(n[2]));
+    else
+      property = new ElementProperty<double>(mesh->get_coords(n[0]), mesh->get_coords(n[1]), mesh->get_coords(n[2]), mesh->get_coords(n[3]));
+
+    const int B = ElementProperty<double>::batch_size;
+    int nblocks = (NElements+B-1)/B;
+    std::vector<double> x(nblocks*dim*(dim+1)*B), m(nblocks*((dim==2)?3:6)*(dim+1)*B);
+
+    double qmean_scalar=0, qmean_batched=0, qmean_gathered=0;
+
+    double tic = get_wtime();
+    for(int i=0;i<ntimes;i++)
+      qmean_scalar = scalar_qmean(mesh, *property);
+    double time_scalar = get_wtime()-tic;
+
+    tic = get_wtime();
+    for(int i=0;i<ntimes;i++)
+      qmean_gathered = batched_qmean(mesh, *property, x, m, true);
+    double time_gathered = get_wtime()-tic;
+
+    tic = get_wtime();
+    for(int i=0;i<ntimes;i++)
+      qmean_batched = batched_qmean(mesh, *property, x, m, false);
+    double time_batched = get_wtime()-tic;
+
+    delete property;
+    delete mesh;
+
+    if(rank==0){
+      std::cout<<"BENCHMARK: "
+               <<std::setw(3)<<dim<<" "
+               <<std::setw(9)<<NElements<<" "
+               <<std::setw(20)<<ntimes*NElements/time_scalar<<" "
+               <<std::setw(21)<<ntimes*NElements/time_batched<<" "
+               <<std::setw(28)<<ntimes*NElements/time_gathered<<std::endl;
+
+      std::cout<<"Expecting batched qmean == scalar qmean: ";
+      if(fabs(qmean_batched-qmean_scalar)<1.0e-12*qmean_scalar && qmean_batched==qmean_gathered)
+        std::cout<<"pass"<<std::endl;
+      else
+        std::cout<<"fail (scalar="<<qmean_scalar<<", batched="<<qmean_batched<<")"<<std::endl;
+    }
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}
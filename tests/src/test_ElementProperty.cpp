@@ -35,6 +35,8 @@
  *  SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 
 #include "ElementProperty.h"
@@ -97,6 +99,33 @@ int main(){
       std::cout<<"pass\n";
     else
       std::cout<<"fail\n";
+
+    // Compare against central differences for small and large
+    // elements, which are on either side of the kink in the functional.
+    std::cout<<"Test ElementProperty<double>::lipnikov_grad/ElementProperty<double>::lipnikov_grad_fd 2D:"<<std::endl;
+    {
+      double gx1[] = {1.1, 0.2};
+      double gx2[] = {0.3, 0.9};
+      double gm[] = {2.0, 0.5, 1.5};
+      double max_err = 0;
+      for(int k=0;k<2;k++){
+        double scale = k==0?0.5:4.0;
+        double gx0[] = {-0.1*scale, 0.05*scale};
+        double sx1[] = {scale*gx1[0], scale*gx1[1]};
+        double sx2[] = {scale*gx2[0], scale*gx2[1]};
+
+        double grad[2], grad_fd[2];
+        triangle.lipnikov_grad(gx0, sx1, sx2, gm, grad);
+        triangle.lipnikov_grad_fd(0, gx0, sx1, sx2, gm, grad_fd);
+        double mag = sqrt(grad_fd[0]*grad_fd[0] + grad_fd[1]*grad_fd[1]);
+        for(int i=0;i<2;i++)
+          max_err = std::max(max_err, fabs(grad[i]-grad_fd[i])/mag);
+      }
+      if(max_err<1.0e-6)
+        std::cout<<"pass\n";
+      else
+        std::cout<<"fail (relative error="<<max_err<<")\n";
+    }
   }
 
   // Check tetrahedra
@@ -164,6 +193,33 @@ int main(){
       std::cout<<"pass\n";
     else
       std::cout<<"fail\n";
+
+    std::cout<<"Test ElementProperty<double>::lipnikov_grad/ElementProperty<double>::lipnikov_grad_fd 3D:"<<std::endl;
+    {
+      double gx1[] = {1.1, 0.2, -0.1};
+      double gx2[] = {0.3, 0.9, 0.2};
+      double gx3[] = {0.2, 0.8, 1.2};
+      double gm[] = {2.0, 0.5, 0.1, 1.5, -0.2, 1.0};
+      double max_err = 0;
+      for(int k=0;k<2;k++){
+        double scale = k==0?0.5:4.0;
+        double gx0[] = {-0.1*scale, 0.05*scale, 0.1*scale};
+        double sx1[] = {scale*gx1[0], scale*gx1[1], scale*gx1[2]};
+        double sx2[] = {scale*gx2[0], scale*gx2[1], scale*gx2[2]};
+        double sx3[] = {scale*gx3[0], scale*gx3[1], scale*gx3[2]};
+
+        double grad[3], grad_fd[3];
+        tetrahedron.lipnikov_grad(gx0, sx1, sx2, sx3, gm, grad);
+        tetrahedron.lipnikov_grad_fd(0, gx0, sx1, sx2, sx3, gm, grad_fd);
+        double mag = sqrt(grad_fd[0]*grad_fd[0] + grad_fd[1]*grad_fd[1] + grad_fd[2]*grad_fd[2]);
+        for(int i=0;i<3;i++)
+          max_err = std::max(max_err, fabs(grad[i]-grad_fd[i])/mag);
+      }
+      if(max_err<1.0e-6)
+        std::cout<<"pass\n";
+      else
+        std::cout<<"fail (relative error="<<max_err<<")\n";
+    }
   }
 
   return 0;
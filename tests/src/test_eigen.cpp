@@ -35,9 +35,121 @@
  *  SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <random>
+
 #include <Eigen/Core>
 #include <Eigen/Dense>
 
+#include "MetricTensor.h"
+
+/* Compare MetricTensor's symmetric eigen-decomposition with Eigen's
+ * general solver on random symmetric tensors, including indefinite ones,
+ * ones with repeated eigenvalues and ones with eigenvalues ranging over
+ * many orders of magnitude.
+ */
+template<int dim> bool check_decomposition(){
+  const int msize = (dim==2?3:6);
+  std::mt19937 gen(dim);
+  std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+
+  bool pass = true;
+  for(int trial=0;trial<10000;trial++){
+    // Random orthonormal basis.
+    double Q[dim*dim];
+    for(int i=0;i<dim*dim;i++)
+      Q[i] = uniform(gen);
+    for(int k=0;k<dim;k++){
+      for(int j=0;j<k;j++){
+        double d=0;
+        for(int i=0;i<dim;i++)
+          d += Q[k*dim+i]*Q[j*dim+i];
+        for(int i=0;i<dim;i++)
+          Q[k*dim+i] -= d*Q[j*dim+i];
+      }
+      double mag=0;
+      for(int i=0;i<dim;i++)
+        mag += Q[k*dim+i]*Q[k*dim+i];
+      for(int i=0;i<dim;i++)
+        Q[k*dim+i] /= sqrt(mag);
+    }
+
+    double lambda[dim];
+    for(int i=0;i<dim;i++)
+      lambda[i] = pow(10.0, 6*uniform(gen));
+    if(trial%3==1)
+      lambda[1] = lambda[0];
+    if(trial%3==2)
+      lambda[dim-1] = -lambda[dim-1];
+
+    double m[msize];
+    MetricTensor<double,dim>::recompose(lambda, Q, m);
+
+    double D[dim], V[dim*dim];
+    MetricTensor<double,dim>::decompose(m, D, V);
+
+    Eigen::Matrix<double, dim, dim> M;
+    double norm=0;
+    for(int i=0, ii=0;i<dim;i++)
+      for(int j=i;j<dim;j++, ii++){
+        M(i, j) = M(j, i) = m[ii];
+        norm = std::max(norm, fabs(m[ii]));
+      }
+
+    // Eigenvalues agree with the general solver.
+    Eigen::EigenSolver< Eigen::Matrix<double, dim, dim> > solver(M);
+    double ref[dim], eig[dim];
+    for(int i=0;i<dim;i++){
+      ref[i] = solver.eigenvalues()[i].real();
+      eig[i] = D[i];
+    }
+    std::sort(ref, ref+dim);
+    std::sort(eig, eig+dim);
+    for(int i=0;i<dim;i++)
+      if(fabs(ref[i]-eig[i])>1.0e-12*norm)
+        pass = false;
+
+    // M*v = lambda*v and the eigenvectors are orthonormal.
+    for(int k=0;k<dim;k++){
+      for(int i=0;i<dim;i++){
+        double Mv=0;
+        for(int j=0;j<dim;j++)
+          Mv += M(i, j)*V[k*dim+j];
+        if(fabs(Mv-D[k]*V[k*dim+i])>1.0e-12*norm)
+          pass = false;
+      }
+      for(int l=0;l<dim;l++){
+        double vv=0;
+        for(int i=0;i<dim;i++)
+          vv += V[k*dim+i]*V[l*dim+i];
+        if(fabs(vv-(k==l?1.0:0.0))>1.0e-12)
+          pass = false;
+      }
+    }
+
+    // Round trip.
+    double mr[msize];
+    MetricTensor<double,dim>::recompose(D, V, mr);
+    for(int i=0;i<msize;i++)
+      if(fabs(mr[i]-m[i])>1.0e-12*norm)
+        pass = false;
+
+    // The superposition of a metric with itself is the same metric.
+    if(trial%3!=2){
+      MetricTensor<double,dim> metric(m);
+      metric.constrain(m);
+      for(int i=0;i<msize;i++)
+        if(fabs(metric.get_metric()[i]-m[i])>1.0e-8*norm)
+          pass = false;
+    }
+  }
+
+  return pass;
+}
+
 int main(){
   Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> A = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic>::Zero(6,6);
   
@@ -82,6 +194,18 @@ int main(){
     std::cout<<"pass\n";
   else
     std::cout<<"fail\n";
+
+  std::cout<<"Checking 2D symmetric eigen-decomposition: ";
+  if(check_decomposition<2>())
+    std::cout<<"pass\n";
+  else
+    std::cout<<"fail\n";
+
+  std::cout<<"Checking 3D symmetric eigen-decomposition: ";
+  if(check_decomposition<3>())
+    std::cout<<"pass\n";
+  else
+    std::cout<<"fail\n";
   
   return 0;
 }
@@ -0,0 +1,24 @@
+
+#include <cmath>
+#include <cfloat>
+#include <iostream>
+
+#include <generate_Steiner_ellipse_2d.h>
+
+int main(){
+  double x1[]={ 1,  0};
+  double x2[]={-1,  0};
+  double x3[]={ 0,  2*sqrt(3)};
+  double sm[3];
+  pragmatic::generate_Steiner_ellipse(x1, x2, x3, sm);
+
+  // Test
+  if(fabs(sm[0]-1./4)<10*DBL_EPSILON && fabs(sm[1])<10*DBL_EPSILON &&
+                                        fabs(sm[2]-1./16)<10*DBL_EPSILON){
+    std::cout<<"pass"<<std::endl;
+  }else{
+    std::cout<<"fail"<<std::endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <iostream>
+#include <set>
+#include <vector>
+
+#include <omp.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+#include "MetricTensor.h"
+#include "ticker.h"
+
+#include <mpi.h>
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box200x200.vtu");
+  mesh->create_boundary();
+
+  size_t NNodes = mesh->get_number_nodes();
+
+  // Fine anisotropic resolution in a thin strip, coarse elsewhere.
+  std::vector<double> metric(NNodes*3);
+  for(size_t i=0;i<NNodes;i++){
+    double x = mesh->get_coords(i)[0];
+    double hx=0.1, hy=0.1;
+    if(fabs(x-0.5)<0.02){
+      hx = 0.002;
+      hy = 0.05;
+    }
+    metric[i*3  ] = 1.0/(hx*hx);
+    metric[i*3+1] = 0.0;
+    metric[i*3+2] = 1.0/(hy*hy);
+  }
+
+  MetricField<double,2> metric_field(*mesh);
+  metric_field.set_metric(&(metric[0]));
+
+  double beta = 1.5;
+  double tic = get_wtime();
+  int iterations = metric_field.apply_gradation(beta);
+  double toc = get_wtime();
+
+  metric_field.update_mesh();
+  metric_field.get_metric(&(metric[0]));
+
+  // Along every edge the metric should already contain the neighbouring
+  // metric grown by the gradation factor.
+  double max_violation = 0;
+  for(size_t i=0;i<NNodes;i++){
+    if(!mesh->is_owned_node(i))
+      continue;
+
+    const double *x = mesh->get_coords(i);
+    std::set<index_t> patch = mesh->get_node_patch(i);
+    for(std::set<index_t>::const_iterator it=patch.begin();it!=patch.end();++it){
+      index_t n = *it;
+      const double *m = &(metric[n*3]);
+      const double *y = mesh->get_coords(n);
+      double e[] = {x[0]-y[0], x[1]-y[1]};
+      double l = sqrt(e[0]*(m[0]*e[0]+m[1]*e[1]) + e[1]*(m[1]*e[0]+m[2]*e[1]));
+      double eta = 1.0/pow(1.0+l*log(beta), 2);
+      double grown[] = {eta*m[0], eta*m[1], eta*m[2]};
+
+      MetricTensor<double,2> M(&(metric[i*3]));
+      M.constrain(grown);
+      double mc[3];
+      M.get_metric(mc);
+
+      double norm = std::max(fabs(metric[i*3]), fabs(metric[i*3+2]));
+      for(int j=0;j<3;j++)
+        max_violation = std::max(max_violation, fabs(mc[j]-metric[i*3+j])/norm);
+    }
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &max_violation, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+  if(rank==0){
+    std::cout<<"Gradation :: iterations = "<<iterations<<", time = "<<toc-tic<<std::endl;
+
+    std::cout<<"Expecting graded metric: ";
+    if(max_violation<1.0e-4)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (max violation="<<max_violation<<")"<<std::endl;
+  }
+
+  delete mesh;
+
+  MPI_Finalize();
+
+  return 0;
+}
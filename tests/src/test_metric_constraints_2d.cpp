@@ -0,0 +1,160 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include <omp.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+#include "MetricTensor.h"
+
+#include <mpi.h>
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box200x200.vtu");
+  mesh->create_boundary();
+
+  size_t NNodes = mesh->get_number_nodes();
+
+  std::vector<double> psi(NNodes);
+  for(size_t i=0;i<NNodes;i++){
+    double x = 2*mesh->get_coords(i)[0]-1;
+    double y = 2*mesh->get_coords(i)[1]-1;
+
+    psi[i] = 0.1*sin(50*x) + atan2(-0.1, (double)(2*x - sin(5*y)));
+  }
+
+  MetricField<double,2> metric_field(*mesh);
+  metric_field.add_field(&(psi[0]), 0.001, 2);
+
+  std::vector<double> metric(NNodes*3);
+  metric_field.get_metric(&(metric[0]));
+
+  // Apply the constraints one at a time to each tensor.
+  double max_len=0.5, min_len=0.005, max_aspect_ratio=10;
+  double M_max[] = {1.0/(max_len*max_len), 0, 1.0/(max_len*max_len)};
+  double M_min[] = {1.0/(min_len*min_len), 0, 1.0/(min_len*min_len)};
+  std::vector< MetricTensor<double,2> > reference(NNodes);
+  for(size_t i=0;i<NNodes;i++){
+    reference[i].set_metric(&(metric[i*3]));
+    reference[i].constrain(M_max);
+    reference[i].constrain(M_min, false);
+    reference[i].limit_aspect_ratio(max_aspect_ratio);
+  }
+
+  // Apply them in a single pass, followed by the element number constraint.
+  double nelements = 5000;
+  metric_field.add_constraint(MetricField<double,2>::MAX_EDGE_LENGTH, max_len);
+  metric_field.add_constraint(MetricField<double,2>::MIN_EDGE_LENGTH, min_len);
+  metric_field.add_constraint(MetricField<double,2>::MAX_ASPECT_RATIO, max_aspect_ratio);
+  metric_field.add_constraint(MetricField<double,2>::NELEMENTS, nelements);
+  metric_field.apply_constraints();
+
+  double predicted = metric_field.predict_nelements();
+
+  // The element number constraint scales the constrained field uniformly.
+  metric_field.get_metric(&(metric[0]));
+  double scale = 0;
+  for(size_t i=0;i<NNodes;i++){
+    double m[3];
+    reference[i].get_metric(m);
+    scale = std::max(scale, metric[i*3]/m[0]);
+  }
+
+  double max_error = 0;
+  for(size_t i=0;i<NNodes;i++){
+    double m[3];
+    reference[i].get_metric(m);
+    double norm = fabs(m[0])+fabs(m[1])+fabs(m[2]);
+    for(int j=0;j<3;j++)
+      max_error = std::max(max_error, fabs(metric[i*3+j]-scale*m[j])/(scale*norm));
+  }
+
+  std::cout<<"Expecting single pass constraints to match MetricTensor: ";
+  if(max_error<1.0e-8)
+    std::cout<<"pass"<<std::endl;
+  else
+    std::cout<<"fail (max error="<<max_error<<")"<<std::endl;
+
+  std::cout<<"Expecting predicted number of elements == "<<nelements<<": ";
+  if(fabs(predicted-nelements)<1.0e-6*nelements)
+    std::cout<<"pass"<<std::endl;
+  else
+    std::cout<<"fail (predicted="<<predicted<<")"<<std::endl;
+
+  // A per-vertex constraint field is copied, so it can be released
+  // before the constraints are applied.
+  metric_field.clear_constraints();
+  {
+    std::vector<double> len(NNodes);
+    for(size_t i=0;i<NNodes;i++)
+      len[i] = 0.002+0.002*mesh->get_coords(i)[0];
+    metric_field.add_constraint(MetricField<double,2>::MAX_EDGE_LENGTH, 0, &(len[0]));
+  }
+  metric_field.apply_constraints();
+
+  metric_field.get_metric(&(metric[0]));
+  int nerrors = 0;
+  for(size_t i=0;i<NNodes;i++){
+    double len = 0.002+0.002*mesh->get_coords(i)[0];
+    double a=metric[i*3], b=metric[i*3+1], c=metric[i*3+2];
+    double min_eigenvalue = 0.5*(a+c)-sqrt(0.25*(a-c)*(a-c)+b*b);
+    if(min_eigenvalue*len*len<1-1.0e-6)
+      nerrors++;
+  }
+
+  std::cout<<"Expecting per-vertex maximum edge length to be applied: ";
+  if(nerrors==0)
+    std::cout<<"pass"<<std::endl;
+  else
+    std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+
+  delete mesh;
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,147 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include <omp.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+#include "MetricTensor.h"
+
+#include <mpi.h>
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box200x200.vtu");
+  mesh->create_boundary();
+
+  size_t NNodes = mesh->get_number_nodes();
+
+  // Accumulate the metric of a moving front over a window of time levels.
+  const int nsamples = 5;
+  double eta = 0.01;
+
+  MetricField<double,2> window(*mesh);
+  MetricField<double,2> intersected(*mesh);
+  std::vector< std::vector<double> > samples(nsamples, std::vector<double>(NNodes*3));
+  std::vector<double> psi(NNodes);
+  for(int t=0;t<nsamples;t++){
+    for(size_t i=0;i<NNodes;i++){
+      double x = mesh->get_coords(i)[0];
+      double y = mesh->get_coords(i)[1];
+      psi[i] = tanh(50*(x - 0.3 - 0.1*t + 0.1*sin(6*y)));
+    }
+
+    window.add_field(&(psi[0]), eta);
+
+    MetricField<double,2> sample(*mesh);
+    sample.add_field(&(psi[0]), eta);
+    sample.get_metric(&(samples[t][0]));
+
+    intersected.intersect_metric(&(samples[t][0]));
+  }
+
+  std::vector<double> metric(NNodes*3), metric_intersected(NNodes*3);
+  window.get_metric(&(metric[0]));
+  intersected.get_metric(&(metric_intersected[0]));
+
+  // The windowed metric should resolve every time level. The two ways of
+  // accumulating it are compared relative to the largest tensor, as
+  // intersecting nearly singular tensors is sensitive to round-off.
+  double max_norm = 0;
+  for(size_t i=0;i<NNodes;i++)
+    max_norm = std::max(max_norm, std::max(fabs(metric[i*3]), fabs(metric[i*3+2])));
+
+  double max_violation = 0, max_diff = 0;
+  for(size_t i=0;i<NNodes;i++){
+    double norm = std::max(fabs(metric[i*3]), fabs(metric[i*3+2]));
+    for(int t=0;t<nsamples;t++){
+      MetricTensor<double,2> M(&(metric[i*3]));
+      M.constrain(&(samples[t][i*3]));
+      double m[3];
+      M.get_metric(m);
+      for(int j=0;j<3;j++)
+        max_violation = std::max(max_violation, fabs(m[j]-metric[i*3+j])/norm);
+    }
+    for(int j=0;j<3;j++)
+      max_diff = std::max(max_diff, fabs(metric_intersected[i*3+j]-metric[i*3+j])/max_norm);
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &max_violation, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, &max_diff, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+  // Control the size of the mesh for the whole window.
+  double nelements = 20000;
+  window.apply_nelements(nelements);
+  double predicted = window.predict_nelements();
+
+  if(rank==0){
+    std::cout<<"Expecting windowed metric to contain every time level: ";
+    if(max_violation<1.0e-8)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (max violation="<<max_violation<<")"<<std::endl;
+
+    std::cout<<"Expecting intersect_metric == add_field for each time level: ";
+    if(max_diff<1.0e-8)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (max difference="<<max_diff<<")"<<std::endl;
+
+    std::cout<<"Expecting predicted number of elements == "<<nelements<<": ";
+    if(fabs(predicted-nelements)<1.0e-6*nelements)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (predicted="<<predicted<<")"<<std::endl;
+  }
+
+  delete mesh;
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include <mpi.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+
+#include "Refine.h"
+
+double f(const double *x){
+  return sin(3*x[0])+cos(5*x[1]);
+}
+
+// Set the owned values, exchange the halo with two exchanges in flight
+// at once, and count the vertices with wrong values.
+int check_halo(Mesh<double> *mesh, int rank){
+  size_t NNodes = mesh->get_number_nodes();
+
+  std::vector<double> psi(NNodes*2, -1.0);
+  std::vector<int> owner(NNodes, -1);
+  for(size_t i=0;i<NNodes;i++){
+    if(mesh->is_owned_node(i)){
+      psi[i*2] = f(mesh->get_coords(i));
+      psi[i*2+1] = -f(mesh->get_coords(i));
+      owner[i] = rank;
+    }
+  }
+
+  HaloExchanger &halo = mesh->get_halo_exchanger();
+  halo.begin<double, 2>(psi);
+  halo.begin<int, 1>(owner);
+  halo.end<int, 1>(owner);
+  halo.end<double, 2>(psi);
+
+  int nerrors=0;
+  for(size_t i=0;i<NNodes;i++){
+    if(mesh->get_number_elements()>0 && mesh->get_node_patch(i).empty())
+      continue;
+
+    if(fabs(psi[i*2]-f(mesh->get_coords(i)))>0 || fabs(psi[i*2+1]+f(mesh->get_coords(i)))>0)
+      nerrors++;
+    if(mesh->is_owned_node(i)?(owner[i]!=rank):(owner[i]<0 || owner[i]==rank))
+      nerrors++;
+  }
+
+  MPI_Allreduce(MPI_IN_PLACE, &nerrors, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  return nerrors;
+}
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box10x10.vtu");
+  mesh->create_boundary();
+
+  int nerrors = check_halo(mesh, rank);
+  if(rank==0){
+    std::cout<<"Expecting halo values to match owned values: ";
+    if(nerrors==0)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+  }
+
+  // Refinement changes the halo, so the exchanger has to be rebuilt.
+  MetricField<double,2> metric_field(*mesh);
+
+  size_t NNodes = mesh->get_number_nodes();
+  for(size_t i=0;i<NNodes;i++){
+    double m[] = {100.0, 0.0, 100.0};
+    metric_field.set_metric(m, i);
+  }
+  metric_field.update_mesh();
+
+  Refine<double,2> adapt(*mesh);
+  for(int i=0;i<2;i++)
+    adapt.refine(sqrt(2.0));
+  mesh->defragment();
+
+  nerrors = check_halo(mesh, rank);
+  if(rank==0){
+    std::cout<<"Expecting halo values to match owned values after refinement: ";
+    if(nerrors==0)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+  }
+
+  // Neighbours on the same node are exchanged through shared memory by
+  // default; the message path has to give the same values.
+  mesh->get_halo_exchanger().set_shared_memory(false);
+  nerrors = check_halo(mesh, rank);
+  if(rank==0){
+    std::cout<<"Expecting halo values to match owned values without shared memory: ";
+    if(nerrors==0)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+  }
+
+  // Release the shared memory collectively; the halo is then exchanged
+  // through messages.
+  mesh->get_halo_exchanger().set_shared_memory(true);
+  mesh->free_halo_exchanger();
+  nerrors = check_halo(mesh, rank);
+  if(rank==0){
+    std::cout<<"Expecting halo values to match owned values after releasing shared memory: ";
+    if(nerrors==0)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+  }
+
+  delete mesh;
+
+  // Destroying a mesh whose shared memory is still in use is not
+  // collective, so the processes can do it at different times.
+  mesh=VTKTools<double>::import_vtu("../data/box10x10.vtu");
+  nerrors = check_halo(mesh, rank);
+  if(rank%2==0)
+    delete mesh;
+  MPI_Barrier(MPI_COMM_WORLD);
+  if(rank%2==1)
+    delete mesh;
+
+  if(rank==0){
+    std::cout<<"Expecting a mesh to be destroyed on some processes first: ";
+    if(nerrors==0)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}
@@ -0,0 +1,188 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include <mpi.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+
+#include "Refine.h"
+
+double f(const double *x){
+  return sin(3*x[0])+cos(5*x[1]);
+}
+
+// Ratio of the maximum to the mean number of elements around owned vertices.
+double imbalance(Mesh<double> *mesh){
+  double load=0;
+  int NElements = mesh->get_number_elements();
+  for(int i=0;i<NElements;i++){
+    const int *n = mesh->get_element(i);
+    if(n[0]<0)
+      continue;
+
+    for(int j=0;j<3;j++)
+      if(mesh->is_owned_node(n[j]))
+        load++;
+  }
+
+  double max_load, mean_load;
+  MPI_Allreduce(&load, &max_load, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  MPI_Allreduce(&load, &mean_load, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+  int nprocs;
+  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+
+  return max_load/(mean_load/nprocs);
+}
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box20x20.vtu");
+  mesh->create_boundary();
+
+  // Refine next to x=0 so that the first partitions are overloaded.
+  MetricField<double,2> metric_field(*mesh);
+
+  size_t NNodes = mesh->get_number_nodes();
+  for(size_t i=0;i<NNodes;i++){
+    double h = mesh->get_coords(i)[0]<0.3?0.01:0.05;
+    double m[] = {1.0/(h*h), 0.0, 1.0/(h*h)};
+    metric_field.set_metric(m, i);
+  }
+  metric_field.update_mesh();
+
+  Refine<double,2> adapt(*mesh);
+  for(int i=0;i<3;i++)
+    adapt.refine(sqrt(2.0));
+  mesh->defragment();
+
+  double imbalance_before = imbalance(mesh);
+
+  // Vertex fields with one and two values per vertex.
+  NNodes = mesh->get_number_nodes();
+  std::vector< std::vector<double> > fields(2);
+  fields[0].resize(NNodes);
+  fields[1].resize(NNodes*2);
+  for(size_t i=0;i<NNodes;i++){
+    fields[0][i] = f(mesh->get_coords(i));
+    fields[1][i*2] = mesh->get_coords(i)[0];
+    fields[1][i*2+1] = mesh->get_coords(i)[1];
+  }
+
+  mesh->rebalance(1.1, &fields);
+
+  double imbalance_after = imbalance(mesh);
+
+  if(!mesh->verify()){
+    std::cout<<"ERROR(rank="<<rank<<"): Verification failed after rebalancing.\n";
+  }
+
+  // The fields must have moved with their vertices, and the halo must
+  // be consistent with the new owners.
+  NNodes = mesh->get_number_nodes();
+  int nerrors=0;
+  if(fields[0].size()!=NNodes || fields[1].size()!=NNodes*2){
+    nerrors++;
+  }else{
+    std::vector<double> psi(NNodes, -1.0);
+    for(size_t i=0;i<NNodes;i++){
+      if(fabs(fields[0][i]-f(mesh->get_coords(i)))>0 ||
+         fabs(fields[1][i*2]-mesh->get_coords(i)[0])>0 ||
+         fabs(fields[1][i*2+1]-mesh->get_coords(i)[1])>0)
+        nerrors++;
+      if(mesh->is_owned_node(i))
+        psi[i] = f(mesh->get_coords(i));
+    }
+    mesh->halo_update<double, 1>(psi);
+    for(size_t i=0;i<NNodes;i++){
+      if(fabs(psi[i]-f(mesh->get_coords(i)))>0)
+        nerrors++;
+    }
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &nerrors, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  long double perimeter = mesh->calculate_perimeter();
+  long double area = mesh->calculate_area();
+
+  delete mesh;
+
+  if(rank==0){
+    std::cout<<"Imbalance before and after rebalancing = "<<imbalance_before<<", "<<imbalance_after<<std::endl;
+
+    std::cout<<"Expecting imbalance <= 1.1: ";
+    if(imbalance_after<=1.1)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail"<<std::endl;
+
+    std::cout<<"Expecting fields and halo to follow the vertices: ";
+    if(nerrors==0)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+
+    std::cout<<"Expecting perimeter == 4: ";
+    if(fabs(perimeter-4)<=4*DBL_EPSILON)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (perimeter="<<perimeter<<")"<<std::endl;
+
+    std::cout<<"Expecting area == 1: ";
+    if(fabs(area-1)<=DBL_EPSILON)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail (area="<<area<<")"<<std::endl;
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}
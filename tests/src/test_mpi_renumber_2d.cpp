@@ -0,0 +1,137 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include <mpi.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+
+#include "Refine.h"
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank, nprocs;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &nprocs);
+
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box20x20.vtu");
+  mesh->create_boundary();
+
+  MetricField<double,2> metric_field(*mesh);
+
+  size_t NNodes = mesh->get_number_nodes();
+  for(size_t i=0;i<NNodes;i++){
+    double h = 0.02+0.05*mesh->get_coords(i)[1];
+    double m[] = {1.0/(h*h), 0.0, 1.0/(h*h)};
+    metric_field.set_metric(m, i);
+  }
+  metric_field.update_mesh();
+
+  Refine<double,2> adapt(*mesh);
+  for(int i=0;i<2;i++)
+    adapt.refine(sqrt(2.0));
+  mesh->defragment();
+
+  std::vector<int> NPNodes, lnn2gnn;
+  mesh->get_global_node_numbering(NPNodes, lnn2gnn);
+
+  NNodes = mesh->get_number_nodes();
+  int offset=0;
+  for(int p=0;p<rank;p++)
+    offset += NPNodes[p];
+  int NGNodes=0;
+  for(int p=0;p<nprocs;p++)
+    NGNodes += NPNodes[p];
+
+  // Owned vertices are numbered contiguously from the offset of this
+  // process, and every global number is used exactly once.
+  int nerrors=0;
+  std::vector<int> used(NGNodes, 0);
+  for(size_t i=0;i<NNodes;i++){
+    if(lnn2gnn[i]<0 || lnn2gnn[i]>=NGNodes){
+      nerrors++;
+      continue;
+    }
+    if(mesh->is_owned_node(i)){
+      if(lnn2gnn[i]<offset || lnn2gnn[i]>=offset+NPNodes[rank])
+        nerrors++;
+      used[lnn2gnn[i]]++;
+    }
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &(used[0]), NGNodes, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+  for(int i=0;i<NGNodes;i++)
+    if(used[i]!=1)
+      nerrors++;
+
+  // The halo copies must carry the numbers given by their owners.
+  std::vector<int> gnn(NNodes, -1);
+  for(size_t i=0;i<NNodes;i++)
+    if(mesh->is_owned_node(i))
+      gnn[i] = lnn2gnn[i];
+  mesh->halo_update<int, 1>(gnn);
+  for(size_t i=0;i<NNodes;i++)
+    if(gnn[i]!=lnn2gnn[i])
+      nerrors++;
+
+  if(!mesh->verify())
+    nerrors++;
+
+  MPI_Allreduce(MPI_IN_PLACE, &nerrors, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+  delete mesh;
+
+  if(rank==0){
+    std::cout<<"Expecting a contiguous global numbering: ";
+    if(nerrors==0)
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<nerrors<<" errors)"<<std::endl;
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}
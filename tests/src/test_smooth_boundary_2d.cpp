@@ -0,0 +1,150 @@
+/*  Copyright (C) 2010 Imperial College London and others.
+ *
+ *  Please see the AUTHORS file in the main source directory for a
+ *  full list of copyright holders.
+ *
+ *  Gerard Gorman
+ *  Applied Modelling and Computation Group
+ *  Department of Earth Science and Engineering
+ *  Imperial College London
+ *
+ *  g.gorman@imperial.ac.uk
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *  1. Redistributions of source code must retain the above copyright
+ *  notice, this list of conditions and the following disclaimer.
+ *  2. Redistributions in binary form must reproduce the above
+ *  copyright notice, this list of conditions and the following
+ *  disclaimer in the documentation and/or other materials provided
+ *  with the distribution.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *  CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *  INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS
+ *  BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ *  EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ *  TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ *  ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ *  TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ *  THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ *  SUCH DAMAGE.
+ */
+
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <omp.h>
+
+#include "Mesh.h"
+#include "VTKTools.h"
+#include "MetricField.h"
+
+#include "Smooth.h"
+#include "ticker.h"
+
+#include <mpi.h>
+
+Mesh<double> *create_mesh(){
+  Mesh<double> *mesh=VTKTools<double>::import_vtu("../data/box50x50.vtu");
+  mesh->create_boundary();
+
+  MetricField<double,2> metric_field(*mesh);
+
+  size_t NNodes = mesh->get_number_nodes();
+
+  // The resolution varies along the boundary as well as across it, so the
+  // boundary vertices are badly placed.
+  double h1 = 1.0/100;
+  double h0 = 10.0/50;
+  for(size_t i=0;i<NNodes;i++){
+    double x = mesh->get_coords(i)[0];
+    double y = mesh->get_coords(i)[1];
+
+    double hx = h1 + (h0-h1)*x*y;
+    double m[] = {1.0/pow(hx, 2), 0, 1.0/pow(hx, 2)};
+
+    metric_field.set_metric(m, i);
+  }
+  metric_field.update_mesh();
+
+  return mesh;
+}
+
+int main(int argc, char **argv){
+  int required_thread_support=MPI_THREAD_SINGLE;
+  int provided_thread_support;
+  MPI_Init_thread(&argc, &argv, required_thread_support, &provided_thread_support);
+  assert(required_thread_support==provided_thread_support);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  bool verbose = false;
+  if(argc>1){
+    verbose = std::string(argv[1])=="-v";
+  }
+
+  // Smooth with the boundary vertices fixed and then sliding.
+  double qmin[2];
+  for(int boundary=0;boundary<2;boundary++){
+    Mesh<double> *mesh=create_mesh();
+
+    Smooth<double, 2> smooth(*mesh);
+    smooth.set_boundary_smoothing(boundary==1);
+
+    double tic = get_wtime();
+    smooth.smart_laplacian(2000);
+    smooth.optimisation_linf(2000);
+    double toc = get_wtime();
+
+    qmin[boundary] = mesh->get_qmin();
+    double qmean = mesh->get_qmean();
+
+    long double perimeter = mesh->calculate_perimeter();
+    long double area = mesh->calculate_area();
+
+    if(verbose && rank==0)
+      std::cout<<"Smooth time (boundary="<<boundary<<")  "<<toc-tic<<std::endl
+               <<"Quality mean:     "<<qmean<<std::endl
+               <<"Quality min:      "<<qmin[boundary]<<std::endl;
+
+    if(boundary==1)
+      VTKTools<double>::export_vtu("../data/test_smooth_boundary_2d", mesh);
+
+    delete mesh;
+
+    if(rank==0){
+      std::cout<<"Checking perimeter == 4: ";
+      if(fabs(perimeter-4)<4*DBL_EPSILON)
+        std::cout<<"pass"<<std::endl;
+      else
+        std::cout<<"fail ("<<perimeter<<")"<<std::endl;
+
+      std::cout<<"Checking area == 1: ";
+      if(fabs(area-1)<DBL_EPSILON)
+        std::cout<<"pass"<<std::endl;
+      else
+        std::cout<<"fail ("<<area<<")"<<std::endl;
+    }
+  }
+
+  if(rank==0){
+    std::cout<<"Checking boundary smoothing improves the minimum quality: ";
+    if(qmin[1]>qmin[0])
+      std::cout<<"pass"<<std::endl;
+    else
+      std::cout<<"fail ("<<qmin[1]<<" <= "<<qmin[0]<<")"<<std::endl;
+  }
+
+  MPI_Finalize();
+
+  return 0;
+}